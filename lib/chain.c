@@ -0,0 +1,116 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+
+static void jgfs_chain_grow(struct jgfs_chain *chain) {
+	if (chain->len == chain->cap) {
+		chain->cap   = (chain->cap == 0 ? 16 : chain->cap * 2);
+		chain->clust = realloc(chain->clust, chain->cap * sizeof(fat_ent_t));
+		
+		if (chain->clust == NULL) {
+			err(1, "jgfs_chain_grow: realloc failed");
+		}
+	}
+}
+
+fat_ent_t jgfs_chain_follow(struct jgfs_chain *chain, fat_ent_t begin,
+	uint16_t n, uint16_t *len) {
+	uint16_t at = 0;
+	fat_ent_t this = begin;
+	
+	/* what has been copied is read from the copy; a chain that has grown
+	 * since carries on from its last cluster copied */
+	if (chain != NULL && chain->len != 0) {
+		if (n < chain->len) {
+			return chain->clust[n];
+		}
+		
+		at   = chain->len - 1;
+		this = chain->clust[at];
+	}
+	
+	uint16_t limit = jgfs_fs_clusters();
+	while (this != FAT_EOF) {
+		/* this means the filesystem is inconsistent */
+		if (this > FAT_LAST || at == limit) {
+			warnx("jgfs_chain_follow: bad clust chain at %#06" PRIx16, begin);
+			this = FAT_EOF;
+			break;
+		}
+		
+		if (chain != NULL && at == chain->len) {
+			jgfs_chain_grow(chain);
+			chain->clust[chain->len++] = this;
+		}
+		
+		if (at == n) {
+			break;
+		}
+		
+		++at;
+		this = jgfs_fat_read(this);
+	}
+	
+	if (len != NULL) {
+		*len = at;
+	}
+	
+	return this;
+}
+
+void jgfs_chain_cut(struct jgfs_chain *chain, uint16_t len) {
+	if (len < chain->len) {
+		chain->len = len;
+	}
+}
+
+void jgfs_chain_free(struct jgfs_chain *chain) {
+	free(chain->clust);
+	
+	chain->clust = NULL;
+	chain->len   = 0;
+	chain->cap   = 0;
+}
+
+/* a file's chain is copied by its open file, and a directory's by its name
+ * index, for as long as they are kept; anything else is followed along the fat
+ * each time */
+static fat_ent_t jgfs_chain_lookup(struct jgfs_dir_ent *dir_ent, uint16_t n,
+	uint16_t *len) {
+	if (dir_ent->begin == FAT_NALLOC) {
+		if (len != NULL) {
+			*len = 0;
+		}
+		
+		return FAT_EOF;
+	}
+	
+	fat_ent_t addr;
+	if (dir_ent->type == TYPE_DIR) {
+		addr = jgfs_dindex_chain(dir_ent, n, len);
+	} else if (!jgfs_file_chain(dir_ent, n, &addr, len)) {
+		addr = jgfs_chain_follow(NULL, dir_ent->begin, n, len);
+	}
+	
+	return addr;
+}
+
+fat_ent_t jgfs_chain_get(struct jgfs_dir_ent *dir_ent, uint16_t n) {
+	return jgfs_chain_lookup(dir_ent, n, NULL);
+}
+
+uint16_t jgfs_chain_len(struct jgfs_dir_ent *dir_ent) {
+	uint16_t len;
+	jgfs_chain_lookup(dir_ent, UINT16_MAX, &len);
+	
+	return len;
+}
@@ -0,0 +1,166 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* number of slots in the (direct-mapped) path cache; must be a power of two */
+#define DCACHE_SLOTS 4096
+
+
+/* cached result of resolving a path: the location of its dir ent (the first
+ * cluster of the directory holding it and its number there), or the fact that
+ * it doesn't exist */
+struct jgfs_dcache_ent {
+	char     *path; // NULL if this slot is unused
+	uint32_t  hash;
+	fat_ent_t dir;  // FAT_NALLOC for a negative entry
+	uint32_t  idx;
+	uint32_t  gen;  // generation the entry was made in
+};
+
+
+static struct jgfs_dcache_ent dcache[DCACHE_SLOTS];
+
+/* bumping tree_gen invalidates all positive entries (directories were moved or
+ * removed, so paths through them may have changed); bumping neg_gen invalidates
+ * all negative entries (a name came into existence somewhere) */
+static uint32_t tree_gen = 0;
+static uint32_t neg_gen  = 0;
+
+static struct jgfs_dcache_stats dcache_stats;
+
+/* guards all of the above; positive entries can't go stale while it is held,
+ * since directories are only moved or removed under the exclusive namespace
+ * lock, and callers put negative entries while still holding the lock on the
+ * directory they looked in, so no create can slip in between */
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static struct jgfs_dcache_ent *jgfs_dcache_slot(const char *path, size_t len,
+	uint32_t *hash) {
+	*hash = jgfs_hash(path, len);
+	
+	return &dcache[*hash & (DCACHE_SLOTS - 1)];
+}
+
+static enum jgfs_dcache_result jgfs_dcache_get_locked(const char *path,
+	size_t len, fat_ent_t *dir, uint32_t *idx) {
+	uint32_t hash;
+	struct jgfs_dcache_ent *ent = jgfs_dcache_slot(path, len, &hash);
+	
+	if (ent->path == NULL || ent->hash != hash ||
+		strncmp(ent->path, path, len) != 0 || ent->path[len] != '\0') {
+		++dcache_stats.misses;
+		return DCACHE_MISS;
+	}
+	
+	if (ent->dir == FAT_NALLOC) {
+		if (ent->gen != neg_gen) {
+			++dcache_stats.stale;
+			return DCACHE_MISS;
+		}
+		
+		++dcache_stats.neg_hits;
+		return DCACHE_NEG;
+	}
+	
+	if (ent->gen != tree_gen) {
+		++dcache_stats.stale;
+		return DCACHE_MISS;
+	}
+	
+	/* the dir ent may since have been renamed or deleted in place (or its
+	 * directory shrunk), so make sure it still has the last component of the
+	 * path as its name */
+	const char *name = path + len;
+	while (name > path && name[-1] != '/') {
+		--name;
+	}
+	
+	struct jgfs_dir_ent *dir_ent = jgfs_dir_get(ent->dir, ent->idx);
+	
+	size_t name_len = (path + len) - name;
+	if (dir_ent == NULL || name_len > JGFS_NAME_LIMIT ||
+		strncmp(dir_ent->name, name, name_len) != 0 ||
+		dir_ent->name[name_len] != '\0') {
+		++dcache_stats.stale;
+		return DCACHE_MISS;
+	}
+	
+	*dir = ent->dir;
+	*idx = ent->idx;
+	
+	++dcache_stats.hits;
+	return DCACHE_HIT;
+}
+
+enum jgfs_dcache_result jgfs_dcache_get(const char *path, size_t len,
+	fat_ent_t *dir, uint32_t *idx) {
+	pthread_mutex_lock(&dcache_lock);
+	
+	enum jgfs_dcache_result result =
+		jgfs_dcache_get_locked(path, len, dir, idx);
+	
+	pthread_mutex_unlock(&dcache_lock);
+	
+	return result;
+}
+
+void jgfs_dcache_put(const char *path, size_t len, fat_ent_t dir,
+	uint32_t idx) {
+	pthread_mutex_lock(&dcache_lock);
+	
+	uint32_t hash;
+	struct jgfs_dcache_ent *ent = jgfs_dcache_slot(path, len, &hash);
+	
+	free(ent->path);
+	if ((ent->path = strndup(path, len)) == NULL) {
+		err(1, "jgfs_dcache_put: strndup failed");
+	}
+	
+	ent->hash = hash;
+	ent->dir  = dir;
+	ent->idx  = idx;
+	ent->gen  = (dir == FAT_NALLOC ? neg_gen : tree_gen);
+	
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void jgfs_dcache_inval_neg(void) {
+	pthread_mutex_lock(&dcache_lock);
+	++neg_gen;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void jgfs_dcache_inval_tree(void) {
+	pthread_mutex_lock(&dcache_lock);
+	++tree_gen;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void jgfs_dcache_stats(struct jgfs_dcache_stats *stats) {
+	pthread_mutex_lock(&dcache_lock);
+	*stats = dcache_stats;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void jgfs_dcache_clear(void) {
+	pthread_mutex_lock(&dcache_lock);
+	
+	for (struct jgfs_dcache_ent *ent = dcache; ent < dcache + DCACHE_SLOTS;
+		++ent) {
+		free(ent->path);
+		ent->path = NULL;
+	}
+	
+	pthread_mutex_unlock(&dcache_lock);
+}
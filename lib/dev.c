@@ -0,0 +1,1795 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+/* number of locks that pages being read in are hashed onto */
+#define LOAD_STRIPES 64
+
+/* number of io_uring rings, each carrying one batch at a time, and the size of
+ * each; a batch bigger than a ring goes through it in turns */
+#define URING_RINGS   4
+#define URING_ENTRIES 64
+
+/* the most bytes a single read or write in a ring is given */
+#define URING_IO_MAX (1U << 30)
+
+/* size of the pieces the windowed backend maps the device in (rounded down to
+ * whole clusters); small enough that the default cache limit holds a good
+ * number of them, and that the window a directory pins doesn't tie up much
+ * else */
+#define WINDOW_SIZE (4 << 20)
+
+/* the most chunks the pool of buffers grows to, each as big as all of those
+ * before it */
+#define POOL_CHUNKS 32
+
+
+/* device backends: the mmap backend maps the whole device at once, while the
+ * rest keep a cache of it in pages that each lie somewhere of their own in
+ * memory; either way, a pointer into the device's memory stays good for as
+ * long as its page stays loaded */
+struct jgfs_dev_ops {
+	/* take on the device on fd, of size bytes (false if the backend can't be
+	 * had here, so that the pread backend is used instead) */
+	bool  (*open)(int fd, uint64_t size);
+	/* release the device's memory */
+	void  (*close)(void);
+	/* lay the cache out by the filesystem's clusters, of clust_size bytes,
+	 * which start meta bytes into the device, up to len bytes into it (NULL
+	 * for the mmap backend, which has no cache) */
+	void  (*layout)(uint64_t meta, uint32_t clust_size, uint64_t len);
+	/* make the span of the device at off present in memory, keeping it there
+	 * until unmount if pin is set (NULL if it always is) */
+	void  (*load)(uint64_t off, uint64_t len, bool pin);
+	/* make the spans of the iovecs present at once (NULL to load them one at a
+	 * time) */
+	void  (*load_iov)(const struct iovec *iov, int iov_count);
+	/* make count whole pages of the cache starting at page present without
+	 * reading them, as they are about to be written over (NULL to load them
+	 * instead) */
+	void  (*claim)(uint64_t page, uint64_t count);
+	/* start bringing the span at off into memory, without waiting for it
+	 * (NULL to have the kernel read it ahead from the fd) */
+	void  (*prefetch)(uint64_t off, uint64_t len);
+	/* hand the changes in the span at off to the device fd (NULL if the fd
+	 * sees them already); returns posix error code on failure */
+	int   (*write)(uint64_t off, uint64_t len);
+	/* make everything handed to the fd and written back durable; returns
+	 * posix error code on failure */
+	int   (*barrier)(void);
+	/* write spans back, as jgfs_dev_flush (NULL to go through write, then
+	 * sync_file_range, then barrier) */
+	int   (*flush)(const struct jgfs_flush *flush, size_t count,
+		bool barrier);
+	/* give back memory, if over the limit */
+	void  (*trim)(void);
+	/* give a page of the cache its memory, returning it, or take the memory
+	 * back (for the backends built on the cache) */
+	char *(*place)(uint64_t page);
+	void  (*evict)(uint64_t page, char *mem);
+	/* read a page of the cache into its memory (NULL if placing it was
+	 * enough) */
+	void  (*fill)(uint64_t page);
+	/* whether the fd can be read and written directly, with the memory
+	 * following along */
+	bool  direct;
+};
+
+
+/* a ring and the mappings shared with the kernel that make it up */
+struct jgfs_uring {
+	pthread_mutex_t      lock;
+	int                  fd;
+	bool                 fixed; // the device fd is registered as file 0
+	unsigned             entries;
+	
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+	
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+	
+	void                *sq_map;
+	void                *cq_map; // the same as sq_map, if the kernel allows
+	size_t               sq_map_len;
+	size_t               cq_map_len;
+	size_t               sqes_len;
+};
+
+/* an i/o to put through a ring */
+struct jgfs_uring_io {
+	uint8_t  opcode; // IORING_OP_READ, _WRITE, _FSYNC or _SYNC_FILE_RANGE
+	bool     drain;  // wait for everything before it in the batch
+	uint64_t off;
+	uint32_t len;
+	char    *mem;    // where a read or write goes in memory
+	int      res;    // bytes transferred, or negative posix error code
+};
+
+/* a chunk of the pool of buffers, and the page each of its buffers is given
+ * to */
+struct jgfs_chunk {
+	char     *mem;
+	uint64_t *page;
+	uint32_t  first; // number of its first buffer
+	uint32_t  count;
+};
+
+
+static enum jgfs_dev_type         dev_type = DEV_AUTO;
+static const struct jgfs_dev_ops *dev      = NULL;
+
+/* the device starts at dev_base in memory, which holds base_len bytes of it:
+ * all of it for the mmap backend, or the first page of the cache */
+static int      dev_fd   = -1;
+static char    *dev_base = NULL;
+static uint64_t base_len = 0;
+static uint64_t dev_size = 0;
+
+/* set by a failed read from the device, and reported by the next fsync */
+static bool dev_error = false;
+
+/* where a thread probing the device's memory jumps back to if a page of it
+ * can't be read in (which the kernel reports with SIGBUS), and the address that
+ * faulted; and how SIGBUS was handled before */
+static __thread sigjmp_buf *volatile fault_jmp = NULL;
+static __thread char       *volatile fault_addr;
+static struct sigaction               fault_old;
+
+/* whether what is pinned is also locked into memory (until locking fails), and
+ * how many bytes have been; for the mmap backend, with a bit per page of the
+ * system for whether it has been; lock_wanted stays as it was asked for */
+static bool      lock_pinned = false;
+static bool      lock_wanted = false;
+static uint64_t *lock_map    = NULL;
+static uint64_t  lock_bytes  = 0;
+
+/* the cache behind every backend but mmap: the device is cut into pages, the
+ * first holding everything before the filesystem's clusters and the rest
+ * holding whole clusters each; a page is given memory of its own when it is
+ * first wanted, which the pread and uring backends read it into, while the
+ * windowed backend maps that window of the device there; each page has a bit
+ * for whether it is loaded, recently used (for the clock) or failed to read,
+ * and a count of its sectors that are pinned (the header, the fat and
+ * directories), which keeps it from being evicted while there are any */
+static uint64_t  cache_limit = 64 << 20;
+static uint64_t  cache_len; // bytes of the device the pages cover
+static uint64_t  meta_len;  // bytes of the first page
+static uint64_t  unit_len;  // bytes of every other page
+static uint64_t  page_count;
+static char    **page_mem    = NULL; // memory of each page, or NULL
+static uint64_t *page_loaded = NULL;
+static uint64_t *page_refd   = NULL;
+static uint64_t *page_bad    = NULL; // loaded, but failed to read
+static uint32_t *page_pins   = NULL;
+static uint64_t *sect_pinned = NULL;
+static uint64_t  page_hand   = 0;
+static uint64_t  cache_pages = 0; // with memory, and not pinned
+
+/* the pool of buffers of slot_len bytes that pages other than the first are
+ * read or mapped into, in chunks that are added as more are in use at once than
+ * ever before, with a stack of those that are free */
+static struct jgfs_chunk pool[POOL_CHUNKS];
+static unsigned          pool_chunks = 0;
+static size_t            slot_len;
+static int               slot_prot;
+static uint32_t         *slot_free  = NULL;
+static uint32_t          free_count = 0;
+static pthread_mutex_t   pool_lock  = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t load_locks[LOAD_STRIPES] = {
+	[0 ... LOAD_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct jgfs_uring rings[URING_RINGS];
+static int               ring_count = 0;
+static unsigned          ring_next  = 0;
+
+
+static bool jgfs_page_test(const uint64_t *bits, uint64_t page) {
+	return ((__atomic_load_n(bits + (page / 64), __ATOMIC_ACQUIRE) &
+		(1ULL << (page % 64))) != 0);
+}
+
+static void jgfs_page_set(uint64_t *bits, uint64_t page, bool set) {
+	if (set) {
+		__atomic_fetch_or(bits + (page / 64), 1ULL << (page % 64),
+			__ATOMIC_RELEASE);
+	} else {
+		__atomic_fetch_and(bits + (page / 64), ~(1ULL << (page % 64)),
+			__ATOMIC_RELEASE);
+	}
+}
+
+
+static bool jgfs_mmap_open(int fd, uint64_t size) {
+	if ((dev_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		0)) == MAP_FAILED) {
+		err(1, "mmap failed");
+	}
+	base_len = size;
+	
+	return true;
+}
+
+/* start the kernel reading the span into the pages behind the mapping */
+static void jgfs_mmap_prefetch(uint64_t off, uint64_t len) {
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	uint64_t start = off / sys_page * sys_page;
+	
+	madvise(dev_base + start, len + (off - start), MADV_WILLNEED);
+}
+
+static void jgfs_mmap_close(void) {
+	if (munmap(dev_base, dev_size) == -1) {
+		warn("munmap failed");
+	}
+}
+
+/* a ranged msync has the kernel flush the device's cache, after writing back
+ * the header if it changed */
+static int jgfs_mmap_barrier(void) {
+	uint64_t len = (JGFS_BOOT_SECT + jgfs.hdr->s_boot) * SECT_SIZE;
+	
+	return (msync(dev_base, len, MS_SYNC) == -1 ? -errno : 0);
+}
+
+
+/* get the page of the cache that off on the device is in */
+static uint64_t jgfs_page_of(uint64_t off) {
+	return (off < meta_len ? 0 : 1 + ((off - meta_len) / unit_len));
+}
+
+/* get the offset on the device of a page */
+static uint64_t jgfs_page_off(uint64_t page) {
+	return (page == 0 ? 0 : meta_len + ((page - 1) * unit_len));
+}
+
+/* get the length of a page, which stops short at the end of the cache */
+static uint64_t jgfs_page_len(uint64_t page) {
+	uint64_t off = jgfs_page_off(page);
+	uint64_t len = (page == 0 ? meta_len : unit_len);
+	
+	return (cache_len - off < len ? cache_len - off : len);
+}
+
+/* get the number of pages the cache may hold beyond those pinned */
+static uint64_t jgfs_cache_max(void) {
+	uint64_t max = cache_limit / unit_len;
+	
+	return (max != 0 ? max : 1);
+}
+
+/* find the buffer of the pool that ptr points into, returning its chunk (NULL
+ * if it is in none) and leaving its number there in *slot */
+static struct jgfs_chunk *jgfs_pool_find(const char *ptr, uint32_t *slot) {
+	unsigned count = __atomic_load_n(&pool_chunks, __ATOMIC_ACQUIRE);
+	
+	for (unsigned i = 0; i < count; ++i) {
+		struct jgfs_chunk *chunk = pool + i;
+		
+		if (ptr >= chunk->mem &&
+			ptr < chunk->mem + ((size_t)chunk->count * slot_len)) {
+			*slot = (ptr - chunk->mem) / slot_len;
+			return chunk;
+		}
+	}
+	
+	return NULL;
+}
+
+/* add a chunk to the pool: the first has a buffer for as many pages as the
+ * cache limit allows, and each after it doubles the pool, up to a buffer for
+ * every page; the pool lock must be held */
+static void jgfs_pool_grow(void) {
+	struct jgfs_chunk *last = pool + pool_chunks - 1;
+	uint64_t total = (pool_chunks != 0 ? last->first + last->count : 0);
+	
+	uint64_t count = (total != 0 ? total : jgfs_cache_max());
+	if (count > page_count - 1 - total) {
+		count = page_count - 1 - total;
+	}
+	if (count == 0 || pool_chunks == POOL_CHUNKS) {
+		errx(1, "jgfs_pool_grow: out of buffers");
+	}
+	
+	/* buffers that aren't in use only take address space */
+	struct jgfs_chunk *chunk = pool + pool_chunks;
+	if ((chunk->mem = mmap(NULL, count * slot_len, slot_prot,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+		err(1, "mmap failed");
+	}
+	if ((chunk->page = malloc(count * sizeof(*chunk->page))) == NULL ||
+		(slot_free = realloc(slot_free, (total + count) *
+		sizeof(*slot_free))) == NULL) {
+		errx(1, "jgfs_pool_grow: malloc failed");
+	}
+	chunk->first = total;
+	chunk->count = count;
+	
+	/* the lowest buffers are handed out first */
+	for (uint32_t i = count; i-- > 0; ) {
+		slot_free[free_count++] = total + i;
+	}
+	
+	__atomic_store_n(&pool_chunks, pool_chunks + 1, __ATOMIC_RELEASE);
+}
+
+/* take a buffer from the pool for page, returning its memory */
+static char *jgfs_pool_take(uint64_t page) {
+	pthread_mutex_lock(&pool_lock);
+	
+	if (free_count == 0) {
+		jgfs_pool_grow();
+	}
+	uint32_t n = slot_free[--free_count];
+	
+	pthread_mutex_unlock(&pool_lock);
+	
+	struct jgfs_chunk *chunk = pool;
+	while (n >= chunk->first + chunk->count) {
+		++chunk;
+	}
+	n -= chunk->first;
+	
+	__atomic_store_n(chunk->page + n, page, __ATOMIC_RELEASE);
+	
+	return chunk->mem + ((size_t)n * slot_len);
+}
+
+/* give the buffer that mem is in back to the pool */
+static void jgfs_pool_put(const char *mem) {
+	uint32_t slot;
+	struct jgfs_chunk *chunk = jgfs_pool_find(mem, &slot);
+	
+	pthread_mutex_lock(&pool_lock);
+	slot_free[free_count++] = chunk->first + slot;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void jgfs_cache_free(void) {
+	for (unsigned i = 0; i < pool_chunks; ++i) {
+		if (munmap(pool[i].mem, pool[i].count * slot_len) == -1) {
+			warn("munmap failed");
+		}
+		free(pool[i].page);
+	}
+	pool_chunks = 0;
+	
+	free(slot_free);
+	slot_free  = NULL;
+	free_count = 0;
+	
+	free(page_mem);
+	free(page_loaded);
+	free(page_refd);
+	free(page_bad);
+	free(page_pins);
+	free(sect_pinned);
+	page_mem    = NULL;
+	page_loaded = page_refd = page_bad = sect_pinned = NULL;
+	page_pins   = NULL;
+	cache_pages = 0;
+}
+
+/* lay the cache out afresh, with a first page of meta bytes and pages of unit
+ * bytes after it, up to len bytes into the device, dropping every page; the
+ * first page's memory is left to the backend, and that of the others comes
+ * from a pool of buffers of slot bytes */
+static void jgfs_cache_layout(uint64_t meta, uint64_t unit, uint64_t len,
+	size_t slot) {
+	jgfs_cache_free();
+	
+	cache_len  = (len < dev_size ? len : dev_size);
+	meta_len   = (meta < cache_len ? meta : cache_len);
+	unit_len   = unit;
+	page_count = 1 + CEIL(cache_len - meta_len, unit_len);
+	slot_len   = slot;
+	
+	size_t words = CEIL(page_count, 64);
+	if ((page_mem = calloc(page_count, sizeof(*page_mem))) == NULL ||
+		(page_loaded = calloc(words, sizeof(uint64_t))) == NULL ||
+		(page_refd = calloc(words, sizeof(uint64_t))) == NULL ||
+		(page_bad = calloc(words, sizeof(uint64_t))) == NULL ||
+		(page_pins = calloc(page_count, sizeof(*page_pins))) == NULL ||
+		(sect_pinned = calloc(CEIL(CEIL(cache_len, SECT_SIZE), 64),
+		sizeof(uint64_t))) == NULL) {
+		errx(1, "jgfs_cache_layout: calloc failed");
+	}
+	
+	page_hand  = 1;
+	lock_bytes = 0;
+}
+
+/* give a page its memory; its stripe lock must be held */
+static char *jgfs_page_place(uint64_t page) {
+	char *mem = dev->place(page);
+	
+	__atomic_add_fetch(&cache_pages, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(page_mem + page, mem, __ATOMIC_RELEASE);
+	
+	return mem;
+}
+
+/* get the memory of a page, placing it if it has none */
+static char *jgfs_page_mem(uint64_t page) {
+	char *mem;
+	if ((mem = __atomic_load_n(page_mem + page, __ATOMIC_ACQUIRE)) != NULL) {
+		return mem;
+	}
+	
+	pthread_mutex_t *lock = load_locks + (page % LOAD_STRIPES);
+	pthread_mutex_lock(lock);
+	
+	if ((mem = __atomic_load_n(page_mem + page, __ATOMIC_RELAXED)) == NULL) {
+		mem = jgfs_page_place(page);
+	}
+	
+	pthread_mutex_unlock(lock);
+	
+	return mem;
+}
+
+/* take a page's memory back; it must not be pinned, and the namespace lock
+ * must be held exclusively */
+static void jgfs_page_evict(uint64_t page) {
+	char *mem = page_mem[page];
+	__atomic_store_n(page_mem + page, NULL, __ATOMIC_RELEASE);
+	
+	/* a page that failed to read gets another try next time */
+	jgfs_page_set(page_bad, page, false);
+	jgfs_page_set(page_loaded, page, false);
+	
+	dev->evict(page, mem);
+	__atomic_sub_fetch(&cache_pages, 1, __ATOMIC_RELAXED);
+}
+
+/* get the memory of the span at off, returning how much of it runs on there
+ * (up to the end of its page) */
+static uint64_t jgfs_dev_run(uint64_t off, uint64_t len, char **mem) {
+	*mem = jgfs_dev_addr(off);
+	
+	if (dev->layout == NULL) {
+		return len;
+	}
+	
+	uint64_t page = jgfs_page_of(off);
+	uint64_t left = jgfs_page_off(page) + jgfs_page_len(page) - off;
+	
+	return (len < left ? len : left);
+}
+
+/* give the first page memory of its own at the base, keeping what it held
+ * before, if anything */
+static void jgfs_pread_base(void) {
+	char *mem;
+	if ((mem = mmap(NULL, meta_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		err(1, "mmap failed");
+	}
+	
+	if (dev_base != NULL) {
+		memcpy(mem, dev_base, (base_len < meta_len ? base_len : meta_len));
+		
+		if (munmap(dev_base, base_len) == -1) {
+			warn("munmap failed");
+		}
+	}
+	
+	dev_base = mem;
+	base_len = meta_len;
+	
+	page_mem[0] = dev_base;
+}
+
+static bool jgfs_pread_open(int fd, uint64_t size) {
+	/* until the header has been read, the vbr and the header are all
+	 * there is */
+	uint64_t meta = JGFS_BOOT_SECT * SECT_SIZE;
+	jgfs_cache_layout(meta, meta, meta, 0);
+	jgfs_pread_base();
+	
+	return true;
+}
+
+static void jgfs_pread_close(void) {
+	if (munmap(dev_base, base_len) == -1) {
+		warn("munmap failed");
+	}
+	
+	jgfs_cache_free();
+}
+
+/* read len bytes at off on the device into memory; whatever can't be read is
+ * left zeroed, its pages are marked bad until they are evicted, and the error
+ * is left for fsync to report */
+static void jgfs_pread_fill(uint64_t off, uint64_t len) {
+	for (uint64_t done = 0; done < len; ) {
+		char *mem;
+		uint64_t run = jgfs_dev_run(off + done, len - done, &mem);
+		
+		ssize_t b_read = pread(dev_fd, mem, run, off + done);
+		
+		if (b_read == -1 && errno == EINTR) {
+			continue;
+		} else if (b_read <= 0) {
+			warnx("failed to read the device at %#" PRIx64 ": %s",
+				off + done, (b_read == 0 ? "short read" : strerror(errno)));
+			__atomic_store_n(&dev_error, true, __ATOMIC_RELEASE);
+			
+			for (uint64_t page = jgfs_page_of(off + done);
+				page <= jgfs_page_of(off + len - 1); ++page) {
+				jgfs_page_set(page_bad, page, true);
+			}
+			jgfs_bad_note(off + done, len - done);
+			break;
+		}
+		
+		done += b_read;
+	}
+}
+
+/* what has been read of the first page is kept, as it may have been changed
+ * since (by mkfs), and the rest of it is read after it */
+static void jgfs_pread_layout(uint64_t meta, uint32_t clust_size,
+	uint64_t len) {
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	
+	uint64_t old_len = meta_len;
+	bool loaded = jgfs_page_test(page_loaded, 0);
+	
+	uint64_t unit = CEIL(sys_page, clust_size) * clust_size;
+	jgfs_cache_layout(meta, unit, len, CEIL(unit, sys_page) * sys_page);
+	slot_prot = PROT_READ | PROT_WRITE;
+	jgfs_pread_base();
+	
+	if (loaded) {
+		jgfs_pread_fill(old_len, meta_len - old_len);
+		jgfs_page_set(page_loaded, 0, true);
+	}
+}
+
+static char *jgfs_pread_place(uint64_t page) {
+	return jgfs_pool_take(page);
+}
+
+/* the buffer's memory goes back to the system before the buffer goes back to
+ * the pool; a page loaded again is read in whole */
+static void jgfs_pread_evict(uint64_t page, char *mem) {
+	madvise(mem, slot_len, MADV_DONTNEED);
+	
+	jgfs_pool_put(mem);
+}
+
+static void jgfs_pread_fill_page(uint64_t page) {
+	jgfs_pread_fill(jgfs_page_off(page), jgfs_page_len(page));
+}
+
+static void jgfs_pread_page(uint64_t page) {
+	pthread_mutex_t *lock = load_locks + (page % LOAD_STRIPES);
+	pthread_mutex_lock(lock);
+	
+	if (!jgfs_page_test(page_loaded, page)) {
+		if (__atomic_load_n(page_mem + page, __ATOMIC_RELAXED) == NULL) {
+			jgfs_page_place(page);
+		}
+		if (dev->fill != NULL) {
+			dev->fill(page);
+		}
+		
+		jgfs_page_set(page_loaded, page, true);
+	}
+	
+	pthread_mutex_unlock(lock);
+}
+
+/* check whether every sector from first to last is pinned */
+static bool jgfs_sect_pinned(uint64_t first, uint64_t last) {
+	for (uint64_t word = first / 64; word <= last / 64; ++word) {
+		uint64_t mask = ~0ULL;
+		if (word == first / 64) {
+			mask &= ~0ULL << (first % 64);
+		}
+		if (word == last / 64) {
+			mask &= ~0ULL >> (63 - (last % 64));
+		}
+		
+		if ((__atomic_load_n(sect_pinned + word, __ATOMIC_ACQUIRE) & mask) !=
+			mask) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/* pin the sectors of the span, counting those newly pinned against their
+ * pages, and lock them into memory if asked to */
+static void jgfs_cache_pin(uint64_t off, uint64_t len) {
+	uint64_t first = off / SECT_SIZE, last = (off + len - 1) / SECT_SIZE;
+	
+	if (jgfs_sect_pinned(first, last)) {
+		return;
+	}
+	
+	uint64_t pinned = 0;
+	for (uint64_t sect = first; sect <= last; ++sect) {
+		uint64_t bit = 1ULL << (sect % 64);
+		
+		if ((__atomic_fetch_or(sect_pinned + (sect / 64), bit,
+			__ATOMIC_ACQ_REL) & bit) == 0) {
+			uint64_t page = jgfs_page_of(sect * SECT_SIZE);
+			
+			if (__atomic_fetch_add(page_pins + page, 1, __ATOMIC_RELAXED) ==
+				0 && page != 0) {
+				__atomic_sub_fetch(&cache_pages, 1, __ATOMIC_RELAXED);
+			}
+			++pinned;
+		}
+	}
+	
+	/* a pinned page is never read again, so one that failed to read would
+	 * stand in for the metadata as zeroes for good, and be written over it as
+	 * soon as it changed; there is no going on without it, as with a fault on
+	 * the mapping */
+	for (uint64_t page = jgfs_page_of(off);
+		page <= jgfs_page_of(off + len - 1); ++page) {
+		if (jgfs_page_test(page_bad, page)) {
+			errx(1, "failed to read the filesystem's metadata at %#" PRIx64,
+				jgfs_page_off(page));
+		}
+	}
+	
+	if (pinned != 0 && __atomic_load_n(&lock_pinned, __ATOMIC_RELAXED)) {
+		uint64_t sys_page = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)jgfs_dev_addr(off) / sys_page * sys_page;
+		uintptr_t end = CEIL((uintptr_t)jgfs_dev_addr(off) + len, sys_page) *
+			sys_page;
+		
+		if (mlock((void *)start, end - start) == -1) {
+			warn("mlock failed; pinned memory may be paged out");
+			__atomic_store_n(&lock_pinned, false, __ATOMIC_RELAXED);
+		} else {
+			__atomic_add_fetch(&lock_bytes, pinned * SECT_SIZE,
+				__ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void jgfs_pread_load(uint64_t off, uint64_t len, bool pin) {
+	for (uint64_t page = jgfs_page_of(off);
+		page <= jgfs_page_of(off + len - 1); ++page) {
+		if (!jgfs_page_test(page_loaded, page)) {
+			jgfs_pread_page(page);
+		}
+		
+		if (!jgfs_page_test(page_refd, page)) {
+			jgfs_page_set(page_refd, page, true);
+		}
+	}
+	
+	if (pin) {
+		jgfs_cache_pin(off, len);
+	}
+}
+
+/* pages that aren't loaded are marked as if they were, holding whatever their
+ * memory does, which is only ever seen past the end of a file */
+static void jgfs_pread_claim(uint64_t page, uint64_t count) {
+	for (uint64_t end = page + count; page < end; ++page) {
+		if (!jgfs_page_test(page_loaded, page)) {
+			pthread_mutex_t *lock = load_locks + (page % LOAD_STRIPES);
+			pthread_mutex_lock(lock);
+			
+			if (!jgfs_page_test(page_loaded, page)) {
+				if (__atomic_load_n(page_mem + page, __ATOMIC_RELAXED) ==
+					NULL) {
+					jgfs_page_place(page);
+				}
+				jgfs_page_set(page_loaded, page, true);
+			}
+			
+			pthread_mutex_unlock(lock);
+		}
+		
+		if (!jgfs_page_test(page_refd, page)) {
+			jgfs_page_set(page_refd, page, true);
+		}
+	}
+}
+
+/* what the cache already holds needn't be read again, so only the rest of the
+ * span, from the first page missing, is read ahead */
+static void jgfs_pread_prefetch(uint64_t off, uint64_t len) {
+	for (uint64_t page = jgfs_page_of(off);
+		page <= jgfs_page_of(off + len - 1); ++page) {
+		if (!jgfs_page_test(page_loaded, page)) {
+			uint64_t start = jgfs_page_off(page);
+			if (start < off) {
+				start = off;
+			}
+			
+			readahead(dev_fd, start, off + len - start);
+			break;
+		}
+	}
+}
+
+/* get whether any page of the span failed to read */
+static bool jgfs_pread_bad(uint64_t off, uint64_t len) {
+	for (uint64_t page = jgfs_page_of(off); len != 0 &&
+		page <= jgfs_page_of(off + len - 1); ++page) {
+		if (jgfs_page_test(page_bad, page)) {
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static int jgfs_pread_write_run(uint64_t off, uint64_t len) {
+	for (uint64_t done = 0; done < len; ) {
+		char *mem;
+		uint64_t run = jgfs_dev_run(off + done, len - done, &mem);
+		
+		ssize_t b_written = pwrite(dev_fd, mem, run, off + done);
+		
+		if (b_written == -1 && errno == EINTR) {
+			continue;
+		} else if (b_written == -1) {
+			return -errno;
+		} else if (b_written == 0) {
+			return -EIO;
+		}
+		
+		done += b_written;
+	}
+	
+	return 0;
+}
+
+/* the span may be changed again while it is being written out, as pages of a
+ * mapping can be while the kernel writes them back; such changes are marked
+ * dirty again after they are made, and go out with the next flush; pages that
+ * failed to read hold zeroes in place of what is on the device, so they are
+ * never written, and the span fails once the rest of it is out */
+static int jgfs_pread_write(uint64_t off, uint64_t len) {
+	if (!jgfs_pread_bad(off, len)) {
+		return jgfs_pread_write_run(off, len);
+	}
+	
+	/* runs of good pages are written, and runs of bad ones skipped */
+	uint64_t end = off + len;
+	int rtn = 0;
+	for (uint64_t at = off; at < end && rtn == 0; ) {
+		bool bad = jgfs_page_test(page_bad, jgfs_page_of(at));
+		
+		uint64_t run_end = at;
+		while (run_end < end &&
+			jgfs_page_test(page_bad, jgfs_page_of(run_end)) == bad) {
+			run_end = jgfs_page_off(jgfs_page_of(run_end) + 1);
+		}
+		if (run_end > end) {
+			run_end = end;
+		}
+		
+		if (!bad) {
+			rtn = jgfs_pread_write_run(at, run_end - at);
+		}
+		
+		at = run_end;
+	}
+	
+	return (rtn != 0 ? rtn : -EIO);
+}
+
+static int jgfs_pread_barrier(void) {
+	return (fdatasync(dev_fd) == -1 ? -errno : 0);
+}
+
+/* evict pages that haven't been used since the clock hand last passed them,
+ * giving their memory back, until the cache is comfortably under its limit;
+ * pages with changes not yet written back stay, unless the fd sees them */
+static void jgfs_pread_trim(void) {
+	uint64_t target = jgfs_cache_max() - (jgfs_cache_max() / 8);
+	
+	/* the writeback thread mustn't be in the middle of writing out pages
+	 * whose changes it has already taken */
+	if (!dev->direct && !jgfs_writeback_hold()) {
+		return;
+	}
+	
+	/* the first page is never evicted, so the hand skips it */
+	for (uint64_t seen = 0; page_count > 1 && seen < 2 * page_count &&
+		__atomic_load_n(&cache_pages, __ATOMIC_RELAXED) > target; ++seen) {
+		uint64_t page = page_hand;
+		page_hand = (page_hand + 1 < page_count ? page_hand + 1 : 1);
+		
+		if (page_mem[page] == NULL || page_pins[page] != 0) {
+			continue;
+		} else if (jgfs_page_test(page_refd, page)) {
+			jgfs_page_set(page_refd, page, false);
+		} else if (dev->direct || !jgfs_dirty_test(jgfs_page_off(page),
+			jgfs_page_len(page))) {
+			jgfs_page_evict(page);
+		}
+	}
+	
+	if (!dev->direct) {
+		jgfs_writeback_release();
+		
+		/* what's left is mostly changes; once they're written back, their
+		 * pages can go too */
+		if (__atomic_load_n(&cache_pages, __ATOMIC_RELAXED) > target) {
+			jgfs_writeback_kick();
+		}
+	}
+}
+
+
+static int jgfs_uring_setup(struct jgfs_uring *ring, int fd) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	
+	if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES,
+		&params)) == -1) {
+		return -errno;
+	}
+	
+	ring->entries    = params.sq_entries;
+	ring->sq_map_len = params.sq_off.array +
+		(params.sq_entries * sizeof(unsigned));
+	ring->cq_map_len = params.cq_off.cqes +
+		(params.cq_entries * sizeof(struct io_uring_cqe));
+	ring->sqes_len   = params.sq_entries * sizeof(struct io_uring_sqe);
+	
+	/* newer kernels put both queues in one mapping */
+	bool single = ((params.features & IORING_FEAT_SINGLE_MMAP) != 0);
+	if (single && ring->cq_map_len > ring->sq_map_len) {
+		ring->sq_map_len = ring->cq_map_len;
+	}
+	
+	ring->sq_map = ring->cq_map = MAP_FAILED;
+	ring->sqes   = MAP_FAILED;
+	if ((ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) ==
+		MAP_FAILED || (ring->cq_map = (single ? ring->sq_map :
+		mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING))) ==
+		MAP_FAILED || (ring->sqes = mmap(NULL, ring->sqes_len,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		IORING_OFF_SQES)) == MAP_FAILED) {
+		int rtn = -errno;
+		
+		if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+			munmap(ring->cq_map, ring->cq_map_len);
+		}
+		if (ring->sq_map != MAP_FAILED) {
+			munmap(ring->sq_map, ring->sq_map_len);
+		}
+		close(ring->fd);
+		
+		return rtn;
+	}
+	
+	char *sq = ring->sq_map, *cq = ring->cq_map;
+	ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	
+	/* a registered fd saves looking it up for every i/o; without one, the
+	 * plain fd still works */
+	ring->fixed = (syscall(__NR_io_uring_register, ring->fd,
+		IORING_REGISTER_FILES, &fd, 1) == 0);
+	
+	pthread_mutex_init(&ring->lock, NULL);
+	
+	return 0;
+}
+
+static void jgfs_uring_free(struct jgfs_uring *ring) {
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_map_len);
+	}
+	munmap(ring->sq_map, ring->sq_map_len);
+	
+	if (close(ring->fd) == -1) {
+		warn("close failed");
+	}
+	
+	pthread_mutex_destroy(&ring->lock);
+}
+
+/* get a ring to ourselves, preferring one that is idle */
+static struct jgfs_uring *jgfs_uring_take(void) {
+	for (int i = 0; i < ring_count; ++i) {
+		if (pthread_mutex_trylock(&rings[i].lock) == 0) {
+			return rings + i;
+		}
+	}
+	
+	struct jgfs_uring *ring = rings +
+		(__atomic_fetch_add(&ring_next, 1, __ATOMIC_RELAXED) % ring_count);
+	pthread_mutex_lock(&ring->lock);
+	
+	return ring;
+}
+
+static void jgfs_uring_prep(const struct jgfs_uring *ring,
+	struct io_uring_sqe *sqe, const struct jgfs_uring_io *io, size_t n) {
+	memset(sqe, 0, sizeof(*sqe));
+	
+	sqe->opcode    = io->opcode;
+	sqe->fd        = (ring->fixed ? 0 : dev_fd);
+	sqe->flags     = (ring->fixed ? IOSQE_FIXED_FILE : 0) |
+		(io->drain ? IOSQE_IO_DRAIN : 0);
+	sqe->off       = io->off;
+	sqe->len       = io->len;
+	sqe->user_data = n;
+	
+	if (io->opcode == IORING_OP_READ || io->opcode == IORING_OP_WRITE) {
+		sqe->addr = (uintptr_t)io->mem;
+	} else if (io->opcode == IORING_OP_FSYNC) {
+		sqe->len         = 0;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	} else if (io->opcode == IORING_OP_SYNC_FILE_RANGE) {
+		sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+	}
+}
+
+/* put count i/os through a ring and wait for all of them, setting the result of
+ * each */
+static void jgfs_uring_run(struct jgfs_uring_io *io, size_t count) {
+	if (count == 0) {
+		return;
+	}
+	
+	struct jgfs_uring *ring = jgfs_uring_take();
+	
+	for (size_t first = 0; first < count; ) {
+		unsigned n = (count - first < ring->entries ? count - first :
+			ring->entries);
+		
+		/* only we move the tail, and the ring is empty between turns */
+		unsigned tail = *ring->sq_tail;
+		for (unsigned i = 0; i < n; ++i) {
+			unsigned idx = (tail + i) & *ring->sq_mask;
+			
+			jgfs_uring_prep(ring, ring->sqes + idx, io + first + i, first + i);
+			ring->sq_array[idx] = idx;
+		}
+		__atomic_store_n(ring->sq_tail, tail + n, __ATOMIC_RELEASE);
+		
+		unsigned submitted = 0, done = 0;
+		while (done < n) {
+			/* submit first, then wait; waiting on more than has gone in
+			 * could wait forever */
+			int rtn;
+			if (submitted < n) {
+				rtn = syscall(__NR_io_uring_enter, ring->fd, n - submitted, 0,
+					0, NULL, 0);
+			} else {
+				rtn = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+			}
+			
+			if (rtn == -1 && errno != EINTR && errno != EAGAIN &&
+				errno != EBUSY) {
+				err(1, "io_uring_enter failed");
+			} else if (rtn > 0 && submitted < n) {
+				submitted += rtn;
+			}
+			
+			unsigned head = *ring->cq_head;
+			while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+				const struct io_uring_cqe *cqe =
+					ring->cqes + (head & *ring->cq_mask);
+				
+				io[cqe->user_data].res = cqe->res;
+				
+				++head;
+				++done;
+			}
+			__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		}
+		
+		first += n;
+	}
+	
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static bool jgfs_uring_open(int fd, uint64_t size) {
+	int rtn = 0;
+	for (ring_count = 0; ring_count < URING_RINGS; ++ring_count) {
+		if ((rtn = jgfs_uring_setup(rings + ring_count, fd)) != 0) {
+			break;
+		}
+	}
+	
+	/* io_uring may be missing from the kernel or forbidden by seccomp, in
+	 * which case the pread backend, with the same cache, takes over */
+	if (ring_count == 0) {
+		warnx("io_uring is unavailable (%s); using pread", strerror(-rtn));
+		return false;
+	}
+	
+	return jgfs_pread_open(fd, size);
+}
+
+static void jgfs_uring_close(void) {
+	for (int i = 0; i < ring_count; ++i) {
+		jgfs_uring_free(rings + i);
+	}
+	ring_count = 0;
+	
+	jgfs_pread_close();
+}
+
+static int jgfs_page_cmp(const void *a, const void *b) {
+	uint64_t page_a = *(const uint64_t *)a, page_b = *(const uint64_t *)b;
+	
+	return (page_a > page_b) - (page_a < page_b);
+}
+
+/* read in every missing page behind the iovecs in one batch, with a read for
+ * each run of them that lies together both on the device and in memory */
+static void jgfs_uring_load_iov(const struct iovec *iov, int iov_count) {
+	/* note the stripes of the missing pages, so that their locks can be
+	 * taken in order */
+	uint64_t stripes = 0;
+	size_t missing = 0;
+	for (int i = 0; i < iov_count; ++i) {
+		uint64_t off = jgfs_dev_offset(iov[i].iov_base);
+		
+		for (uint64_t page = jgfs_page_of(off); iov[i].iov_len != 0 &&
+			page <= jgfs_page_of(off + iov[i].iov_len - 1); ++page) {
+			if (!jgfs_page_test(page_loaded, page)) {
+				stripes |= 1ULL << (page % LOAD_STRIPES);
+				++missing;
+			}
+			
+			if (!jgfs_page_test(page_refd, page)) {
+				jgfs_page_set(page_refd, page, true);
+			}
+		}
+	}
+	
+	if (missing == 0) {
+		return;
+	}
+	
+	uint64_t *pages;
+	struct jgfs_uring_io *io;
+	if ((pages = malloc(missing * sizeof(*pages))) == NULL ||
+		(io = malloc(missing * sizeof(*io))) == NULL) {
+		free(pages);
+		
+		/* a page at a time still works */
+		for (int i = 0; i < iov_count; ++i) {
+			if (iov[i].iov_len != 0) {
+				jgfs_pread_load(jgfs_dev_offset(iov[i].iov_base),
+					iov[i].iov_len, false);
+			}
+		}
+		return;
+	}
+	
+	for (int i = 0; i < LOAD_STRIPES; ++i) {
+		if ((stripes & (1ULL << i)) != 0) {
+			pthread_mutex_lock(load_locks + i);
+		}
+	}
+	
+	/* now that nobody else can be reading them in, see which pages are still
+	 * missing, once each */
+	size_t count = 0;
+	for (int i = 0; i < iov_count && count < missing; ++i) {
+		uint64_t off = jgfs_dev_offset(iov[i].iov_base);
+		
+		for (uint64_t page = jgfs_page_of(off); iov[i].iov_len != 0 &&
+			page <= jgfs_page_of(off + iov[i].iov_len - 1) && count < missing;
+			++page) {
+			if ((stripes & (1ULL << (page % LOAD_STRIPES))) != 0 &&
+				!jgfs_page_test(page_loaded, page)) {
+				pages[count++] = page;
+			}
+		}
+	}
+	qsort(pages, count, sizeof(*pages), jgfs_page_cmp);
+	
+	size_t io_count = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (i != 0 && pages[i] == pages[i - 1]) {
+			continue;
+		}
+		
+		/* its stripe lock is held */
+		char *mem = __atomic_load_n(page_mem + pages[i], __ATOMIC_RELAXED);
+		if (mem == NULL) {
+			mem = jgfs_page_place(pages[i]);
+		}
+		
+		uint64_t off = jgfs_page_off(pages[i]), len = jgfs_page_len(pages[i]);
+		struct jgfs_uring_io *last = io + io_count - 1;
+		
+		if (io_count != 0 && last->off + last->len == off &&
+			last->mem + last->len == mem && last->len + len <= URING_IO_MAX) {
+			last->len += len;
+		} else {
+			io[io_count++] = (struct jgfs_uring_io){
+				.opcode = IORING_OP_READ,
+				.off    = off,
+				.len    = len,
+				.mem    = mem,
+			};
+		}
+	}
+	
+	jgfs_uring_run(io, io_count);
+	
+	/* whatever didn't come in goes through pread, which reports errors */
+	for (size_t i = 0; i < io_count; ++i) {
+		uint32_t done = (io[i].res > 0 ? (uint32_t)io[i].res : 0);
+		
+		if (done < io[i].len) {
+			jgfs_pread_fill(io[i].off + done, io[i].len - done);
+		}
+		
+		for (uint64_t page = jgfs_page_of(io[i].off);
+			page <= jgfs_page_of(io[i].off + io[i].len - 1); ++page) {
+			jgfs_page_set(page_loaded, page, true);
+		}
+	}
+	
+	for (int i = LOAD_STRIPES - 1; i >= 0; --i) {
+		if ((stripes & (1ULL << i)) != 0) {
+			pthread_mutex_unlock(load_locks + i);
+		}
+	}
+	
+	free(io);
+	free(pages);
+}
+
+/* write the spans in one batch, followed by either an fdatasync or a
+ * sync_file_range of each, which waits for the writes to finish */
+static int jgfs_uring_flush(const struct jgfs_flush *flush, size_t count,
+	bool barrier) {
+	/* a span is written a page at a time, at most, as the pages lie apart in
+	 * memory */
+	size_t io_max = 1 + count;
+	for (size_t i = 0; i < count; ++i) {
+		io_max += CEIL(flush[i].len, URING_IO_MAX);
+		if (flush[i].len != 0) {
+			io_max += jgfs_page_of(flush[i].off + flush[i].len - 1) -
+				jgfs_page_of(flush[i].off) + 1;
+		}
+	}
+	
+	struct jgfs_uring_io *io;
+	if ((io = malloc(io_max * sizeof(*io))) == NULL) {
+		return -ENOMEM;
+	}
+	
+	size_t io_count = 0;
+	for (size_t i = 0; i < count; ++i) {
+		for (uint64_t done = 0; done < flush[i].len; ) {
+			char *mem;
+			uint64_t run = jgfs_dev_run(flush[i].off + done,
+				flush[i].len - done, &mem);
+			if (run > URING_IO_MAX) {
+				run = URING_IO_MAX;
+			}
+			
+			io[io_count++] = (struct jgfs_uring_io){
+				.opcode = IORING_OP_WRITE,
+				.off    = flush[i].off + done,
+				.len    = run,
+				.mem    = mem,
+			};
+			
+			done += run;
+		}
+	}
+	size_t writes = io_count;
+	
+	if (barrier) {
+		io[io_count++] = (struct jgfs_uring_io){
+			.opcode = IORING_OP_FSYNC,
+			.drain  = true,
+		};
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			io[io_count++] = (struct jgfs_uring_io){
+				.opcode = IORING_OP_SYNC_FILE_RANGE,
+				.drain  = (i == 0),
+				.off    = flush[i].off,
+				.len    = (flush[i].len < UINT32_MAX ? flush[i].len : 0),
+			};
+		}
+	}
+	
+	jgfs_uring_run(io, io_count);
+	
+	/* a short write is finished off with pwrite, and then has to be synced
+	 * again on its own */
+	int rtn = 0;
+	bool resync = false;
+	for (size_t i = 0; i < writes && rtn == 0; ++i) {
+		if (io[i].res < 0) {
+			rtn = io[i].res;
+		} else if ((uint32_t)io[i].res < io[i].len) {
+			rtn = jgfs_pread_write(io[i].off + io[i].res,
+				io[i].len - io[i].res);
+			resync = true;
+		}
+	}
+	for (size_t i = writes; i < io_count && rtn == 0; ++i) {
+		if (io[i].res < 0) {
+			rtn = io[i].res;
+		}
+	}
+	
+	if (rtn == 0 && resync) {
+		if (barrier) {
+			rtn = jgfs_pread_barrier();
+		} else if (sync_file_range(dev_fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+			rtn = -errno;
+		}
+	}
+	
+	free(io);
+	
+	return rtn;
+}
+
+
+/* only what lies before the clusters stays mapped, at the base; the pages of
+ * the cache are windows of whole clusters, each mapped into a buffer of the
+ * pool when it is used and unmapped again when it is evicted, so that no more
+ * of the device than the cache limit allows is ever mapped at once; changes to
+ * a window go straight to the device's page cache */
+static void jgfs_window_layout(uint64_t meta, uint32_t clust_size,
+	uint64_t len) {
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	
+	/* a window is mapped from the page of the system it starts in, so its
+	 * buffer has room for one more */
+	uint64_t unit = (WINDOW_SIZE / clust_size != 0 ?
+		WINDOW_SIZE / clust_size : 1) * clust_size;
+	jgfs_cache_layout(meta, unit, len, CEIL(unit + sys_page, sys_page) *
+		sys_page);
+	slot_prot = PROT_NONE;
+	
+	if (dev_base != NULL && munmap(dev_base, base_len) == -1) {
+		warn("munmap failed");
+	}
+	if ((dev_base = mmap(NULL, meta_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		dev_fd, 0)) == MAP_FAILED) {
+		err(1, "mmap failed");
+	}
+	base_len = meta_len;
+	
+	page_mem[0] = dev_base;
+	jgfs_page_set(page_loaded, 0, true);
+}
+
+static bool jgfs_window_open(int fd, uint64_t size) {
+	/* until the header has been read, the vbr and the header are all
+	 * there is */
+	uint64_t meta = JGFS_BOOT_SECT * SECT_SIZE;
+	jgfs_window_layout(meta, SECT_SIZE, meta);
+	
+	return true;
+}
+
+static char *jgfs_window_place(uint64_t page) {
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	uint64_t off = jgfs_page_off(page), skew = off % sys_page;
+	
+	char *slot = jgfs_pool_take(page);
+	if (mmap(slot, jgfs_page_len(page) + skew, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED, dev_fd, off - skew) == MAP_FAILED) {
+		err(1, "mmap failed");
+	}
+	
+	return slot + skew;
+}
+
+/* put the buffer back as it was, with the window gone, before handing it
+ * back */
+static void jgfs_window_evict(uint64_t page, char *mem) {
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	char *slot = mem - (jgfs_page_off(page) % sys_page);
+	
+	if (mmap(slot, slot_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+		MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		warn("mmap failed");
+	}
+	
+	jgfs_pool_put(slot);
+}
+
+
+/* a fault on the device's memory while a probe is under way goes back to the
+ * probe; any other is a crash like before */
+static void jgfs_fault(int sig, siginfo_t *info, void *context) {
+	char *addr = info->si_addr;
+	
+	if (fault_jmp != NULL && jgfs_dev_offset(addr) < dev_size) {
+		fault_addr = addr;
+		siglongjmp(*fault_jmp, 1);
+	}
+	
+	sigaction(SIGBUS, &fault_old, NULL);
+}
+
+
+static const struct jgfs_dev_ops dev_ops[] = {
+	[DEV_MMAP] = {
+		.open     = jgfs_mmap_open,
+		.close    = jgfs_mmap_close,
+		.layout   = NULL,
+		.load     = NULL,
+		.load_iov = NULL,
+		.claim    = NULL,
+		.prefetch = jgfs_mmap_prefetch,
+		.write    = NULL,
+		.barrier  = jgfs_mmap_barrier,
+		.flush    = NULL,
+		.trim     = NULL,
+		.place    = NULL,
+		.evict    = NULL,
+		.fill     = NULL,
+		.direct   = true,
+	},
+	[DEV_PREAD] = {
+		.open     = jgfs_pread_open,
+		.close    = jgfs_pread_close,
+		.layout   = jgfs_pread_layout,
+		.load     = jgfs_pread_load,
+		.load_iov = NULL,
+		.claim    = jgfs_pread_claim,
+		.prefetch = jgfs_pread_prefetch,
+		.write    = jgfs_pread_write,
+		.barrier  = jgfs_pread_barrier,
+		.flush    = NULL,
+		.trim     = jgfs_pread_trim,
+		.place    = jgfs_pread_place,
+		.evict    = jgfs_pread_evict,
+		.fill     = jgfs_pread_fill_page,
+		.direct   = false,
+	},
+	[DEV_URING] = {
+		.open     = jgfs_uring_open,
+		.close    = jgfs_uring_close,
+		.layout   = jgfs_pread_layout,
+		.load     = jgfs_pread_load,
+		.load_iov = jgfs_uring_load_iov,
+		.claim    = jgfs_pread_claim,
+		.prefetch = jgfs_pread_prefetch,
+		.write    = jgfs_pread_write,
+		.barrier  = jgfs_pread_barrier,
+		.flush    = jgfs_uring_flush,
+		.trim     = jgfs_pread_trim,
+		.place    = jgfs_pread_place,
+		.evict    = jgfs_pread_evict,
+		.fill     = jgfs_pread_fill_page,
+		.direct   = false,
+	},
+	[DEV_WINDOW] = {
+		.open     = jgfs_window_open,
+		.close    = jgfs_pread_close,
+		.layout   = jgfs_window_layout,
+		.load     = jgfs_pread_load,
+		.load_iov = NULL,
+		.claim    = NULL,
+		.prefetch = NULL,
+		.write    = NULL,
+		.barrier  = jgfs_mmap_barrier,
+		.flush    = NULL,
+		.trim     = jgfs_pread_trim,
+		.place    = jgfs_window_place,
+		.evict    = jgfs_window_evict,
+		.fill     = NULL,
+		.direct   = true,
+	},
+};
+
+
+/* hand each span to the fd and start writing it back, then wait on each, so
+ * that the device sees them all at once */
+static int jgfs_dev_flush_sync(const struct jgfs_flush *flush, size_t count,
+	bool barrier) {
+	int rtn = 0;
+	
+	/* a span that can't be written doesn't hold up the ones after it */
+	for (size_t i = 0; i < count; ++i) {
+		int span_rtn = (dev->write != NULL ?
+			dev->write(flush[i].off, flush[i].len) : 0);
+		
+		if (span_rtn == 0 && sync_file_range(dev_fd, flush[i].off,
+			flush[i].len, SYNC_FILE_RANGE_WRITE) == -1) {
+			span_rtn = -errno;
+		}
+		
+		if (rtn == 0) {
+			rtn = span_rtn;
+		}
+	}
+	for (size_t i = 0; i < count && rtn == 0; ++i) {
+		if (sync_file_range(dev_fd, flush[i].off, flush[i].len,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+			rtn = -errno;
+		}
+	}
+	
+	/* sync_file_range leaves the data in the device's volatile cache */
+	if (rtn == 0 && barrier) {
+		rtn = dev->barrier();
+	}
+	
+	return rtn;
+}
+
+
+void jgfs_dev_select(enum jgfs_dev_type type, uint64_t cache_size) {
+	dev_type = type;
+	
+	if (cache_size != 0) {
+		cache_limit = cache_size;
+	}
+}
+
+void jgfs_dev_lock_pinned(bool lock) {
+	lock_pinned = lock_wanted = lock;
+}
+
+void jgfs_dev_open(int fd, uint64_t size) {
+	dev      = dev_ops + (dev_type == DEV_AUTO ? DEV_MMAP : dev_type);
+	dev_fd   = fd;
+	dev_size = size;
+	
+	if (!dev->open(fd, size)) {
+		dev = dev_ops + DEV_PREAD;
+		dev->open(fd, size);
+	}
+	
+	/* the cache keeps count of what it has locked itself */
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	if (lock_pinned && dev->layout == NULL && (lock_map =
+		calloc(CEIL(CEIL(size, sys_page), 64), sizeof(uint64_t))) == NULL) {
+		err(1, "calloc failed");
+	}
+	lock_bytes = 0;
+	
+	/* a page of a mapping of the device that can't be read in raises SIGBUS;
+	 * SA_NODEFER keeps it unblocked after jumping out of the handler */
+	if (dev->direct) {
+		struct sigaction act = {
+			.sa_sigaction = jgfs_fault,
+			.sa_flags     = SA_SIGINFO | SA_NODEFER,
+		};
+		sigemptyset(&act.sa_mask);
+		
+		if (sigaction(SIGBUS, &act, &fault_old) == -1) {
+			warn("sigaction failed");
+		}
+	}
+}
+
+void jgfs_dev_close(void) {
+	if (dev->direct) {
+		sigaction(SIGBUS, &fault_old, NULL);
+	}
+	
+	/* unmapping the memory unlocks it too */
+	dev->close();
+	
+	free(lock_map);
+	lock_map = NULL;
+	
+	dev_base = NULL;
+	base_len = 0;
+	dev_fd   = -1;
+}
+
+void jgfs_dev_layout(uint64_t meta, uint32_t clust_size, uint64_t len) {
+	if (dev->layout != NULL) {
+		dev->layout(meta, clust_size, len);
+	}
+}
+
+/* lock the pages of the mapping behind the span into memory, faulting them in
+ * if they aren't already; each page is only locked once, so that the hot path
+ * of looking up pinned memory stays free of system calls */
+static void jgfs_dev_mlock(uint64_t off, uint64_t len) {
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	uint64_t first = off / sys_page, last = (off + len - 1) / sys_page;
+	
+	bool locked = true;
+	for (uint64_t page = first; page <= last && locked; ++page) {
+		locked = jgfs_page_test(lock_map, page);
+	}
+	if (locked) {
+		return;
+	}
+	
+	if (mlock(dev_base + (first * sys_page), (last - first + 1) *
+		sys_page) == -1) {
+		warn("mlock failed; pinned memory may be paged out");
+		__atomic_store_n(&lock_pinned, false, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	for (uint64_t page = first; page <= last; ++page) {
+		if ((__atomic_fetch_or(lock_map + (page / 64), 1ULL << (page % 64),
+			__ATOMIC_RELAXED) & (1ULL << (page % 64))) == 0) {
+			__atomic_add_fetch(&lock_bytes, sys_page, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* make the span present, without working out where it is */
+static void jgfs_dev_fetch(uint64_t off, uint64_t len, bool pin) {
+	if (dev->load != NULL && len != 0) {
+		dev->load(off, len, pin);
+	} else if (pin && len != 0 && lock_map != NULL &&
+		__atomic_load_n(&lock_pinned, __ATOMIC_RELAXED)) {
+		jgfs_dev_mlock(off, len);
+	}
+}
+
+void *jgfs_dev_load(uint64_t off, uint64_t len, bool pin) {
+	uint64_t end = (dev->layout != NULL ? cache_len : dev_size);
+	if (off > end || len > end - off) {
+		errx(1, "jgfs_dev_load: tried to access past the end of the "
+			"filesystem (%#" PRIx64 ")", off);
+	}
+	
+	jgfs_dev_fetch(off, len, pin);
+	
+	return jgfs_dev_addr(off);
+}
+
+void *jgfs_dev_addr(uint64_t off) {
+	if (dev->layout == NULL) {
+		return dev_base + off;
+	}
+	
+	uint64_t page = jgfs_page_of(off);
+	
+	return jgfs_page_mem(page) + (off - jgfs_page_off(page));
+}
+
+/* make the span at off present, reading in only the pages it covers in part,
+ * whose other bytes it leaves as they are */
+static void jgfs_dev_claim(uint64_t off, uint64_t len) {
+	if (dev->claim == NULL || len == 0) {
+		jgfs_dev_fetch(off, len, false);
+		return;
+	}
+	
+	uint64_t first = jgfs_page_of(off), end = jgfs_page_of(off + len - 1) + 1;
+	if (jgfs_page_off(first) != off) {
+		++first;
+	}
+	if (jgfs_page_off(end - 1) + jgfs_page_len(end - 1) != off + len) {
+		--end;
+	}
+	
+	if (first >= end) {
+		jgfs_dev_fetch(off, len, false);
+		return;
+	}
+	
+	uint64_t start = jgfs_page_off(first);
+	uint64_t stop = jgfs_page_off(end - 1) + jgfs_page_len(end - 1);
+	
+	jgfs_dev_fetch(off, start - off, false);
+	dev->claim(first, end - first);
+	jgfs_dev_fetch(stop, (off + len) - stop, false);
+}
+
+void jgfs_dev_load_iov(const struct iovec *iov, int iov_count,
+	uint64_t load_len) {
+	/* find where the span to be read in ends: after load_count whole iovecs,
+	 * and edge bytes into the next */
+	int load_count = 0;
+	uint64_t edge = load_len;
+	while (load_count < iov_count && edge >= iov[load_count].iov_len) {
+		edge -= iov[load_count++].iov_len;
+	}
+	if (load_count == iov_count) {
+		edge = 0;
+	}
+	
+	struct iovec head[load_count + 1];
+	memcpy(head, iov, load_count * sizeof(*iov));
+	int head_count = load_count;
+	if (edge != 0) {
+		head[head_count++] = (struct iovec){
+			.iov_base = iov[load_count].iov_base,
+			.iov_len  = edge,
+		};
+	}
+	
+	if (dev->load_iov != NULL) {
+		if (head_count != 0) {
+			dev->load_iov(head, head_count);
+		}
+	} else if (dev->load != NULL) {
+		for (int i = 0; i < head_count; ++i) {
+			jgfs_dev_fetch(jgfs_dev_offset(head[i].iov_base),
+				head[i].iov_len, false);
+		}
+	}
+	
+	for (int i = load_count; i < iov_count && dev->load != NULL; ++i) {
+		uint64_t skip = (i == load_count ? edge : 0);
+		
+		jgfs_dev_claim(jgfs_dev_offset(iov[i].iov_base) + skip,
+			iov[i].iov_len - skip);
+	}
+}
+
+void jgfs_dev_prefetch(uint64_t off, uint64_t len) {
+	if (len == 0) {
+		return;
+	}
+	
+	if (dev->prefetch != NULL) {
+		dev->prefetch(off, len);
+	} else {
+		readahead(dev_fd, off, len);
+	}
+}
+
+int jgfs_dev_flush(const struct jgfs_flush *flush, size_t count,
+	bool barrier) {
+	/* spans with pages that failed to read go a page at a time through
+	 * write, which leaves those pages out */
+	bool bad = false;
+	for (size_t i = 0; i < count && !bad && !dev->direct; ++i) {
+		bad = jgfs_pread_bad(flush[i].off, flush[i].len);
+	}
+	
+	if (dev->flush != NULL && !bad) {
+		return dev->flush(flush, count, barrier);
+	} else {
+		return jgfs_dev_flush_sync(flush, count, barrier);
+	}
+}
+
+/* touch a byte of every page of the span */
+static void jgfs_dev_touch(const volatile char *ptr, uint64_t len) {
+	uint64_t sys_page = sysconf(_SC_PAGESIZE);
+	
+	for (uint64_t at = 0; at < len; at = (((uintptr_t)(ptr + at) / sys_page) +
+		1) * sys_page - (uintptr_t)ptr) {
+		(void)ptr[at];
+	}
+}
+
+int jgfs_dev_probe(const void *ptr, uint64_t len) {
+	uint64_t off = jgfs_dev_offset(ptr);
+	
+	if (len == 0 || off >= dev_size) {
+		return 0;
+	}
+	
+	/* the cache has already read the pages in, and knows which failed */
+	if (!dev->direct) {
+		return (jgfs_pread_bad(off, len) ? -EIO : 0);
+	}
+	
+	/* any page that can't be read in faults here, rather than wherever the
+	 * memory is used next */
+	sigjmp_buf env;
+	if (sigsetjmp(env, 0) != 0) {
+		fault_jmp = NULL;
+		
+		uint64_t sys_page = sysconf(_SC_PAGESIZE);
+		uint64_t fault_off = jgfs_dev_offset(fault_addr);
+		warnx("failed to read the device at %#" PRIx64, fault_off);
+		jgfs_bad_note(fault_off / sys_page * sys_page, sys_page);
+		
+		return -EIO;
+	}
+	
+	fault_jmp = &env;
+	jgfs_dev_touch(ptr, len);
+	fault_jmp = NULL;
+	
+	return 0;
+}
+
+uint64_t jgfs_dev_offset(const void *ptr) {
+	const char *p = ptr;
+	
+	if (p >= dev_base && p < dev_base + base_len) {
+		return p - dev_base;
+	} else if (dev == NULL || dev->layout == NULL) {
+		return UINT64_MAX;
+	}
+	
+	/* anywhere else, it is in the buffer of the pool given to its page */
+	uint32_t slot;
+	const struct jgfs_chunk *chunk = jgfs_pool_find(p, &slot);
+	if (chunk != NULL) {
+		uint64_t page = __atomic_load_n(chunk->page + slot, __ATOMIC_ACQUIRE);
+		const char *mem = __atomic_load_n(page_mem + page, __ATOMIC_ACQUIRE);
+		
+		if (mem != NULL && p >= mem && p < mem + jgfs_page_len(page)) {
+			return jgfs_page_off(page) + (p - mem);
+		}
+	}
+	
+	return UINT64_MAX;
+}
+
+uint64_t jgfs_dev_locked(void) {
+	return __atomic_load_n(&lock_bytes, __ATOMIC_RELAXED);
+}
+
+bool jgfs_dev_lock_wanted(void) {
+	return lock_wanted;
+}
+
+bool jgfs_dev_direct(void) {
+	return dev->direct;
+}
+
+bool jgfs_dev_chosen(void) {
+	return (dev_type != DEV_AUTO);
+}
+
+int jgfs_dev_check(void) {
+	return (__atomic_exchange_n(&dev_error, false, __ATOMIC_ACQ_REL) ?
+		-EIO : 0);
+}
+
+bool jgfs_dev_over(void) {
+	return (dev != NULL && dev->trim != NULL && __atomic_load_n(&cache_pages,
+		__ATOMIC_RELAXED) > jgfs_cache_max());
+}
+
+void jgfs_dev_trim(void) {
+	if (dev->trim != NULL) {
+		dev->trim();
+	}
+}
@@ -0,0 +1,508 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* most memory the indexes may take between them, past which the least
+ * recently used are dropped (the one in use is kept, however big it is) */
+#define DINDEX_MEM_MAX (16 << 20)
+
+/* marks an unused hash table bucket */
+#define DINDEX_EMPTY UINT32_MAX
+
+
+struct jgfs_dindex_bucket {
+	uint32_t hash; // hash of the dir ent's name
+	uint32_t idx;  // dir ent number within the directory
+};
+
+/* in-memory hash index of the names in a directory; dir ents are numbered
+ * across the whole directory, and the table is kept at most half full */
+struct jgfs_dindex {
+	fat_ent_t                  begin;       // first cluster of the directory
+	                                        // (FAT_NALLOC if slot unused)
+	uint32_t                   n_ents;      // number of dir ent slots
+	uint32_t                   count;       // number of dir ents in use
+	uint32_t                   free_hint;   // no dir ent below this is free
+	uint32_t                   mask;        // number of buckets, minus one
+	struct jgfs_dindex_bucket *table;
+	uint32_t                   clust_cap;   // allocated length of clust_count
+	uint16_t                  *clust_count; // dir ents in use in each cluster
+	struct jgfs_chain          chain;       // the directory's cluster chain
+	struct jgfs_dindex        *prev;        // lru list, most recent first
+	struct jgfs_dindex        *next;
+};
+
+
+/* the index of each directory that has one, by its first cluster, and the
+ * same indexes from most to least recently used; and the memory they take */
+static struct jgfs_dindex **dindex_map  = NULL;
+static struct jgfs_dindex  *dindex_head = NULL;
+static struct jgfs_dindex  *dindex_tail = NULL;
+static size_t               dindex_mem  = 0;
+
+/* guards the indexes and the lists of them, which are shared by all
+ * directories; callers hold the lock on the directory itself as well */
+static pthread_mutex_t dindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint32_t jgfs_dindex_hash(const char *name) {
+	return jgfs_hash(name, strnlen(name, JGFS_NAME_LIMIT + 1));
+}
+
+static struct jgfs_dindex *jgfs_dindex_find(fat_ent_t begin) {
+	if (begin == FAT_NALLOC || dindex_map == NULL) {
+		return NULL;
+	}
+	
+	return dindex_map[begin];
+}
+
+static void jgfs_dindex_unlink(struct jgfs_dindex *dindex) {
+	if (dindex->prev != NULL) {
+		dindex->prev->next = dindex->next;
+	} else {
+		dindex_head = dindex->next;
+	}
+	
+	if (dindex->next != NULL) {
+		dindex->next->prev = dindex->prev;
+	} else {
+		dindex_tail = dindex->prev;
+	}
+}
+
+/* put the index at the front of the lru list */
+static void jgfs_dindex_link(struct jgfs_dindex *dindex) {
+	dindex->prev = NULL;
+	dindex->next = dindex_head;
+	
+	if (dindex_head != NULL) {
+		dindex_head->prev = dindex;
+	} else {
+		dindex_tail = dindex;
+	}
+	dindex_head = dindex;
+}
+
+static void jgfs_dindex_drop(struct jgfs_dindex *dindex) {
+	jgfs_dindex_unlink(dindex);
+	dindex_map[dindex->begin] = NULL;
+	
+	dindex_mem -= sizeof(*dindex) + ((dindex->mask + 1) *
+		sizeof(struct jgfs_dindex_bucket)) + (dindex->clust_cap *
+		sizeof(uint16_t)) + (dindex->chain.cap * sizeof(fat_ent_t));
+	
+	free(dindex->table);
+	free(dindex->clust_count);
+	jgfs_chain_free(&dindex->chain);
+	free(dindex);
+}
+
+/* get cluster n of the directory, as jgfs_chain_follow */
+static fat_ent_t jgfs_dindex_follow(struct jgfs_dindex *dindex, uint16_t n,
+	uint16_t *len) {
+	uint32_t old_cap = dindex->chain.cap;
+	fat_ent_t addr = jgfs_chain_follow(&dindex->chain, dindex->begin, n, len);
+	
+	dindex_mem += (dindex->chain.cap - old_cap) * sizeof(fat_ent_t);
+	
+	return addr;
+}
+
+/* get dir ent number idx of the directory, as jgfs_dir_get */
+static struct jgfs_dir_ent *jgfs_dindex_ent(struct jgfs_dindex *dindex,
+	uint32_t idx) {
+	fat_ent_t addr = jgfs_dindex_follow(dindex, idx / JGFS_DENT_PER_C, NULL);
+	if (addr == FAT_EOF) {
+		return NULL;
+	}
+	
+	struct jgfs_dir_clust *dir_clust = jgfs_get_clust(addr);
+	return dir_clust->entries + (idx % JGFS_DENT_PER_C);
+}
+
+static void jgfs_dindex_add(struct jgfs_dindex *dindex, uint32_t idx,
+	uint32_t hash) {
+	uint32_t pos = hash & dindex->mask;
+	while (dindex->table[pos].idx != DINDEX_EMPTY) {
+		pos = (pos + 1) & dindex->mask;
+	}
+	
+	dindex->table[pos].hash = hash;
+	dindex->table[pos].idx  = idx;
+}
+
+/* reallocate the hash table with n_buckets buckets and rehash into it */
+static void jgfs_dindex_rehash(struct jgfs_dindex *dindex,
+	uint32_t n_buckets) {
+	struct jgfs_dindex_bucket *old_table = dindex->table;
+	uint32_t old_buckets = (old_table != NULL ? dindex->mask + 1 : 0);
+	
+	if ((dindex->table = malloc(n_buckets *
+		sizeof(struct jgfs_dindex_bucket))) == NULL) {
+		err(1, "jgfs_dindex_rehash: malloc failed");
+	}
+	
+	dindex_mem += (n_buckets - old_buckets) *
+		sizeof(struct jgfs_dindex_bucket);
+	
+	dindex->mask = n_buckets - 1;
+	for (uint32_t i = 0; i < n_buckets; ++i) {
+		dindex->table[i].idx = DINDEX_EMPTY;
+	}
+	
+	for (uint32_t i = 0; i < old_buckets; ++i) {
+		if (old_table[i].idx != DINDEX_EMPTY) {
+			jgfs_dindex_add(dindex, old_table[i].idx, old_table[i].hash);
+		}
+	}
+	
+	free(old_table);
+}
+
+/* track the directory's current size, which changes as it grows and shrinks */
+static void jgfs_dindex_resize(struct jgfs_dindex *dindex,
+	struct jgfs_dir_ent *dir) {
+	uint32_t n_clust = dir->size / jgfs_clust_size();
+	uint32_t n_ents  = n_clust * JGFS_DENT_PER_C;
+	
+	if (n_ents == dindex->n_ents) {
+		return;
+	}
+	
+	if (n_clust > dindex->clust_cap) {
+		uint32_t new_cap = (dindex->clust_cap == 0 ? 16 : dindex->clust_cap);
+		while (new_cap < n_clust) {
+			new_cap *= 2;
+		}
+		
+		if ((dindex->clust_count = realloc(dindex->clust_count,
+			new_cap * sizeof(uint16_t))) == NULL) {
+			err(1, "jgfs_dindex_resize: realloc failed");
+		}
+		
+		dindex_mem += (new_cap - dindex->clust_cap) * sizeof(uint16_t);
+		dindex->clust_cap = new_cap;
+	}
+	
+	/* clusters appended to a directory always start out empty, and only empty
+	 * clusters are ever cut off the end */
+	uint32_t old_clust = dindex->n_ents / JGFS_DENT_PER_C;
+	for (uint32_t i = old_clust; i < n_clust; ++i) {
+		dindex->clust_count[i] = 0;
+	}
+	
+	dindex->n_ents = n_ents;
+	if (dindex->free_hint > n_ents) {
+		dindex->free_hint = n_ents;
+	}
+}
+
+static void jgfs_dindex_advance(struct jgfs_dindex *dindex) {
+	uint32_t per_c = JGFS_DENT_PER_C;
+	
+	while (dindex->free_hint < dindex->n_ents) {
+		/* skip over full clusters without looking at them */
+		if (dindex->clust_count[dindex->free_hint / per_c] == per_c) {
+			dindex->free_hint = (dindex->free_hint / per_c + 1) * per_c;
+			continue;
+		}
+		
+		struct jgfs_dir_ent *dir_ent =
+			jgfs_dindex_ent(dindex, dindex->free_hint);
+		if (dir_ent == NULL || dir_ent->name[0] == '\0') {
+			break;
+		}
+		
+		++dindex->free_hint;
+	}
+}
+
+static struct jgfs_dindex *jgfs_dindex_build(struct jgfs_dir_ent *dir) {
+	if (dindex_map == NULL && (dindex_map = calloc(JGFS_FENT_PER_S *
+		jgfs.hdr->s_fat, sizeof(*dindex_map))) == NULL) {
+		err(1, "jgfs_dindex_build: calloc failed");
+	}
+	
+	struct jgfs_dindex *dindex;
+	if ((dindex = calloc(1, sizeof(*dindex))) == NULL) {
+		err(1, "jgfs_dindex_build: calloc failed");
+	}
+	dindex_mem += sizeof(*dindex);
+	
+	dindex->begin = dir->begin;
+	dindex_map[dir->begin] = dindex;
+	jgfs_dindex_link(dindex);
+	
+	jgfs_dindex_resize(dindex, dir);
+	jgfs_dindex_rehash(dindex, 16);
+	
+	uint32_t per_c = JGFS_DENT_PER_C;
+	for (uint32_t i = 0; i < dindex->n_ents / per_c; ++i) {
+		fat_ent_t addr = jgfs_dindex_follow(dindex, i, NULL);
+		
+		/* this means the filesystem is inconsistent */
+		if (addr == FAT_EOF) {
+			warnx("jgfs_dindex_build: dir clust chain is too short");
+			break;
+		}
+		
+		struct jgfs_dir_clust *dir_clust = jgfs_get_clust(addr);
+		for (uint32_t j = 0; j < per_c; ++j) {
+			if (dir_clust->entries[j].name[0] != '\0') {
+				if ((dindex->count + 1) * 2 > dindex->mask + 1) {
+					jgfs_dindex_rehash(dindex, (dindex->mask + 1) * 2);
+				}
+				
+				jgfs_dindex_add(dindex, i * per_c + j,
+					jgfs_dindex_hash(dir_clust->entries[j].name));
+				++dindex->count;
+				++dindex->clust_count[i];
+			}
+		}
+	}
+	
+	jgfs_dindex_advance(dindex);
+	
+	return dindex;
+}
+
+/* the indexes are kept for every directory used, as long as they fit */
+static struct jgfs_dindex *jgfs_dindex_get(struct jgfs_dir_ent *dir) {
+	struct jgfs_dindex *dindex;
+	if ((dindex = jgfs_dindex_find(dir->begin)) == NULL) {
+		dindex = jgfs_dindex_build(dir);
+	} else {
+		jgfs_dindex_resize(dindex, dir);
+		
+		jgfs_dindex_unlink(dindex);
+		jgfs_dindex_link(dindex);
+	}
+	
+	while (dindex_mem > DINDEX_MEM_MAX && dindex_tail != dindex) {
+		jgfs_dindex_drop(dindex_tail);
+	}
+	
+	return dindex;
+}
+
+int jgfs_dindex_lookup(struct jgfs_dir_ent *dir, const char *name,
+	uint32_t *idx) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex = jgfs_dindex_get(dir);
+	uint32_t hash = jgfs_dindex_hash(name);
+	int rtn = -ENOENT;
+	
+	for (uint32_t pos = hash & dindex->mask;
+		dindex->table[pos].idx != DINDEX_EMPTY;
+		pos = (pos + 1) & dindex->mask) {
+		if (dindex->table[pos].hash != hash) {
+			continue;
+		}
+		
+		struct jgfs_dir_ent *this_ent =
+			jgfs_dindex_ent(dindex, dindex->table[pos].idx);
+		if (this_ent != NULL &&
+			strncmp(this_ent->name, name, JGFS_NAME_LIMIT + 1) == 0) {
+			*idx = dindex->table[pos].idx;
+			rtn = 0;
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&dindex_lock);
+	
+	return rtn;
+}
+
+bool jgfs_dindex_free(struct jgfs_dir_ent *dir, uint32_t *idx) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex = jgfs_dindex_get(dir);
+	
+	jgfs_dindex_advance(dindex);
+	bool found = (dindex->free_hint != dindex->n_ents);
+	*idx = dindex->free_hint;
+	
+	pthread_mutex_unlock(&dindex_lock);
+	
+	return found;
+}
+
+uint32_t jgfs_dindex_count(struct jgfs_dir_ent *dir) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	uint32_t count = jgfs_dindex_get(dir)->count;
+	
+	pthread_mutex_unlock(&dindex_lock);
+	
+	return count;
+}
+
+uint32_t jgfs_dindex_clusts(struct jgfs_dir_ent *dir) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex = jgfs_dindex_get(dir);
+	
+	uint32_t n_clust = dindex->n_ents / JGFS_DENT_PER_C;
+	while (n_clust > 0 && dindex->clust_count[n_clust - 1] == 0) {
+		--n_clust;
+	}
+	
+	pthread_mutex_unlock(&dindex_lock);
+	
+	return n_clust;
+}
+
+void jgfs_dindex_insert(struct jgfs_dir_ent *dir, uint32_t idx) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex;
+	if ((dindex = jgfs_dindex_find(dir->begin)) == NULL) {
+		pthread_mutex_unlock(&dindex_lock);
+		return;
+	}
+	
+	jgfs_dindex_resize(dindex, dir);
+	
+	if ((dindex->count + 1) * 2 > dindex->mask + 1) {
+		jgfs_dindex_rehash(dindex, (dindex->mask + 1) * 2);
+	}
+	
+	jgfs_dindex_add(dindex, idx,
+		jgfs_dindex_hash(jgfs_dindex_ent(dindex, idx)->name));
+	++dindex->count;
+	++dindex->clust_count[idx / JGFS_DENT_PER_C];
+	
+	if (idx == dindex->free_hint) {
+		++dindex->free_hint;
+	}
+	
+	pthread_mutex_unlock(&dindex_lock);
+}
+
+void jgfs_dindex_remove(struct jgfs_dir_ent *dir,
+	struct jgfs_dir_ent *dir_ent) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex;
+	if ((dindex = jgfs_dindex_find(dir->begin)) == NULL) {
+		pthread_mutex_unlock(&dindex_lock);
+		return;
+	}
+	
+	jgfs_dindex_resize(dindex, dir);
+	
+	/* find the bucket that refers to this particular dir ent */
+	uint32_t pos = jgfs_dindex_hash(dir_ent->name) & dindex->mask;
+	while (dindex->table[pos].idx == DINDEX_EMPTY ||
+		jgfs_dindex_ent(dindex, dindex->table[pos].idx) != dir_ent) {
+		if (dindex->table[pos].idx == DINDEX_EMPTY) {
+			errx(1, "jgfs_dindex_remove: dir ent '%s' not in index",
+				dir_ent->name);
+		}
+		
+		pos = (pos + 1) & dindex->mask;
+	}
+	
+	uint32_t idx = dindex->table[pos].idx;
+	
+	/* shift later members of the probe sequence back so that no lookup runs
+	 * into the hole we're about to leave */
+	for (uint32_t next = (pos + 1) & dindex->mask;
+		dindex->table[next].idx != DINDEX_EMPTY;
+		next = (next + 1) & dindex->mask) {
+		uint32_t home = dindex->table[next].hash & dindex->mask;
+		
+		if (((next - home) & dindex->mask) >= ((next - pos) & dindex->mask)) {
+			dindex->table[pos] = dindex->table[next];
+			pos = next;
+		}
+	}
+	
+	dindex->table[pos].idx = DINDEX_EMPTY;
+	--dindex->count;
+	--dindex->clust_count[idx / JGFS_DENT_PER_C];
+	
+	if (idx < dindex->free_hint) {
+		dindex->free_hint = idx;
+	}
+	
+	pthread_mutex_unlock(&dindex_lock);
+}
+
+fat_ent_t jgfs_dindex_chain(struct jgfs_dir_ent *dir, uint16_t n,
+	uint16_t *len) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	fat_ent_t addr = jgfs_dindex_follow(jgfs_dindex_get(dir), n, len);
+	
+	pthread_mutex_unlock(&dindex_lock);
+	
+	return addr;
+}
+
+/* a directory whose index has been dropped has its chain followed along the
+ * fat, rather than have the whole directory read to build the index again */
+fat_ent_t jgfs_dindex_clust(fat_ent_t begin, uint16_t n) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex;
+	if ((dindex = jgfs_dindex_find(begin)) != NULL) {
+		fat_ent_t addr = jgfs_dindex_follow(dindex, n, NULL);
+		
+		pthread_mutex_unlock(&dindex_lock);
+		return addr;
+	}
+	
+	pthread_mutex_unlock(&dindex_lock);
+	
+	return jgfs_chain_follow(NULL, begin, n, NULL);
+}
+
+void jgfs_dindex_trunc(struct jgfs_dir_ent *dir, uint16_t len) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex;
+	if ((dindex = jgfs_dindex_find(dir->begin)) != NULL) {
+		jgfs_chain_cut(&dindex->chain, len);
+	}
+	
+	pthread_mutex_unlock(&dindex_lock);
+}
+
+void jgfs_dindex_forget(fat_ent_t begin) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	struct jgfs_dindex *dindex;
+	if ((dindex = jgfs_dindex_find(begin)) != NULL) {
+		jgfs_dindex_drop(dindex);
+	}
+	
+	pthread_mutex_unlock(&dindex_lock);
+}
+
+void jgfs_dindex_forget_all(void) {
+	pthread_mutex_lock(&dindex_lock);
+	
+	while (dindex_head != NULL) {
+		jgfs_dindex_drop(dindex_head);
+	}
+	
+	free(dindex_map);
+	dindex_map = NULL;
+	
+	pthread_mutex_unlock(&dindex_lock);
+}
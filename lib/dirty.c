@@ -0,0 +1,558 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+
+/* the most spans and bytes written back at once; fsync waits for at most one
+ * such batch */
+#define WB_SPANS 256
+#define WB_BATCH (4 << 20)
+
+
+/* what has changed in the device mapping since it last went to disk: one bit
+ * per data cluster and per fat sector, and one flag for everything before the
+ * fat (the vbr, the header with the root dir ent, and the boot area); bits are
+ * set after the change is made, and cleared before it is flushed, so that a
+ * change made during a flush is never lost */
+static uint64_t dirty_clust[0x10000 / 64];
+static uint64_t dirty_fat[0x10000 / 64];
+static bool     dirty_hdr = false;
+
+/* the number of bytes the set bits stand for */
+static uint64_t dirty_total = 0;
+
+/* held exclusively by the writeback thread from clearing a batch of bits until
+ * the batch is on disk, and shared by fsync, so that a bit fsync finds clear is
+ * never for data still on its way */
+static pthread_rwlock_t wb_lock =
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+	PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+	PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+/* the writeback thread, which waits on wb_cond for an interval to pass or for
+ * wb_kick to be set */
+static struct jgfs_wb_param wb_param;
+static pthread_t            wb_thread;
+static bool                 wb_running = false;
+static bool                 wb_stop    = false;
+static bool                 wb_kick    = false;
+static pthread_mutex_t      wb_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       wb_cond;
+
+
+static uint64_t jgfs_fat_off(void) {
+	return (uint64_t)(JGFS_BOOT_SECT + jgfs.hdr->s_boot) * SECT_SIZE;
+}
+
+static uint64_t jgfs_data_off(void) {
+	return jgfs_fat_off() + ((uint64_t)jgfs.hdr->s_fat * SECT_SIZE);
+}
+
+void jgfs_writeback_kick(void) {
+	if (__atomic_load_n(&wb_running, __ATOMIC_ACQUIRE) &&
+		!__atomic_exchange_n(&wb_kick, true, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock(&wb_mutex);
+		pthread_cond_signal(&wb_cond);
+		pthread_mutex_unlock(&wb_mutex);
+	}
+}
+
+/* count bytes newly changed, waking the writeback thread if they have built up
+ * past its threshold */
+static void jgfs_dirty_count(uint64_t bytes) {
+	uint64_t total =
+		__atomic_add_fetch(&dirty_total, bytes, __ATOMIC_RELAXED);
+	
+	if (wb_param.dirty_bytes != 0 && total >= wb_param.dirty_bytes) {
+		jgfs_writeback_kick();
+	}
+}
+
+static void jgfs_dirty_set(uint64_t *map, uint64_t first, uint64_t last,
+	uint32_t unit) {
+	if (last > 0xffff) {
+		last = 0xffff;
+	}
+	
+	uint64_t added = 0;
+	for (uint64_t i = first; i <= last; ++i) {
+		uint64_t bit = 1ULL << (i % 64);
+		
+		if ((__atomic_fetch_or(map + (i / 64), bit, __ATOMIC_RELEASE) &
+			bit) == 0) {
+			added += unit;
+		}
+	}
+	
+	if (added != 0) {
+		jgfs_dirty_count(added);
+	}
+}
+
+/* note that len bytes at off on the device have changed */
+static void jgfs_dirty_span(uint64_t off, uint64_t len) {
+	uint64_t end = off + len;
+	uint64_t fat_off = jgfs_fat_off(), data_off = jgfs_data_off();
+	
+	/* a pointer outside the filesystem (such as at the dir ent of an unlinked
+	 * file, which is kept in memory) has nothing on disk to flush */
+	if (len == 0 || off >= (uint64_t)jgfs.hdr->s_total * SECT_SIZE) {
+		return;
+	}
+	
+	if (off < fat_off) {
+		if (!__atomic_exchange_n(&dirty_hdr, true, __ATOMIC_RELEASE)) {
+			jgfs_dirty_count(fat_off);
+		}
+		off = fat_off;
+	}
+	
+	if (off < end && off < data_off) {
+		uint64_t fat_end = (end < data_off ? end : data_off);
+		
+		jgfs_dirty_set(dirty_fat, (off - fat_off) / SECT_SIZE,
+			(fat_end - 1 - fat_off) / SECT_SIZE, SECT_SIZE);
+		off = fat_end;
+	}
+	
+	if (off < end) {
+		jgfs_dirty_set(dirty_clust, (off - data_off) / jgfs_clust_size(),
+			(end - 1 - data_off) / jgfs_clust_size(), jgfs_clust_size());
+	}
+}
+
+/* clear bit n of map, returning whether it was set */
+static bool jgfs_dirty_take(uint64_t *map, uint32_t n, uint32_t unit) {
+	uint64_t bit = 1ULL << (n % 64);
+	
+	/* don't write to words that have nothing to clear */
+	if ((__atomic_load_n(map + (n / 64), __ATOMIC_RELAXED) & bit) == 0) {
+		return false;
+	}
+	
+	if ((__atomic_fetch_and(map + (n / 64), ~bit, __ATOMIC_ACQ_REL) &
+		bit) == 0) {
+		return false;
+	}
+	
+	__atomic_sub_fetch(&dirty_total, unit, __ATOMIC_RELAXED);
+	return true;
+}
+
+static bool jgfs_dirty_take_hdr(void) {
+	if (!__atomic_exchange_n(&dirty_hdr, false, __ATOMIC_ACQ_REL)) {
+		return false;
+	}
+	
+	__atomic_sub_fetch(&dirty_total, jgfs_fat_off(), __ATOMIC_RELAXED);
+	return true;
+}
+
+/* get the first set bit of map at or after n, or limit if there is none before
+ * it */
+static uint32_t jgfs_dirty_next(const uint64_t *map, uint32_t n,
+	uint32_t limit) {
+	while (n < limit) {
+		uint64_t bits = __atomic_load_n(map + (n / 64), __ATOMIC_RELAXED) &
+			(~0ULL << (n % 64));
+		
+		if (bits != 0) {
+			n = ((n / 64) * 64) + __builtin_ctzll(bits);
+			return (n < limit ? n : limit);
+		}
+		
+		n = ((n / 64) + 1) * 64;
+	}
+	
+	return limit;
+}
+
+/* add a span to the list, merging it into the last one if they meet */
+static void jgfs_flush_add(struct jgfs_flush *flush, size_t *count,
+	uint64_t off, uint64_t len) {
+	if (*count != 0 && flush[*count - 1].off + flush[*count - 1].len == off) {
+		flush[*count - 1].len += len;
+	} else {
+		flush[*count].off = off;
+		flush[*count].len = len;
+		++*count;
+	}
+}
+
+/* write back count spans (and flush the device's cache, if barrier is set); on
+ * failure, the spans are noted as changed again and posix error code is
+ * returned */
+static int jgfs_flush_write(const struct jgfs_flush *flush, size_t count,
+	bool barrier) {
+	int rtn = jgfs_dev_flush(flush, count, barrier);
+	
+	if (rtn != 0) {
+		for (size_t i = 0; i < count; ++i) {
+			jgfs_dirty_span(flush[i].off, flush[i].len);
+		}
+	}
+	
+	return rtn;
+}
+
+int jgfs_writeback(void) {
+	/* with a journal, the header, the fat and directories are left for the
+	 * commit at the end, so that they go to disk through it, after the data
+	 * they lead to */
+	bool logged = jgfs_journal_active();
+	
+	uint32_t clust_size = jgfs_clust_size();
+	uint64_t fat_off = jgfs_fat_off(), data_off = jgfs_data_off();
+	
+	/* units are numbered with the header first, then the fat sectors, then the
+	 * clusters */
+	uint32_t fat_first = 1, clust_first = fat_first + jgfs.hdr->s_fat;
+	uint32_t units = clust_first + jgfs_fs_clusters();
+	
+	struct jgfs_flush flush[WB_SPANS];
+	uint32_t n = 0;
+	
+	while (n < units) {
+		size_t count = 0;
+		uint64_t bytes = 0;
+		
+		pthread_rwlock_wrlock(&wb_lock);
+		
+		while (n < units && count < WB_SPANS && bytes < WB_BATCH) {
+			if (n < fat_first) {
+				if (!logged && jgfs_dirty_take_hdr()) {
+					jgfs_flush_add(flush, &count, 0, fat_off);
+					bytes += fat_off;
+				}
+				n = fat_first;
+			} else if (n < clust_first && logged) {
+				n = clust_first;
+			} else if (n < clust_first) {
+				n = fat_first + jgfs_dirty_next(dirty_fat, n - fat_first,
+					clust_first - fat_first);
+				if (n < clust_first) {
+					if (jgfs_dirty_take(dirty_fat, n - fat_first, SECT_SIZE)) {
+						jgfs_flush_add(flush, &count, fat_off +
+							((uint64_t)(n - fat_first) * SECT_SIZE), SECT_SIZE);
+						bytes += SECT_SIZE;
+					}
+					++n;
+				}
+			} else {
+				n = clust_first + jgfs_dirty_next(dirty_clust,
+					n - clust_first, units - clust_first);
+				if (n < units) {
+					if (!jgfs_journal_logged(n - clust_first) &&
+						jgfs_dirty_take(dirty_clust, n - clust_first,
+						clust_size)) {
+						jgfs_flush_add(flush, &count, data_off +
+							((uint64_t)(n - clust_first) * clust_size),
+							clust_size);
+						bytes += clust_size;
+					}
+					++n;
+				}
+			}
+		}
+		
+		int rtn = jgfs_flush_write(flush, count, false);
+		
+		pthread_rwlock_unlock(&wb_lock);
+		
+		if (rtn != 0) {
+			return rtn;
+		}
+	}
+	
+	return (logged ? jgfs_journal_commit() : 0);
+}
+
+static void *jgfs_writeback_thread(void *arg) {
+	struct timespec due;
+	
+	pthread_mutex_lock(&wb_mutex);
+	
+	while (!wb_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &due);
+		due.tv_sec  += wb_param.interval / 1000;
+		due.tv_nsec += (wb_param.interval % 1000) * 1000000L;
+		if (due.tv_nsec >= 1000000000L) {
+			due.tv_nsec -= 1000000000L;
+			++due.tv_sec;
+		}
+		
+		/* sleep until the interval is up or enough has changed */
+		int rtn = 0;
+		while (!wb_stop && rtn != ETIMEDOUT &&
+			!__atomic_load_n(&wb_kick, __ATOMIC_ACQUIRE)) {
+			if (wb_param.interval != 0) {
+				rtn = pthread_cond_timedwait(&wb_cond, &wb_mutex, &due);
+			} else {
+				pthread_cond_wait(&wb_cond, &wb_mutex);
+			}
+		}
+		
+		__atomic_store_n(&wb_kick, false, __ATOMIC_RELEASE);
+		
+		/* on failure, try again next time rather than spin on a failing
+		 * device */
+		if (!wb_stop) {
+			pthread_mutex_unlock(&wb_mutex);
+			
+			if ((rtn = jgfs_writeback()) != 0) {
+				warnx("writeback failed: %s", strerror(-rtn));
+			}
+			
+			pthread_mutex_lock(&wb_mutex);
+		}
+	}
+	
+	pthread_mutex_unlock(&wb_mutex);
+	
+	return NULL;
+}
+
+void jgfs_dirty(const void *ptr, size_t len) {
+	jgfs_dirty_span(jgfs_dev_offset(ptr), len);
+}
+
+bool jgfs_dirty_test(uint64_t off, uint64_t len) {
+	uint64_t end = off + len;
+	uint64_t fat_off = jgfs_fat_off(), data_off = jgfs_data_off();
+	
+	if (off < fat_off && __atomic_load_n(&dirty_hdr, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
+	
+	for (uint64_t at = (off > fat_off ? off : fat_off);
+		at < end && at < data_off; at += SECT_SIZE) {
+		uint32_t n = (at - fat_off) / SECT_SIZE;
+		
+		if ((__atomic_load_n(dirty_fat + (n / 64), __ATOMIC_ACQUIRE) &
+			(1ULL << (n % 64))) != 0) {
+			return true;
+		}
+	}
+	
+	for (uint64_t at = (off > data_off ? off : data_off); at < end;
+		at += jgfs_clust_size()) {
+		uint32_t n = (at - data_off) / jgfs_clust_size();
+		
+		if (n <= 0xffff && (__atomic_load_n(dirty_clust + (n / 64),
+			__ATOMIC_ACQUIRE) & (1ULL << (n % 64))) != 0) {
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+void jgfs_dirty_clear(void) {
+	uint64_t cleared = 0;
+	
+	for (uint32_t i = 0; i < 0x10000 / 64; ++i) {
+		cleared += (uint64_t)__builtin_popcountll(__atomic_exchange_n(
+			dirty_clust + i, 0, __ATOMIC_ACQ_REL)) * jgfs_clust_size();
+		cleared += (uint64_t)__builtin_popcountll(__atomic_exchange_n(
+			dirty_fat + i, 0, __ATOMIC_ACQ_REL)) * SECT_SIZE;
+	}
+	
+	if (__atomic_exchange_n(&dirty_hdr, false, __ATOMIC_ACQ_REL)) {
+		cleared += jgfs_fat_off();
+	}
+	
+	__atomic_sub_fetch(&dirty_total, cleared, __ATOMIC_RELAXED);
+}
+
+uint64_t jgfs_dirty_bytes(void) {
+	return __atomic_load_n(&dirty_total, __ATOMIC_RELAXED);
+}
+
+bool jgfs_dirty_take_logged(struct jgfs_flush *flush, size_t *count,
+	uint64_t limit) {
+	uint32_t clust_size = jgfs_clust_size();
+	uint64_t fat_off = jgfs_fat_off(), data_off = jgfs_data_off();
+	uint64_t bytes = 0;
+	
+	if (__atomic_load_n(&dirty_hdr, __ATOMIC_ACQUIRE)) {
+		if (bytes + fat_off > limit) {
+			return false;
+		}
+		if (jgfs_dirty_take_hdr()) {
+			jgfs_flush_add(flush, count, 0, fat_off);
+			bytes += fat_off;
+		}
+	}
+	
+	for (uint32_t n = jgfs_dirty_next(dirty_fat, 0, jgfs.hdr->s_fat);
+		n < jgfs.hdr->s_fat;
+		n = jgfs_dirty_next(dirty_fat, n + 1, jgfs.hdr->s_fat)) {
+		if (bytes + SECT_SIZE > limit) {
+			return false;
+		}
+		if (jgfs_dirty_take(dirty_fat, n, SECT_SIZE)) {
+			jgfs_flush_add(flush, count, fat_off + ((uint64_t)n * SECT_SIZE),
+				SECT_SIZE);
+			bytes += SECT_SIZE;
+		}
+	}
+	
+	uint32_t clusters = jgfs_fs_clusters();
+	for (uint32_t n = jgfs_dirty_next(dirty_clust, 0, clusters); n < clusters;
+		n = jgfs_dirty_next(dirty_clust, n + 1, clusters)) {
+		if (!jgfs_journal_logged(n)) {
+			continue;
+		}
+		if (bytes + clust_size > limit) {
+			return false;
+		}
+		if (jgfs_dirty_take(dirty_clust, n, clust_size)) {
+			jgfs_flush_add(flush, count, data_off + ((uint64_t)n * clust_size),
+				clust_size);
+			bytes += clust_size;
+		}
+	}
+	
+	return true;
+}
+
+int jgfs_sync_file(struct jgfs_dir_ent *dir_ent) {
+	uint32_t clust_size = jgfs_clust_size();
+	uint64_t data_off = jgfs_data_off();
+	
+	/* with a journal, only the file's data is flushed here; the rest is left
+	 * for the commit that the caller makes after letting go of its locks */
+	bool logged = jgfs_journal_active();
+	
+	/* at most one span per cluster of the file, one for the cluster holding
+	 * its dir ent, one per fat sector, and one for the header */
+	uint32_t clust_count = CEIL(dir_ent->size, clust_size);
+	
+	struct jgfs_flush *flush;
+	size_t count = 0;
+	if ((flush = malloc((clust_count + 2 + jgfs.hdr->s_fat) *
+		sizeof(*flush))) == NULL) {
+		return -ENOMEM;
+	}
+	
+	pthread_rwlock_rdlock(&wb_lock);
+	
+	/* the file's own clusters */
+	fat_ent_t addr = (dir_ent->size != 0 ? dir_ent->begin : FAT_EOF);
+	for (uint32_t i = 0; i < clust_count && addr < jgfs_fs_clusters(); ++i) {
+		if (!jgfs_journal_logged(addr) &&
+			jgfs_dirty_take(dirty_clust, addr, clust_size)) {
+			jgfs_flush_add(flush, &count, data_off + ((uint64_t)addr *
+				clust_size), clust_size);
+		}
+		
+		addr = jgfs_fat_read(addr);
+	}
+	
+	/* the directory cluster holding its dir ent (the root dir ent is in the
+	 * header, which comes last) */
+	uint64_t ent_off = jgfs_dev_offset(dir_ent);
+	if (!logged && ent_off >= data_off &&
+		ent_off < (uint64_t)jgfs.hdr->s_total * SECT_SIZE) {
+		fat_ent_t ent_clust = (ent_off - data_off) / clust_size;
+		
+		if (jgfs_dirty_take(dirty_clust, ent_clust, clust_size)) {
+			jgfs_flush_add(flush, &count, data_off + ((uint64_t)ent_clust *
+				clust_size), clust_size);
+		}
+	}
+	
+	/* the fat can't be told apart by file, but it is small; only the sectors
+	 * that changed are flushed */
+	for (uint16_t i = 0; i < jgfs.hdr->s_fat && !logged; ++i) {
+		if (jgfs_dirty_take(dirty_fat, i, SECT_SIZE)) {
+			jgfs_flush_add(flush, &count, jgfs_fat_off() +
+				((uint64_t)i * SECT_SIZE), SECT_SIZE);
+		}
+	}
+	
+	if (!logged && jgfs_dirty_take_hdr()) {
+		jgfs_flush_add(flush, &count, 0, jgfs_fat_off());
+	}
+	
+	/* the writeback thread leaves what it writes in the device's volatile
+	 * cache, so have that flushed along with these (or by the commit) */
+	int rtn = jgfs_flush_write(flush, count, !logged);
+	
+	/* a failure to read from the device since the last fsync is reported now,
+	 * as the kernel does for failed writeback */
+	if (rtn == 0) {
+		rtn = jgfs_dev_check();
+	}
+	
+	pthread_rwlock_unlock(&wb_lock);
+	
+	free(flush);
+	
+	return rtn;
+}
+
+bool jgfs_writeback_hold(void) {
+	return (pthread_rwlock_tryrdlock(&wb_lock) == 0);
+}
+
+void jgfs_writeback_release(void) {
+	pthread_rwlock_unlock(&wb_lock);
+}
+
+void jgfs_writeback_start(const struct jgfs_wb_param *param) {
+	if (wb_running || (param->interval == 0 && param->dirty_bytes == 0)) {
+		return;
+	}
+	
+	wb_param = *param;
+	wb_stop  = false;
+	wb_kick  = false;
+	
+	/* the interval is measured on a clock that doesn't jump */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wb_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	
+	int err;
+	if ((err = pthread_create(&wb_thread, NULL, jgfs_writeback_thread,
+		NULL)) != 0) {
+		warnx("jgfs_writeback_start: pthread_create: %s", strerror(err));
+		pthread_cond_destroy(&wb_cond);
+		return;
+	}
+	
+	__atomic_store_n(&wb_running, true, __ATOMIC_RELEASE);
+}
+
+void jgfs_writeback_stop(void) {
+	if (!wb_running) {
+		return;
+	}
+	
+	__atomic_store_n(&wb_running, false, __ATOMIC_RELEASE);
+	
+	pthread_mutex_lock(&wb_mutex);
+	wb_stop = true;
+	pthread_cond_signal(&wb_cond);
+	pthread_mutex_unlock(&wb_mutex);
+	
+	pthread_join(wb_thread, NULL);
+	pthread_cond_destroy(&wb_cond);
+}
@@ -0,0 +1,301 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+
+/* fat scanning kernels: each one works on a flat array of n fat entries */
+struct jgfs_scan_ops {
+	size_t (*find)(const fat_ent_t *ents, size_t n, fat_ent_t target);
+	size_t (*count)(const fat_ent_t *ents, size_t n, fat_ent_t target);
+	void   (*mask)(const fat_ent_t *ents, size_t n, fat_ent_t target,
+		uint64_t *bits);
+};
+
+
+static size_t scan_find_scalar(const fat_ent_t *ents, size_t n,
+	fat_ent_t target) {
+	for (size_t i = 0; i < n; ++i) {
+		if (ents[i] == target) {
+			return i;
+		}
+	}
+	
+	return n;
+}
+
+static size_t scan_count_scalar(const fat_ent_t *ents, size_t n,
+	fat_ent_t target) {
+	size_t count = 0;
+	
+	for (size_t i = 0; i < n; ++i) {
+		if (ents[i] == target) {
+			++count;
+		}
+	}
+	
+	return count;
+}
+
+static void scan_mask_scalar(const fat_ent_t *ents, size_t n,
+	fat_ent_t target, uint64_t *bits) {
+	memset(bits, 0, CEIL(n, 64) * sizeof(uint64_t));
+	
+	for (size_t i = 0; i < n; ++i) {
+		if (ents[i] == target) {
+			bits[i / 64] |= (1ULL << (i % 64));
+		}
+	}
+}
+
+
+#ifdef SCAN_X86
+
+/* 16-bit compares produce two mask bits per entry; packing two compare results
+ * down to bytes first gives one bit per entry */
+
+__attribute__((__target__("sse2")))
+static size_t scan_find_sse2(const fat_ent_t *ents, size_t n,
+	fat_ent_t target) {
+	__m128i t = _mm_set1_epi16(target);
+	size_t i = 0;
+	
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_cmpeq_epi16(
+			_mm_loadu_si128((const __m128i *)(ents + i)), t);
+		__m128i b = _mm_cmpeq_epi16(
+			_mm_loadu_si128((const __m128i *)(ents + i + 8)), t);
+		
+		uint32_t m = _mm_movemask_epi8(_mm_packs_epi16(a, b));
+		if (m != 0) {
+			return i + __builtin_ctz(m);
+		}
+	}
+	
+	return i + scan_find_scalar(ents + i, n - i, target);
+}
+
+/* counting subtracts each compare result (0 or -1) from per-lane totals, which
+ * are folded into the scalar count before a 16-bit lane can overflow */
+#define COUNT_FOLD 0x7fff
+
+__attribute__((__target__("sse2")))
+static inline uint32_t scan_hsum_sse2(__m128i v) {
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	
+	return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((__target__("sse2")))
+static size_t scan_count_sse2(const fat_ent_t *ents, size_t n,
+	fat_ent_t target) {
+	__m128i t = _mm_set1_epi16(target), ones = _mm_set1_epi16(1);
+	size_t count = 0, i = 0;
+	
+	while (i + 8 <= n) {
+		__m128i acc = _mm_setzero_si128();
+		
+		for (size_t k = 0; k < COUNT_FOLD && i + 8 <= n; ++k, i += 8) {
+			acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(
+				_mm_loadu_si128((const __m128i *)(ents + i)), t));
+		}
+		
+		count += scan_hsum_sse2(_mm_madd_epi16(acc, ones));
+	}
+	
+	return count + scan_count_scalar(ents + i, n - i, target);
+}
+
+__attribute__((__target__("sse2")))
+static void scan_mask_sse2(const fat_ent_t *ents, size_t n,
+	fat_ent_t target, uint64_t *bits) {
+	__m128i t = _mm_set1_epi16(target);
+	size_t i = 0;
+	
+	for (; i + 64 <= n; i += 64) {
+		uint64_t word = 0;
+		
+		for (size_t j = 0; j < 64; j += 16) {
+			__m128i a = _mm_cmpeq_epi16(
+				_mm_loadu_si128((const __m128i *)(ents + i + j)), t);
+			__m128i b = _mm_cmpeq_epi16(
+				_mm_loadu_si128((const __m128i *)(ents + i + j + 8)), t);
+			
+			word |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+				_mm_packs_epi16(a, b)) << j;
+		}
+		
+		bits[i / 64] = word;
+	}
+	
+	if (i < n) {
+		scan_mask_scalar(ents + i, n - i, target, bits + (i / 64));
+	}
+}
+
+/* in 256-bit registers, packs works within each 128-bit lane, so the two
+ * middle quadwords come out swapped and have to be put back in order */
+#define AVX2_PACK_MASK(_a, _b) \
+	((uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64( \
+		_mm256_packs_epi16((_a), (_b)), _MM_SHUFFLE(3, 1, 2, 0))))
+
+__attribute__((__target__("avx2")))
+static size_t scan_find_avx2(const fat_ent_t *ents, size_t n,
+	fat_ent_t target) {
+	__m256i t = _mm256_set1_epi16(target);
+	size_t i = 0;
+	
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_cmpeq_epi16(
+			_mm256_loadu_si256((const __m256i *)(ents + i)), t);
+		__m256i b = _mm256_cmpeq_epi16(
+			_mm256_loadu_si256((const __m256i *)(ents + i + 16)), t);
+		
+		if (!_mm256_testz_si256(_mm256_or_si256(a, b),
+			_mm256_or_si256(a, b))) {
+			return i + __builtin_ctz(AVX2_PACK_MASK(a, b));
+		}
+	}
+	
+	return i + scan_find_scalar(ents + i, n - i, target);
+}
+
+__attribute__((__target__("avx2")))
+static size_t scan_count_avx2(const fat_ent_t *ents, size_t n,
+	fat_ent_t target) {
+	__m256i t = _mm256_set1_epi16(target), ones = _mm256_set1_epi16(1);
+	size_t count = 0, i = 0;
+	
+	while (i + 16 <= n) {
+		__m256i acc = _mm256_setzero_si256();
+		
+		for (size_t k = 0; k < COUNT_FOLD && i + 16 <= n; ++k, i += 16) {
+			acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(
+				_mm256_loadu_si256((const __m256i *)(ents + i)), t));
+		}
+		
+		__m256i sum = _mm256_madd_epi16(acc, ones);
+		count += scan_hsum_sse2(_mm_add_epi32(_mm256_castsi256_si128(sum),
+			_mm256_extracti128_si256(sum, 1)));
+	}
+	
+	return count + scan_count_scalar(ents + i, n - i, target);
+}
+
+__attribute__((__target__("avx2")))
+static void scan_mask_avx2(const fat_ent_t *ents, size_t n,
+	fat_ent_t target, uint64_t *bits) {
+	__m256i t = _mm256_set1_epi16(target);
+	size_t i = 0;
+	
+	for (; i + 64 <= n; i += 64) {
+		uint64_t word = 0;
+		
+		for (size_t j = 0; j < 64; j += 32) {
+			__m256i a = _mm256_cmpeq_epi16(
+				_mm256_loadu_si256((const __m256i *)(ents + i + j)), t);
+			__m256i b = _mm256_cmpeq_epi16(
+				_mm256_loadu_si256((const __m256i *)(ents + i + j + 16)), t);
+			
+			word |= (uint64_t)AVX2_PACK_MASK(a, b) << j;
+		}
+		
+		bits[i / 64] = word;
+	}
+	
+	if (i < n) {
+		scan_mask_scalar(ents + i, n - i, target, bits + (i / 64));
+	}
+}
+
+#endif
+
+
+static const struct jgfs_scan_ops scan_ops[] = {
+	[SCAN_SCALAR] = {
+		.find  = scan_find_scalar,
+		.count = scan_count_scalar,
+		.mask  = scan_mask_scalar,
+	},
+#ifdef SCAN_X86
+	[SCAN_SSE2] = {
+		.find  = scan_find_sse2,
+		.count = scan_count_sse2,
+		.mask  = scan_mask_sse2,
+	},
+	[SCAN_AVX2] = {
+		.find  = scan_find_avx2,
+		.count = scan_count_avx2,
+		.mask  = scan_mask_avx2,
+	},
+#endif
+};
+
+static const struct jgfs_scan_ops *scan = NULL;
+
+
+static bool jgfs_scan_supported(enum jgfs_scan_isa isa) {
+	switch (isa) {
+	case SCAN_SCALAR:
+		return true;
+#ifdef SCAN_X86
+	case SCAN_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case SCAN_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+enum jgfs_scan_isa jgfs_scan_select(enum jgfs_scan_isa isa) {
+	if (isa == SCAN_BEST) {
+		isa = SCAN_AVX2;
+	}
+	
+	/* fall back until we find something this cpu can run */
+	while (!jgfs_scan_supported(isa)) {
+		--isa;
+	}
+	
+	scan = &scan_ops[isa];
+	
+	return isa;
+}
+
+size_t jgfs_scan_find(const fat_ent_t *ents, size_t n, fat_ent_t target) {
+	if (scan == NULL) {
+		jgfs_scan_select(SCAN_BEST);
+	}
+	
+	return scan->find(ents, n, target);
+}
+
+size_t jgfs_scan_count(const fat_ent_t *ents, size_t n, fat_ent_t target) {
+	if (scan == NULL) {
+		jgfs_scan_select(SCAN_BEST);
+	}
+	
+	return scan->count(ents, n, target);
+}
+
+void jgfs_scan_mask(const fat_ent_t *ents, size_t n, fat_ent_t target,
+	uint64_t *bits) {
+	if (scan == NULL) {
+		jgfs_scan_select(SCAN_BEST);
+	}
+	
+	scan->mask(ents, n, target, bits);
+}
@@ -0,0 +1,525 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/* number of hash chains in the open file table; must be a power of two */
+#define FILE_BUCKETS 256
+
+/* how far ahead of a file being read in order its clusters are prefetched at
+ * first, in bytes; this doubles with each read in order, up to ra_max */
+#define RA_MIN (128 * 1024)
+
+
+/* an open file, shared by every handle on it and keyed by the current location
+ * of its dir ent */
+struct jgfs_file {
+	struct jgfs_dir_ent *dir_ent; // in its directory, or &orphan if unlinked
+	struct jgfs_dir_ent  orphan;  // holds the dir ent once it is unlinked
+	uint32_t             refs;    // number of handles (and kernel lookups)
+	uint32_t             cursor;  // cluster number << 16 | its address, for
+	                              // sequential access (FAT_EOF if unset)
+	uint32_t             ra_next; // where a read in order would start next
+	uint32_t             ra_end;  // how far clusters have been prefetched
+	uint32_t             ra_size; // how far ahead to prefetch them
+	struct jgfs_chain    chain;   // its cluster chain, as far as it has been
+	                              // followed
+	struct jgfs_file    *next;    // next in hash chain
+};
+
+
+static struct jgfs_file *files[FILE_BUCKETS];
+
+/* guards the table and the refs, dir_ent and chain of every open file; dir_ent
+ * only changes under the exclusive namespace lock, so it may be read without
+ * this while the namespace lock is held */
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the most bytes to prefetch ahead of a file being read in order */
+static uint32_t ra_max = JGFS_READAHEAD_DEFAULT;
+
+
+static struct jgfs_file **jgfs_file_bucket(
+	const struct jgfs_dir_ent *dir_ent) {
+	uintptr_t n = (uintptr_t)dir_ent / sizeof(struct jgfs_dir_ent);
+	
+	return &files[n & (FILE_BUCKETS - 1)];
+}
+
+static struct jgfs_file *jgfs_file_find(const struct jgfs_dir_ent *dir_ent) {
+	for (struct jgfs_file *file = *jgfs_file_bucket(dir_ent); file != NULL;
+		file = file->next) {
+		if (file->dir_ent == dir_ent) {
+			return file;
+		}
+	}
+	
+	return NULL;
+}
+
+static void jgfs_file_unlink(struct jgfs_file *file) {
+	struct jgfs_file **link = jgfs_file_bucket(file->dir_ent);
+	while (*link != file) {
+		link = &(*link)->next;
+	}
+	
+	*link = file->next;
+}
+
+static void jgfs_file_link(struct jgfs_file *file) {
+	struct jgfs_file **bucket = jgfs_file_bucket(file->dir_ent);
+	
+	file->next = *bucket;
+	*bucket = file;
+}
+
+struct jgfs_file *jgfs_file_open(struct jgfs_dir_ent *dir_ent) {
+	pthread_mutex_lock(&files_lock);
+	
+	struct jgfs_file *file;
+	if ((file = jgfs_file_find(dir_ent)) == NULL) {
+		if ((file = calloc(1, sizeof(*file))) == NULL) {
+			err(1, "jgfs_file_open: calloc failed");
+		}
+		
+		file->dir_ent = dir_ent;
+		file->cursor  = FAT_EOF;
+		jgfs_file_link(file);
+	}
+	
+	++file->refs;
+	
+	pthread_mutex_unlock(&files_lock);
+	
+	return file;
+}
+
+void jgfs_file_close(struct jgfs_file *file) {
+	jgfs_file_put(file, 1);
+}
+
+void jgfs_file_put(struct jgfs_file *file, uint32_t refs) {
+	pthread_mutex_lock(&files_lock);
+	
+	if (refs > file->refs) {
+		errx(1, "jgfs_file_put: dropping %" PRIu32 " of %" PRIu32 " refs",
+			refs, file->refs);
+	}
+	
+	bool last = ((file->refs -= refs) == 0);
+	if (last) {
+		jgfs_file_unlink(file);
+	}
+	
+	pthread_mutex_unlock(&files_lock);
+	
+	if (last) {
+		/* nothing can reach an orphan but its handles, so its clusters can
+		 * finally go; a commit of the journal mustn't catch the fat half
+		 * changed */
+		if (file->dir_ent == &file->orphan && file->orphan.size != 0) {
+			jgfs_lock_ns(false);
+			jgfs_reduce(&file->orphan, 0);
+			jgfs_unlock_ns();
+		}
+		
+		jgfs_chain_free(&file->chain);
+		free(file);
+	}
+}
+
+struct jgfs_dir_ent *jgfs_file_dir_ent(struct jgfs_file *file) {
+	return file->dir_ent;
+}
+
+fat_ent_t jgfs_file_clust(struct jgfs_file *file, uint16_t n) {
+	uint32_t cursor = __atomic_load_n(&file->cursor, __ATOMIC_RELAXED);
+	uint16_t cur_n = cursor >> 16;
+	fat_ent_t cur_addr = cursor & 0xffff;
+	
+	/* sequential access picks up where the last access left off */
+	fat_ent_t addr;
+	if (cur_addr != FAT_EOF && n == cur_n) {
+		addr = cur_addr;
+	} else if (cur_addr != FAT_EOF && n == cur_n + 1) {
+		addr = jgfs_fat_read(cur_addr);
+	} else {
+		pthread_mutex_lock(&files_lock);
+		addr = jgfs_chain_follow(&file->chain, file->dir_ent->begin, n, NULL);
+		pthread_mutex_unlock(&files_lock);
+	}
+	
+	jgfs_file_seek(file, n, addr);
+	
+	return addr;
+}
+
+void jgfs_file_seek(struct jgfs_file *file, uint16_t n, fat_ent_t addr) {
+	if (addr >= FAT_FIRST && addr <= FAT_LAST) {
+		__atomic_store_n(&file->cursor, ((uint32_t)n << 16) | addr,
+			__ATOMIC_RELAXED);
+	}
+}
+
+void jgfs_file_moved(struct jgfs_dir_ent *dir_ent,
+	struct jgfs_dir_ent *new_dir_ent) {
+	pthread_mutex_lock(&files_lock);
+	
+	struct jgfs_file *file;
+	if ((file = jgfs_file_find(dir_ent)) != NULL) {
+		jgfs_file_unlink(file);
+		file->dir_ent = new_dir_ent;
+		jgfs_file_link(file);
+	}
+	
+	pthread_mutex_unlock(&files_lock);
+}
+
+bool jgfs_file_orphan(struct jgfs_dir_ent *dir_ent) {
+	pthread_mutex_lock(&files_lock);
+	
+	struct jgfs_file *file;
+	if ((file = jgfs_file_find(dir_ent)) != NULL) {
+		jgfs_file_unlink(file);
+		file->orphan  = *dir_ent;
+		file->dir_ent = &file->orphan;
+		jgfs_file_link(file);
+	}
+	
+	pthread_mutex_unlock(&files_lock);
+	
+	return (file != NULL);
+}
+
+void jgfs_file_trunc(struct jgfs_dir_ent *dir_ent, uint16_t len) {
+	pthread_mutex_lock(&files_lock);
+	
+	struct jgfs_file *file;
+	if ((file = jgfs_file_find(dir_ent)) != NULL &&
+		(__atomic_load_n(&file->cursor, __ATOMIC_RELAXED) >> 16) >= len) {
+		__atomic_store_n(&file->cursor, FAT_EOF, __ATOMIC_RELAXED);
+	}
+	
+	/* clusters added after this need prefetching again */
+	if (file != NULL) {
+		__atomic_store_n(&file->ra_end, 0, __ATOMIC_RELAXED);
+		jgfs_chain_cut(&file->chain, len);
+	}
+	
+	pthread_mutex_unlock(&files_lock);
+}
+
+bool jgfs_file_chain(const struct jgfs_dir_ent *dir_ent, uint16_t n,
+	fat_ent_t *addr, uint16_t *len) {
+	pthread_mutex_lock(&files_lock);
+	
+	struct jgfs_file *file;
+	if ((file = jgfs_file_find(dir_ent)) != NULL) {
+		*addr = jgfs_chain_follow(&file->chain, dir_ent->begin, n, len);
+	}
+	
+	pthread_mutex_unlock(&files_lock);
+	
+	return (file != NULL);
+}
+
+void jgfs_file_close_all(void) {
+	for (struct jgfs_file **bucket = files; bucket < files + FILE_BUCKETS;
+		++bucket) {
+		while (*bucket != NULL) {
+			struct jgfs_file *file = *bucket;
+			
+			jgfs_file_put(file, file->refs);
+		}
+	}
+}
+
+void jgfs_file_readahead(uint32_t max) {
+	ra_max = max;
+}
+
+/* get cluster n of dir_ent, through the cursor of file if not NULL */
+static fat_ent_t jgfs_data_clust(struct jgfs_dir_ent *dir_ent,
+	struct jgfs_file *file, uint16_t n) {
+	if (file != NULL) {
+		return jgfs_file_clust(file, n);
+	} else {
+		return jgfs_chain_get(dir_ent, n);
+	}
+}
+
+/* after a read of file from start to end, which stopped short of cluster n at
+ * addr: if the read took up where the last one left off, prefetch the clusters
+ * following it along the chain (wherever they are on the device), each run of
+ * contiguous ones at once; any other read is taken for random access, and
+ * stops prefetching until reads are in order again */
+static void jgfs_read_ahead(struct jgfs_dir_ent *dir_ent,
+	struct jgfs_file *file, uint64_t start, uint64_t end, uint16_t n,
+	fat_ent_t addr) {
+	uint32_t clust_size = jgfs_clust_size();
+	
+	if (__atomic_exchange_n(&file->ra_next, end, __ATOMIC_RELAXED) != start) {
+		__atomic_store_n(&file->ra_size, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&file->ra_end,  0, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	/* the longer a file has been read in order, the further ahead to go */
+	uint32_t ra_size = __atomic_load_n(&file->ra_size, __ATOMIC_RELAXED);
+	if (ra_size == 0) {
+		ra_size = (RA_MIN < ra_max ? RA_MIN : ra_max);
+	} else if (ra_size < ra_max / 2) {
+		ra_size *= 2;
+	} else {
+		ra_size = ra_max;
+	}
+	__atomic_store_n(&file->ra_size, ra_size, __ATOMIC_RELAXED);
+	
+	/* wait until the reader is halfway through what was prefetched last, so
+	 * as to prefetch in batches rather than a cluster per read */
+	uint64_t ra_end = __atomic_load_n(&file->ra_end, __ATOMIC_RELAXED);
+	if (ra_end >= end + (ra_size / 2)) {
+		return;
+	}
+	
+	uint64_t target = end + ra_size;
+	if (target > dir_ent->size) {
+		target = dir_ent->size;
+	}
+	
+	uint64_t from = (uint64_t)n * clust_size;
+	if (ra_end > from) {
+		n    = ra_end / clust_size;
+		addr = jgfs_chain_get(dir_ent, n);
+		from = (uint64_t)n * clust_size;
+	}
+	
+	uint64_t run_off = 0, run_len = 0;
+	fat_ent_t last_addr = FAT_EOF;
+	while (from < target && addr >= FAT_FIRST && addr <= FAT_LAST) {
+		uint64_t off = jgfs_data_offset(addr);
+		
+		if (run_len != 0 && addr == last_addr + 1) {
+			run_len += clust_size;
+		} else {
+			jgfs_dev_prefetch(run_off, run_len);
+			
+			run_off = off;
+			run_len = clust_size;
+		}
+		
+		last_addr = addr;
+		addr      = jgfs_fat_read(addr);
+		from     += clust_size;
+	}
+	jgfs_dev_prefetch(run_off, run_len);
+	
+	if (from > target) {
+		from = target;
+	}
+	__atomic_store_n(&file->ra_end, from, __ATOMIC_RELAXED);
+}
+
+/* point iov at up to size bytes at offset of the file with dir_ent, and bring
+ * them in, as jgfs_read_iov does, reading and checking for read errors only
+ * the first probe_len bytes; leaves the number of the cluster after the last
+ * one in *clust_n and its address in *data_addr */
+static int jgfs_map_iov(struct jgfs_dir_ent *dir_ent, struct jgfs_file *file,
+	struct iovec *iov, size_t size, uint64_t offset, uint64_t probe_len,
+	uint16_t *clust_n_out, fat_ent_t *data_addr_out) {
+	uint32_t clust_size = jgfs_clust_size();
+	
+	uint32_t file_size = dir_ent->size;
+	int iov_count = 0;
+	
+	/* immediate EOF check */
+	if (file_size <= offset) {
+		return 0;
+	}
+	
+	/* skip to the first cluster requested */
+	uint16_t clust_n = offset / clust_size;
+	fat_ent_t data_addr = jgfs_data_clust(dir_ent, file, clust_n), last_addr;
+	file_size -= offset;
+	offset    %= clust_size;
+	
+	while (size > 0 && file_size > 0) {
+		uint32_t size_this_cluster;
+		
+		if (size < file_size) {
+			size_this_cluster = size;
+		} else {
+			size_this_cluster = file_size;
+		}
+		
+		/* read to the end of this cluster on this iteration */
+		if (size_this_cluster > (clust_size - offset)) {
+			size_this_cluster = (clust_size - offset);
+		}
+		
+		/* clusters that follow each other on disk, and in memory, make a
+		 * single run */
+		char *data = (char *)jgfs_data_addr(data_addr) + offset;
+		if (iov_count != 0 && data_addr == last_addr + 1 &&
+			data == (char *)iov[iov_count - 1].iov_base +
+			iov[iov_count - 1].iov_len) {
+			iov[iov_count - 1].iov_len += size_this_cluster;
+		} else {
+			iov[iov_count].iov_base = data;
+			iov[iov_count].iov_len  = size_this_cluster;
+			++iov_count;
+		}
+		
+		size      -= size_this_cluster;
+		file_size -= size_this_cluster;
+		
+		offset     = 0;
+		
+		/* next cluster */
+		last_addr = data_addr;
+		data_addr = jgfs_fat_read(data_addr);
+		++clust_n;
+	}
+	
+	/* the next read will most likely pick up where this one left off */
+	if (file != NULL && iov_count != 0) {
+		jgfs_file_seek(file, clust_n - 1, last_addr);
+	}
+	
+	/* bring in every run at once, rather than a cluster at a time */
+	jgfs_dev_load_iov(iov, iov_count, probe_len);
+	
+	/* a bad sector fails this request, rather than the whole process */
+	for (int i = 0; i < iov_count && probe_len != 0; ++i) {
+		uint64_t len = (iov[i].iov_len < probe_len ? iov[i].iov_len :
+			probe_len);
+		
+		int rtn;
+		if ((rtn = jgfs_dev_probe(iov[i].iov_base, len)) != 0) {
+			return rtn;
+		}
+		
+		probe_len -= len;
+	}
+	
+	*clust_n_out   = clust_n;
+	*data_addr_out = data_addr;
+	
+	return iov_count;
+}
+
+int jgfs_read_iov(struct jgfs_dir_ent *dir_ent, struct jgfs_file *file,
+	struct iovec *iov, size_t size, uint64_t offset) {
+	uint16_t clust_n;
+	fat_ent_t data_addr;
+	
+	int iov_count;
+	if ((iov_count = jgfs_map_iov(dir_ent, file, iov, size, offset, size,
+		&clust_n, &data_addr)) <= 0) {
+		return iov_count;
+	}
+	
+	/* get the kernel started on what the next read is likely to want; writes
+	 * are left out, as what follows them is most likely written next too */
+	if (file != NULL && ra_max != 0) {
+		uint32_t file_size = dir_ent->size;
+		uint64_t end = (size < file_size - offset ? offset + size : file_size);
+		
+		jgfs_read_ahead(dir_ent, file, offset, end, clust_n, data_addr);
+	}
+	
+	return iov_count;
+}
+
+int jgfs_write_iov(struct jgfs_dir_ent *dir_ent, struct jgfs_file *file,
+	struct iovec *iov, size_t size, uint64_t offset) {
+	if (offset + size > UINT32_MAX) {
+		return -EFBIG;
+	}
+	
+	/* the span being written is about to be overwritten, so there's no sense
+	 * in zeroing it first */
+	uint32_t old_size = dir_ent->size;
+	if (offset + size > old_size) {
+		if (!jgfs_enlarge_over(dir_ent, offset + size, offset)) {
+			return -ENOSPC;
+		}
+	}
+	
+	/* if the part of the span that holds data can't be read in, it can't be
+	 * written either, and the file keeps its old size; the rest is only
+	 * written over, so it isn't read in, or touched here (which would fault in
+	 * every page of a mapping) */
+	uint64_t probe_len = (old_size > offset ? old_size - offset : 0);
+	uint16_t clust_n;
+	fat_ent_t data_addr;
+	
+	int rtn;
+	if ((rtn = jgfs_map_iov(dir_ent, file, iov, size, offset, probe_len,
+		&clust_n, &data_addr)) < 0) {
+		if (dir_ent->size > old_size) {
+			jgfs_reduce(dir_ent, old_size);
+		}
+		
+		return rtn;
+	}
+	
+	dir_ent->mtime = time(NULL);
+	jgfs_dirty(dir_ent, sizeof(*dir_ent));
+	
+	return rtn;
+}
+
+void jgfs_write_end(struct jgfs_dir_ent *dir_ent, uint32_t old_size,
+	const struct iovec *iov, int iov_count, uint64_t offset, size_t written) {
+	size_t left = written;
+	for (int i = 0; i < iov_count && left > 0; ++i) {
+		size_t len = (iov[i].iov_len < left ? iov[i].iov_len : left);
+		
+		jgfs_dirty(iov[i].iov_base, len);
+		left -= len;
+	}
+	
+	/* a write of nothing at all doesn't extend the file, even past its end */
+	uint64_t end = (written != 0 ? offset + written : 0);
+	if (end < old_size) {
+		end = old_size;
+	}
+	
+	if (end < dir_ent->size) {
+		jgfs_reduce(dir_ent, end);
+	}
+}
+
+int jgfs_resize(struct jgfs_dir_ent *dir_ent, uint64_t new_size) {
+	if (dir_ent->type != TYPE_FILE) {
+		return -EISDIR;
+	} else if (new_size > UINT32_MAX) {
+		return -EFBIG;
+	}
+	
+	if (new_size < dir_ent->size) {
+		jgfs_reduce(dir_ent, new_size);
+	} else if (new_size > dir_ent->size) {
+		if (!jgfs_enlarge(dir_ent, new_size)) {
+			return -ENOSPC;
+		}
+	}
+	
+	dir_ent->mtime = time(NULL);
+	jgfs_dirty(dir_ent, sizeof(*dir_ent));
+	
+	return 0;
+}
@@ -14,16 +14,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
 
 static int      dev_fd   = -1;
-static void    *dev_mem  = NULL;
+static bool     dev_open = false;
 static uint64_t dev_size = 0;
 static uint64_t dev_sect = 0;
 
+/* loaded only to be looked at: nothing is ever written to the device */
+static bool dev_ro = false;
+
 struct jgfs jgfs = {
 	.hdr  = NULL,
 	.boot = NULL,
@@ -32,10 +34,64 @@ struct jgfs jgfs = {
 
 static uint16_t fs_clusters = 0;
 
+/* free cluster index: one bit per cluster (set if the cluster is free), plus a
+ * summary bit per bitmap word (set if that word has any free bits) */
+#define FREE_MAP_WORDS (0x10000 / 64)
+#define FREE_SUM_WORDS (FREE_MAP_WORDS / 64)
+
+static uint64_t free_map[FREE_MAP_WORDS];
+static uint64_t free_sum[FREE_SUM_WORDS];
+
+/* cluster counts by state, kept current on every fat write */
+static struct jgfs_fat_stats fat_stats;
+
+/* clusters that have failed to read since mount, one bit each */
+static uint64_t bad_cand[0x10000 / 64];
+
+/* bounds on the size of an allocation window, in clusters */
+#define RESV_MIN   16
+#define RESV_MAX   1024
+#define RESV_SLOTS 16
+
+/* in-memory allocation window: free clusters set aside for the next growth of
+ * a file, so that interleaved writers don't allocate into each other's runs;
+ * the clusters are still free on disk and are handed out to others as a last
+ * resort */
+struct jgfs_resv {
+	fat_ent_t owner; // first cluster of the file (FAT_NALLOC if slot unused)
+	uint32_t  next;  // first cluster in the window
+	uint32_t  end;   // one past the last cluster in the window
+	uint64_t  used;  // lru stamp
+};
 
-static void jgfs_msync(void) {
-	if (msync(dev_mem, dev_size, MS_SYNC) == -1) {
-		warn("msync failed");
+static struct jgfs_resv resvs[RESV_SLOTS] = {
+	[0 ... RESV_SLOTS - 1] = {
+		.owner = FAT_NALLOC,
+	},
+};
+
+static uint64_t resv_clock = 0;
+
+
+/* write back everything that has changed, short of flushing the device's
+ * cache */
+static void jgfs_write_back(void) {
+	/* a mapping of the device is cheaper to write back whole than by going
+	 * through what changed */
+	if (jgfs_dev_direct()) {
+		struct jgfs_flush all = { .off = 0, .len = dev_size };
+		
+		jgfs_dirty_clear();
+		
+		int rtn;
+		if ((rtn = jgfs_dev_flush(&all, 1, false)) != 0) {
+			warnx("writeback failed: %s", strerror(-rtn));
+		}
+	} else {
+		int rtn;
+		if ((rtn = jgfs_writeback()) != 0) {
+			warnx("writeback failed: %s", strerror(-rtn));
+		}
 	}
 }
 
@@ -46,23 +102,236 @@ static void jgfs_fsync(void) {
 }
 
 static void jgfs_clean_up(void) {
-	if (dev_mem != NULL) {
-		jgfs_msync();
-		
-		if (munmap(dev_mem, dev_size) == -1) {
-			warn("munmap failed");
+	jgfs_writeback_stop();
+	
+	/* exiting from the middle of an operation (for want of the metadata, say)
+	 * leaves the namespace lock held, so what needs it is skipped, rather than
+	 * waited on forever: orphans keep their clusters, and the journal is left
+	 * as it was at its last commit */
+	bool idle = jgfs_trylock_ns(true);
+	if (idle) {
+		jgfs_unlock_ns();
+		jgfs_file_close_all();
+	} else if (dev_open) {
+		warnx("exiting in the middle of an operation");
+		jgfs_journal_abandon();
+	}
+	
+	if (dev_open) {
+		if (!dev_ro) {
+			jgfs_write_back();
 		}
-		dev_mem = NULL;
+		jgfs_journal_close();
+		
+		jgfs_dev_close();
+		dev_open = false;
 	}
 	
 	if (dev_fd != -1) {
-		jgfs_fsync();
+		if (!dev_ro) {
+			jgfs_fsync();
+		}
 		
 		if (close(dev_fd) == -1) {
 			warn("close failed");
 		}
 		dev_fd = -1;
 	}
+	
+	dev_ro = false;
+}
+
+static void jgfs_free_mark(fat_ent_t addr, bool free) {
+	uint16_t word = addr / 64;
+	
+	if (free) {
+		free_map[word]      |= (1ULL << (addr % 64));
+		free_sum[word / 64] |= (1ULL << (word % 64));
+	} else {
+		free_map[word] &= ~(1ULL << (addr % 64));
+		if (free_map[word] == 0) {
+			free_sum[word / 64] &= ~(1ULL << (word % 64));
+		}
+	}
+}
+
+static bool jgfs_bad_test(fat_ent_t addr) {
+	return ((__atomic_load_n(bad_cand + (addr / 64), __ATOMIC_RELAXED) &
+		(1ULL << (addr % 64))) != 0);
+}
+
+static uint16_t *jgfs_fat_stat(fat_ent_t val) {
+	switch (val) {
+	case FAT_FREE:
+		return &fat_stats.free;
+	case FAT_RSVD:
+		return &fat_stats.rsvd;
+	case FAT_BAD:
+		return &fat_stats.bad;
+	case FAT_OOB:
+		return NULL;
+	default:
+		/* normal clusters and FAT_EOF */
+		return &fat_stats.used;
+	}
+}
+
+static void jgfs_fat_index(void) {
+	const fat_ent_t *ents = (const fat_ent_t *)jgfs.fat;
+	
+	memset(free_map, 0, sizeof(free_map));
+	memset(free_sum, 0, sizeof(free_sum));
+	memset(bad_cand, 0, sizeof(bad_cand));
+	
+	jgfs_scan_mask(ents, fs_clusters, FAT_FREE, free_map);
+	
+	for (uint16_t i = 0; i < FREE_MAP_WORDS; ++i) {
+		if (free_map[i] != 0) {
+			free_sum[i / 64] |= (1ULL << (i % 64));
+		}
+	}
+	
+	fat_stats.free = jgfs_scan_count(ents, fs_clusters, FAT_FREE);
+	fat_stats.rsvd = jgfs_scan_count(ents, fs_clusters, FAT_RSVD);
+	fat_stats.bad  = jgfs_scan_count(ents, fs_clusters, FAT_BAD);
+	fat_stats.used = fs_clusters - fat_stats.free - fat_stats.rsvd -
+		fat_stats.bad - jgfs_scan_count(ents, fs_clusters, FAT_OOB);
+}
+
+static bool jgfs_free_first(fat_ent_t *first) {
+	for (uint16_t i = 0; i < FREE_SUM_WORDS; ++i) {
+		if (free_sum[i] != 0) {
+			uint16_t word = (i * 64) + __builtin_ctzll(free_sum[i]);
+			
+			*first = (word * 64) + __builtin_ctzll(free_map[word]);
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+/* find the first run of free clusters at or after from; returns false if there
+ * are no free clusters past that point */
+static bool jgfs_free_extent(uint32_t from, uint32_t *start, uint32_t *len) {
+	uint32_t word = from / 64;
+	
+	if (from >= fs_clusters) {
+		return false;
+	}
+	
+	/* find the first free bit, skipping full words with the summary */
+	uint64_t bits = free_map[word] & (~0ULL << (from % 64));
+	while (bits == 0) {
+		if (++word >= FREE_MAP_WORDS) {
+			return false;
+		}
+		
+		uint64_t sum = free_sum[word / 64] & (~0ULL << (word % 64));
+		while (sum == 0) {
+			word = ((word / 64) + 1) * 64;
+			if (word >= FREE_MAP_WORDS) {
+				return false;
+			}
+			
+			sum = free_sum[word / 64];
+		}
+		
+		word = ((word / 64) * 64) + __builtin_ctzll(sum);
+		bits = free_map[word];
+	}
+	
+	*start = (word * 64) + __builtin_ctzll(bits);
+	
+	/* measure the run (bits past fs_clusters are never set) */
+	uint64_t used = ~free_map[word] & (~0ULL << (*start % 64));
+	while (used == 0) {
+		if (++word >= FREE_MAP_WORDS) {
+			*len = fs_clusters - *start;
+			return true;
+		}
+		
+		used = ~free_map[word];
+	}
+	
+	*len = ((word * 64) + __builtin_ctzll(used)) - *start;
+	return true;
+}
+
+/* trim the part of [*start, end) that begins at *start so that it avoids the
+ * allocation windows of other owners; returns false if nothing is left */
+static bool jgfs_resv_clip(fat_ent_t owner, uint32_t *start, uint32_t end,
+	uint32_t *len) {
+	uint32_t cur = *start;
+	
+again:
+	for (struct jgfs_resv *resv = resvs; resv < resvs + RESV_SLOTS; ++resv) {
+		if (resv->owner != FAT_NALLOC && resv->owner != owner &&
+			cur >= resv->next && cur < resv->end) {
+			cur = resv->end;
+			goto again;
+		}
+	}
+	
+	if (cur >= end) {
+		return false;
+	}
+	
+	uint32_t lim = end;
+	for (struct jgfs_resv *resv = resvs; resv < resvs + RESV_SLOTS; ++resv) {
+		if (resv->owner != FAT_NALLOC && resv->owner != owner &&
+			resv->next > cur && resv->next < lim) {
+			lim = resv->next;
+		}
+	}
+	
+	*start = cur;
+	*len   = lim - cur;
+	return true;
+}
+
+static struct jgfs_resv *jgfs_resv_find(fat_ent_t owner) {
+	if (owner == FAT_NALLOC) {
+		return NULL;
+	}
+	
+	for (struct jgfs_resv *resv = resvs; resv < resvs + RESV_SLOTS; ++resv) {
+		if (resv->owner == owner) {
+			return resv;
+		}
+	}
+	
+	return NULL;
+}
+
+static void jgfs_resv_set(fat_ent_t owner, uint32_t next, uint32_t end) {
+	struct jgfs_resv *resv = jgfs_resv_find(owner);
+	
+	/* an exhausted window is simply dropped */
+	if (next >= end) {
+		if (resv != NULL) {
+			resv->owner = FAT_NALLOC;
+			resv->used  = 0;
+		}
+		
+		return;
+	}
+	
+	if (resv == NULL) {
+		/* take over the least recently used slot */
+		resv = resvs;
+		for (struct jgfs_resv *this = resvs; this < resvs + RESV_SLOTS;
+			++this) {
+			if (this->used < resv->used) {
+				resv = this;
+			}
+		}
+	}
+	
+	resv->owner = owner;
+	resv->next  = next;
+	resv->end   = end;
+	resv->used  = ++resv_clock;
 }
 
 static void jgfs_init_real(const char *dev_path,
@@ -71,7 +340,7 @@ static void jgfs_init_real(const char *dev_path,
 	
 	atexit(jgfs_clean_up);
 	
-	if ((dev_fd = open(dev_path, O_RDWR)) == -1) {
+	if ((dev_fd = open(dev_path, (dev_ro ? O_RDONLY : O_RDWR))) == -1) {
 		err(1, "failed to open '%s'", dev_path);
 	}
 	
@@ -86,12 +355,13 @@ static void jgfs_init_real(const char *dev_path,
 		warnx("device has non-integer number of sectors");
 	}
 	
-	if ((dev_mem = mmap(NULL, dev_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-		dev_fd, 0)) == MAP_FAILED) {
-		err(1, "mmap failed");
-	}
+	jgfs_dev_open(dev_fd, dev_size);
+	dev_open = true;
 	
 	jgfs.hdr = jgfs_get_sect(JGFS_HDR_SECT);
+	if (jgfs_dev_probe(jgfs.hdr, SECT_SIZE) != 0) {
+		errx(1, "failed to read the jgfs header");
+	}
 	
 	if (new_hdr != NULL) {
 		memset(jgfs.hdr, 0, SECT_SIZE);
@@ -102,8 +372,10 @@ static void jgfs_init_real(const char *dev_path,
 		errx(1, "jgfs header not found");
 	}
 	
+	/* minor versions only add to the format, in ways that a zeroed field
+	 * leaves unused */
 	if (jgfs.hdr->ver_major != JGFS_VER_MAJOR ||
-		jgfs.hdr->ver_minor != JGFS_VER_MINOR) {
+		jgfs.hdr->ver_minor > JGFS_VER_MINOR) {
 		errx(1, "incompatible filesystem (%#06" PRIx16 ")",
 			JGFS_VER_EXPAND(jgfs.hdr->ver_major, jgfs.hdr->ver_minor));
 	}
@@ -113,25 +385,127 @@ static void jgfs_init_real(const char *dev_path,
 			jgfs.hdr->s_total, dev_sect);
 	}
 	
+	/* metadata must only reach the device through the journal, but the kernel
+	 * writes back a shared mapping of the device whenever it likes */
+	if (jgfs.hdr->s_journal != 0 && jgfs_dev_direct()) {
+		if (jgfs_dev_chosen()) {
+			warnx("the journal needs a cache of the device; using the pread "
+				"backend");
+		}
+		
+		jgfs_dev_close();
+		jgfs_dev_select(DEV_PREAD, 0);
+		jgfs_dev_open(dev_fd, dev_size);
+		
+		jgfs.hdr = jgfs_get_sect(JGFS_HDR_SECT);
+	}
+	
+	/* everything up to the data clusters is kept in memory throughout */
+	uint64_t meta_len = (uint64_t)(JGFS_BOOT_SECT + jgfs.hdr->s_boot +
+		jgfs.hdr->s_fat) * SECT_SIZE;
+	if (jgfs.hdr->s_per_c == 0 ||
+		meta_len > (uint64_t)jgfs.hdr->s_total * SECT_SIZE) {
+		errx(1, "filesystem geometry is invalid");
+	}
+	
+	jgfs_dev_layout(meta_len, SECT_SIZE * jgfs.hdr->s_per_c,
+		(uint64_t)jgfs.hdr->s_total * SECT_SIZE);
+	
+	void *meta = jgfs_dev_load(0, meta_len, true);
+	if (jgfs_dev_probe(meta, meta_len) != 0) {
+		errx(1, "failed to read the filesystem's metadata");
+	}
+	
+	jgfs.hdr  = jgfs_get_sect(JGFS_HDR_SECT);
 	jgfs.boot = jgfs_get_sect(JGFS_BOOT_SECT);
 	jgfs.fat  = jgfs_get_sect(JGFS_BOOT_SECT + jgfs.hdr->s_boot);
 	
-	fs_clusters = (jgfs.hdr->s_total -
+	fs_clusters = (jgfs.hdr->s_total - jgfs.hdr->s_journal -
 		(2 + jgfs.hdr->s_boot + jgfs.hdr->s_fat)) / jgfs.hdr->s_per_c;
 	
 	if (jgfs.hdr->s_fat < CEIL(fs_clusters, JGFS_FENT_PER_S)) {
 		errx(1, "fat is too small");
 	}
 	
+	/* whatever was committed but may not have reached its place is put
+	 * there before anything looks at the metadata */
+	if (new_hdr == NULL) {
+		jgfs_journal_open(dev_ro);
+	}
+	
 	if (jgfs.hdr->mtime > time(NULL)) {
 		warnx("last mount time is in the future");
 	}
 	
-	jgfs.hdr->mtime = time(NULL);
+	if (!dev_ro) {
+		jgfs.hdr->mtime = time(NULL);
+		jgfs_dirty(&jgfs.hdr->mtime, sizeof(jgfs.hdr->mtime));
+	}
+}
+
+/* load every cluster of dir, and of every directory under it; returns how many
+ * clusters that came to */
+static uint32_t jgfs_dir_preload(struct jgfs_dir_ent *dir) {
+	uint16_t clust_count = jgfs_chain_len(dir);
+	uint32_t loaded = clust_count;
+	
+	for (uint16_t i = 0; i < clust_count; ++i) {
+		struct jgfs_dir_clust *dir_clust =
+			jgfs_get_clust(jgfs_chain_get(dir, i));
+		
+		for (struct jgfs_dir_ent *this_ent = dir_clust->entries;
+			this_ent < dir_clust->entries + JGFS_DENT_PER_C; ++this_ent) {
+			if (this_ent->name[0] != '\0' && this_ent->type == TYPE_DIR) {
+				loaded += jgfs_dir_preload(this_ent);
+			}
+		}
+	}
+	
+	return loaded;
 }
 
 void jgfs_init(const char *dev_path) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
 	jgfs_init_real(dev_path, NULL);
+	
+	jgfs_fat_index();
+	
+	/* with pinned memory to be locked in, the header and the fat are already
+	 * loaded; the directories are brought in now as well, rather than when
+	 * they are first used, which is still worth it if locking turns out not
+	 * to be allowed */
+	if (jgfs_dev_lock_wanted()) {
+		uint32_t clusts = jgfs_dir_preload(&jgfs.hdr->root_dir_ent);
+		uint64_t loaded = ((uint64_t)(JGFS_BOOT_SECT + jgfs.hdr->s_boot +
+			jgfs.hdr->s_fat) * SECT_SIZE) +
+			((uint64_t)clusts * jgfs_clust_size());
+		
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double ms = ((end.tv_sec - start.tv_sec) * 1e3) +
+			((end.tv_nsec - start.tv_nsec) / 1e6);
+		
+		if (jgfs_dev_locked() != 0) {
+			warnx("loaded %" PRIu64 " KiB of metadata in %.1f ms, and locked "
+				"%" PRIu64 " KiB into memory", loaded / 1024, ms,
+				jgfs_dev_locked() / 1024);
+		} else {
+			warnx("loaded %" PRIu64 " KiB of metadata in %.1f ms, without "
+				"locking it into memory", loaded / 1024, ms);
+		}
+	}
+}
+
+void jgfs_init_ro(const char *dev_path) {
+	/* a cache of the device keeps the replay of the journal in memory, where
+	 * the kernel would write back a shared mapping */
+	dev_ro = true;
+	jgfs_dev_select(DEV_PREAD, 0);
+	
+	jgfs_init_real(dev_path, NULL);
+	
+	jgfs_fat_index();
 }
 
 void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
@@ -165,7 +539,7 @@ void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
 		errx(1, "filesystem must have at least 2 sectors");
 	} else if (param->s_total < s_vbr_hdr_boot) {
 		errx(1, "filesystem is too small for the boot area requested");
-	} else if (param->s_total == s_vbr_hdr_boot) {
+	} else if (param->s_total <= s_vbr_hdr_boot + param->s_journal) {
 		errx(1, "filesystem has no room for a fat");
 	}
 	
@@ -182,6 +556,8 @@ void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
 	
 	new_hdr.s_per_c = param->s_per_c;
 	
+	new_hdr.s_journal = param->s_journal;
+	
 	/* iteratively calculate optimal fat size, taking into account the size of
 	 * the fat itself when determining the number of available clusters */
 	/* TODO: fix infinite loop when too small of a cluster size is manually
@@ -191,7 +567,8 @@ void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
 		last_last = last;
 		last = s_fat;
 		
-		s_fat = CEIL(new_hdr.s_total - (2 + new_hdr.s_boot + new_hdr.s_fat),
+		s_fat = CEIL(new_hdr.s_total - new_hdr.s_journal -
+			(2 + new_hdr.s_boot + new_hdr.s_fat),
 			JGFS_FENT_PER_S * new_hdr.s_per_c);
 		
 		/* if we are vacillating infinitely between two possible fat sizes, just
@@ -219,7 +596,7 @@ void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
 	jgfs_init_real(dev_path, &new_hdr);
 	
 	/* initialize the fat */
-	for (uint16_t i = 0; i < JGFS_FENT_PER_S * jgfs.hdr->s_fat; ++i) {
+	for (uint32_t i = 0; i < JGFS_FENT_PER_S * jgfs.hdr->s_fat; ++i) {
 		fat_ent_t *entry =
 			&jgfs.fat[i / JGFS_FENT_PER_S].entries[i % JGFS_FENT_PER_S];
 		
@@ -229,6 +606,11 @@ void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
 			*entry = FAT_OOB;
 		}
 	}
+	jgfs_dirty(jgfs.fat, (size_t)jgfs.hdr->s_fat * SECT_SIZE);
+	
+	jgfs_fat_index();
+	
+	jgfs_journal_format();
 	
 	if (param->zap) {
 		warnx("zapping the vbr and boot area");
@@ -240,15 +622,19 @@ void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
 			sect = jgfs_get_sect(JGFS_BOOT_SECT + i);
 			memset(sect, 0, SECT_SIZE);
 		}
+		
+		jgfs_dirty(jgfs_get_sect(JGFS_VBR_SECT), SECT_SIZE);
+		jgfs_dirty(jgfs.boot, (size_t)jgfs.hdr->s_boot * SECT_SIZE);
 	}
 	
 	if (param->zero_data) {
 		warnx("zeroing out data clusters");
 		
 		for (uint16_t i = 0; i < fs_clusters; ++i) {
-			void *clust = jgfs_get_clust(i);
+			void *clust = jgfs_get_data(i);
 			
 			memset(clust, 0, jgfs_clust_size());
+			jgfs_dirty(clust, jgfs_clust_size());
 		}
 	}
 	
@@ -265,10 +651,15 @@ void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param) {
 
 void jgfs_done(void) {
 	jgfs_clean_up();
+	
+	/* at exit, these just go with the process, so that a thread that exits
+	 * for want of the metadata while holding their locks can't hang it */
+	jgfs_dcache_clear();
+	jgfs_dindex_forget_all();
 }
 
 void jgfs_sync(void) {
-	jgfs_msync();
+	jgfs_write_back();
 	jgfs_fsync();
 }
 
@@ -286,20 +677,80 @@ void *jgfs_get_sect(uint32_t sect_num) {
 			"(sect %" PRIu32 ")", sect_num);
 	}
 	
-	return (void *)((struct sect *)dev_mem + sect_num);
+	return jgfs_dev_load((uint64_t)sect_num * SECT_SIZE, SECT_SIZE, true);
 }
 
-void *jgfs_get_clust(fat_ent_t clust_num) {
+static uint64_t jgfs_clust_off(fat_ent_t clust_num, const char *func) {
 	if (clust_num > FAT_LAST) {
-		errx(1, "jgfs_get_clust: tried to access past FAT_LAST "
-			"(clust %#06" PRIx16 ")", clust_num);
+		errx(1, "%s: tried to access past FAT_LAST (clust %#06" PRIx16 ")",
+			func, clust_num);
 	} else if (clust_num >= fs_clusters) {
-		errx(1, "jgfs_get_clust: tried to access nonexistent cluster "
-			"(clust %#06" PRIx16 ")", clust_num);
+		errx(1, "%s: tried to access nonexistent cluster (clust %#06" PRIx16
+			")", func, clust_num);
 	}
 	
-	return jgfs_get_sect(2 + jgfs.hdr->s_boot + jgfs.hdr->s_fat +
-		(clust_num * jgfs.hdr->s_per_c));
+	uint64_t sect_num = 2 + jgfs.hdr->s_boot + jgfs.hdr->s_fat +
+		((uint64_t)clust_num * jgfs.hdr->s_per_c);
+	
+	return sect_num * SECT_SIZE;
+}
+
+void *jgfs_get_clust(fat_ent_t clust_num) {
+	uint64_t off = jgfs_clust_off(clust_num, "jgfs_get_clust");
+	
+	void *clust = jgfs_dev_load(off, jgfs_clust_size(), true);
+	
+	/* only directories and symlinks are kept, and their changes are logged */
+	jgfs_journal_clust(clust_num, true);
+	
+	return clust;
+}
+
+void *jgfs_get_data(fat_ent_t clust_num) {
+	uint64_t off = jgfs_clust_off(clust_num, "jgfs_get_data");
+	
+	return jgfs_dev_load(off, jgfs_clust_size(), false);
+}
+
+void *jgfs_data_addr(fat_ent_t clust_num) {
+	return jgfs_dev_addr(jgfs_clust_off(clust_num, "jgfs_data_addr"));
+}
+
+uint64_t jgfs_data_offset(fat_ent_t clust_num) {
+	return jgfs_clust_off(clust_num, "jgfs_data_offset");
+}
+
+int jgfs_dev_fd(void) {
+	return dev_fd;
+}
+
+void jgfs_bad_note(uint64_t off, uint64_t len) {
+	if (jgfs.hdr == NULL || fs_clusters == 0) {
+		return;
+	}
+	
+	uint64_t data_off = (uint64_t)(2 + jgfs.hdr->s_boot + jgfs.hdr->s_fat) *
+		SECT_SIZE;
+	if (off + len <= data_off) {
+		warnx("the filesystem's metadata failed to read");
+		return;
+	} else if (off < data_off) {
+		len -= data_off - off;
+		off  = data_off;
+	}
+	
+	uint64_t first = (off - data_off) / jgfs_clust_size(),
+		last = (off + len - 1 - data_off) / jgfs_clust_size();
+	for (uint64_t clust = first; clust <= last && clust < fs_clusters;
+		++clust) {
+		uint64_t bit = 1ULL << (clust % 64);
+		
+		if ((__atomic_fetch_or(bad_cand + (clust / 64), bit,
+			__ATOMIC_RELAXED) & bit) == 0) {
+			warnx("cluster %#06" PRIx16 " failed to read; it will be marked "
+				"bad once freed", (fat_ent_t)clust);
+		}
+	}
 }
 
 fat_ent_t jgfs_fat_read(fat_ent_t addr) {
@@ -329,179 +780,474 @@ void jgfs_fat_write(fat_ent_t addr, fat_ent_t val) {
 			"(fat %#06" PRIx16 ")", addr);
 	}
 	
-	jgfs.fat[fat_sect].entries[fat_idx] = val;
+	fat_ent_t *entry = &jgfs.fat[fat_sect].entries[fat_idx];
+	
+	/* a file whose first cluster is freed no longer owns its window, and a
+	 * cluster the journal may still replay over isn't to be allocated yet */
+	bool held = false;
+	if (val == FAT_FREE) {
+		jgfs_resv_set(addr, 0, 0);
+		held = jgfs_journal_clust(addr, false);
+		
+		/* a cluster that has failed to read is retired, not reused */
+		if (jgfs_bad_test(addr)) {
+			warnx("marking cluster %#06" PRIx16 " bad", addr);
+			val = FAT_BAD;
+		}
+	}
+	
+	uint16_t *stat_old = jgfs_fat_stat(*entry), *stat_new = jgfs_fat_stat(val);
+	if (stat_old != stat_new) {
+		if (stat_old != NULL) {
+			--*stat_old;
+		}
+		if (stat_new != NULL) {
+			++*stat_new;
+		}
+	}
+	
+	if ((*entry == FAT_FREE) != (val == FAT_FREE) && !held) {
+		jgfs_free_mark(addr, (val == FAT_FREE));
+	}
+	
+	*entry = val;
+	jgfs_dirty(entry, sizeof(*entry));
+}
+
+void jgfs_fat_release(fat_ent_t addr) {
+	if (addr < fs_clusters && jgfs_fat_read(addr) == FAT_FREE) {
+		jgfs_free_mark(addr, true);
+	}
 }
 
 bool jgfs_fat_find(fat_ent_t target, fat_ent_t *first) {
-	for (uint16_t i = 0; i < jgfs.hdr->s_fat; ++i) {
-		for (uint16_t j = 0; j < JGFS_FENT_PER_S; ++j) {
-			if (jgfs.fat[i].entries[j] == target) {
-				*first = (i * JGFS_FENT_PER_S) + j;
-				return true;
-			}
-		}
+	/* free clusters are tracked by the free index */
+	if (target == FAT_FREE) {
+		return jgfs_free_first(first);
+	}
+	
+	size_t n = JGFS_FENT_PER_S * jgfs.hdr->s_fat;
+	size_t i = jgfs_scan_find((const fat_ent_t *)jgfs.fat, n, target);
+	
+	if (i < n) {
+		*first = i;
+		return true;
 	}
 	
 	return false;
 }
 
 uint16_t jgfs_fat_count(fat_ent_t target) {
-	uint16_t count = 0;
-	
-	for (uint16_t i = 0; i < jgfs.hdr->s_fat; ++i) {
-		for (uint16_t j = 0; j < JGFS_FENT_PER_S; ++j) {
-			if (jgfs.fat[i].entries[j] == target) {
-				++count;
-			}
-		}
+	/* states with maintained counters don't require a scan */
+	switch (target) {
+	case FAT_FREE:
+		return fat_stats.free;
+	case FAT_RSVD:
+		return fat_stats.rsvd;
+	case FAT_BAD:
+		return fat_stats.bad;
 	}
 	
-	return count;
+	return jgfs_scan_count((const fat_ent_t *)jgfs.fat,
+		JGFS_FENT_PER_S * jgfs.hdr->s_fat, target);
 }
 
-void jgfs_fat_dump(void) {
-	for (uint16_t i = 0; i < jgfs.hdr->s_fat; ++i) {
-		for (uint16_t j = 0; j < JGFS_FENT_PER_S; ++j) {
-			if (j % 8 == 0) {
-				fprintf(stderr, "%04lx:", j + (i * JGFS_FENT_PER_S));
-			}
+void jgfs_fat_stats(struct jgfs_fat_stats *stats) {
+	*stats = fat_stats;
+}
+
+uint16_t jgfs_fat_alloc(fat_ent_t owner, fat_ent_t goal, uint16_t want,
+	uint16_t fit, fat_ent_t *first) {
+	uint32_t start, len;
+	
+	if (want == 0) {
+		return 0;
+	}
+	if (fit < want) {
+		fit = want;
+	}
+	
+	/* continue the owner's current run if the goal cluster is available */
+	if (goal != FAT_NALLOC && goal < fs_clusters &&
+		jgfs_free_extent(goal, &start, &len) && start == goal &&
+		jgfs_resv_clip(owner, &start, goal + len, &len) && start == goal) {
+		if (len > want) {
+			len = want;
+		}
+		
+		*first = goal;
+		
+		struct jgfs_resv *resv;
+		if ((resv = jgfs_resv_find(owner)) != NULL) {
+			jgfs_resv_set(owner, goal + len, resv->end);
+		}
+		
+		return len;
+	}
+	
+	/* otherwise, open a new window in the free extent that fits best, or in the
+	 * largest one if none is big enough; only when every free cluster is in
+	 * someone else's window do we take from those */
+	for (int pass = 0; pass < 2; ++pass) {
+		uint32_t best_start = 0, best_len = 0;
+		uint32_t big_start = 0, big_len = 0;
+		
+		uint32_t from = 0;
+		while (jgfs_free_extent(from, &start, &len)) {
+			uint32_t ext_end = start + len;
 			
-			fprintf(stderr, " %04" PRIx16, jgfs.fat[i].entries[j]);
+			uint32_t sub_start = start, sub_len = len;
+			while (sub_start < ext_end) {
+				if (pass == 0 &&
+					!jgfs_resv_clip(owner, &sub_start, ext_end, &sub_len)) {
+					break;
+				}
+				
+				if (sub_len >= fit && (best_len == 0 || sub_len < best_len)) {
+					best_start = sub_start;
+					best_len   = sub_len;
+				}
+				if (sub_len > big_len) {
+					big_start = sub_start;
+					big_len   = sub_len;
+				}
+				
+				sub_start += sub_len;
+			}
 			
-			if (j % 8 == 7) {
-				fputc('\n', stderr);
+			/* an exact fit can't be beaten */
+			if (best_len == fit) {
+				break;
 			}
+			
+			from = ext_end;
+		}
+		
+		if (best_len == 0) {
+			best_start = big_start;
+			best_len   = big_len;
+		}
+		
+		if (best_len != 0) {
+			len = (best_len < want ? best_len : want);
+			*first = best_start;
+			
+			/* a new file's window is keyed by the cluster it starts at */
+			jgfs_resv_set((owner != FAT_NALLOC ? owner : best_start),
+				best_start + len,
+				best_start + (best_len < fit ? best_len : fit));
+			
+			return len;
 		}
 	}
+	
+	return 0;
 }
 
-int jgfs_lookup(const char *path, struct jgfs_dir_clust **parent,
-	struct jgfs_dir_ent **child) {
-	bool find_child = (child != NULL);
-	
-	struct jgfs_dir_clust *dir_clust;
-	struct jgfs_dir_ent   *dir_ent;
-	
-	dir_clust = jgfs_get_clust(FAT_ROOT);
-	dir_ent   = &jgfs.hdr->root_dir_ent;
-	
-	char *strtok_save = NULL;
-	char *path_dup = strdup(path);
-	char *path_part = strtok_r(path_dup, "/", &strtok_save);
-	char *path_next;
+void jgfs_frag_stats(struct jgfs_frag_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	
+	uint32_t start, len, from = 0;
+	while (jgfs_free_extent(from, &start, &len)) {
+		++stats->free_extents;
+		if (len > stats->free_largest) {
+			stats->free_largest = len;
+		}
+		
+		from = start + len;
+	}
 	
-	/* bail out before the last path component, but only if we weren't asked to
-	 * find the child (we always at least find the parent) */
-	while (path_part != NULL &&
-		(path_next = strtok_r(NULL, "/", &strtok_save),
-		find_child || path_next != NULL)) {
+	for (uint32_t i = 0; i < fs_clusters; ++i) {
+		fat_ent_t next = jgfs_fat_read(i);
 		
-		if (jgfs_lookup_child(path_part, dir_clust, &dir_ent) != 0) {
-			free(path_dup);
-			return -ENOENT;
+		if (next >= FAT_FIRST && next <= FAT_LAST) {
+			++stats->links;
+			
+			if (next != i + 1) {
+				++stats->breaks;
+			}
 		}
-		
-		/* if we're still getting to the child, make sure we don't try to
-		 * recurse into a non-directory */
-		if (path_next != NULL) {
-			if (dir_ent->type != TYPE_DIR) {
-				return -ENOTDIR;
+	}
+}
+
+void jgfs_fat_dump(void) {
+	const fat_ent_t *ents = (const fat_ent_t *)jgfs.fat;
+	size_t n = JGFS_FENT_PER_S * jgfs.hdr->s_fat;
+	
+	/* like hexdump, collapse runs of identical lines into a single '*' */
+	bool skipping = false;
+	for (size_t i = 0; i < n; i += 8) {
+		if (i != 0 && memcmp(ents + i, ents + i - 8, 8 * sizeof(*ents)) == 0) {
+			if (!skipping) {
+				fputs("*\n", stderr);
+				skipping = true;
 			}
 			
-			dir_clust = jgfs_get_clust(dir_ent->begin);
+			continue;
 		}
 		
-		path_part = path_next;
+		skipping = false;
+		
+		fprintf(stderr, "%04zx:", i);
+		for (size_t j = i; j < i + 8; ++j) {
+			fprintf(stderr, " %04" PRIx16, ents[j]);
+		}
+		fputc('\n', stderr);
+	}
+}
+
+uint32_t jgfs_hash(const char *str, size_t len) {
+	/* fnv-1a */
+	uint32_t hash = 2166136261u;
+	
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= (uint8_t)str[i];
+		hash *= 16777619u;
+	}
+	
+	return hash;
+}
+
+/* resolve the first len chars of path to the dir ent they name, going through
+ * the path cache */
+static int jgfs_resolve(const char *path, size_t len,
+	struct jgfs_dir_ent **dir_ent) {
+	/* ignore trailing slashes */
+	while (len > 0 && path[len - 1] == '/') {
+		--len;
+	}
+	
+	/* the root dir ent isn't in any directory, so it's never cached */
+	if (len == 0) {
+		*dir_ent = &jgfs.hdr->root_dir_ent;
+		return 0;
+	}
+	
+	fat_ent_t dir;
+	uint32_t idx;
+	switch (jgfs_dcache_get(path, len, &dir, &idx)) {
+	case DCACHE_HIT:
+		*dir_ent = jgfs_dir_get(dir, idx);
+		return 0;
+	case DCACHE_NEG:
+		return -ENOENT;
+	case DCACHE_MISS:
+		break;
+	}
+	
+	/* split off the last component and resolve everything before it */
+	size_t name_off = len;
+	while (name_off > 0 && path[name_off - 1] != '/') {
+		--name_off;
+	}
+	
+	struct jgfs_dir_ent *parent;
+	int rtn;
+	if ((rtn = jgfs_resolve(path, name_off, &parent)) != 0) {
+		return rtn;
+	}
+	
+	/* make sure we don't try to recurse into a non-directory */
+	if (parent->type != TYPE_DIR) {
+		return -ENOTDIR;
+	}
+	
+	if (len - name_off > JGFS_NAME_LIMIT) {
+		jgfs_dcache_put(path, len, FAT_NALLOC, 0);
+		return -ENOENT;
+	}
+	
+	char name[JGFS_NAME_LIMIT + 1];
+	memcpy(name, path + name_off, len - name_off);
+	name[len - name_off] = '\0';
+	
+	/* cache the result before letting go of the directory, so that a name
+	 * created in it just afterward can't be remembered as missing */
+	jgfs_lock_dir(parent->begin, false);
+	
+	if ((rtn = jgfs_dindex_lookup(parent, name, &idx)) == 0) {
+		*dir_ent = jgfs_dir_get(parent->begin, idx);
+		jgfs_dcache_put(path, len, parent->begin, idx);
+	} else {
+		jgfs_dcache_put(path, len, FAT_NALLOC, 0);
+	}
+	
+	jgfs_unlock_dir(parent->begin);
+	
+	return rtn;
+}
+
+int jgfs_lookup(const char *path, struct jgfs_dir_ent **parent,
+	struct jgfs_dir_ent **child) {
+	struct jgfs_dir_ent *parent_ent, *child_ent;
+	int rtn;
+	
+	/* the parent is whatever everything up to the last component names */
+	size_t len = strlen(path), parent_len = len;
+	while (parent_len > 0 && path[parent_len - 1] == '/') {
+		--parent_len;
+	}
+	while (parent_len > 0 && path[parent_len - 1] != '/') {
+		--parent_len;
+	}
+	
+	if ((rtn = jgfs_resolve(path, parent_len, &parent_ent)) != 0) {
+		return rtn;
+	}
+	if (parent_ent->type != TYPE_DIR) {
+		return -ENOTDIR;
+	}
+	
+	if (child != NULL &&
+		(rtn = jgfs_resolve(path, len, &child_ent)) != 0) {
+		return rtn;
 	}
 	
 	/* only assign to output pointers on success */
-	*parent = dir_clust;
-	if (find_child) {
-		*child = dir_ent;
+	*parent = parent_ent;
+	if (child != NULL) {
+		*child = child_ent;
 	}
 	
-	free(path_dup);
 	return 0;
 }
 
-int jgfs_lookup_child(const char *name, struct jgfs_dir_clust *parent,
+int jgfs_lookup_child(const char *name, struct jgfs_dir_ent *parent,
 	struct jgfs_dir_ent **child) {
+	jgfs_lock_dir(parent->begin, false);
 	
-	for (struct jgfs_dir_ent *this_ent = parent->entries;
-		this_ent < parent->entries + JGFS_DENT_PER_C; ++this_ent) {
-		if (strncmp(this_ent->name, name, JGFS_NAME_LIMIT + 1) == 0) {
-			*child = this_ent;
-			return 0;
-		}
+	uint32_t idx;
+	int rtn;
+	if ((rtn = jgfs_dindex_lookup(parent, name, &idx)) == 0) {
+		*child = jgfs_dir_get(parent->begin, idx);
+	}
+	
+	jgfs_unlock_dir(parent->begin);
+	
+	return rtn;
+}
+
+struct jgfs_dir_ent *jgfs_dir_get(fat_ent_t begin, uint32_t n) {
+	fat_ent_t addr = jgfs_dindex_clust(begin, n / JGFS_DENT_PER_C);
+	if (addr == FAT_EOF) {
+		return NULL;
 	}
 	
-	return -ENOENT;
+	struct jgfs_dir_clust *dir_clust = jgfs_get_clust(addr);
+	return dir_clust->entries + (n % JGFS_DENT_PER_C);
 }
 
 void jgfs_dir_init(struct jgfs_dir_clust *dir_clust) {
 	memset(dir_clust, 0, jgfs_clust_size());
+	jgfs_dirty(dir_clust, jgfs_clust_size());
 }
 
-uint32_t jgfs_dir_count(struct jgfs_dir_clust *dir_clust) {
-	uint32_t count = 0;
-	for (struct jgfs_dir_ent *this_ent = dir_clust->entries;
-		this_ent < dir_clust->entries + JGFS_DENT_PER_C; ++this_ent) {
-		if (this_ent->name[0] != '\0') {
-			++count;
-		}
-	}
-	
-	return count;
+uint32_t jgfs_dir_count(struct jgfs_dir_ent *dir) {
+	return jgfs_dindex_count(dir);
 }
 
-int jgfs_dir_foreach(jgfs_dir_func_t func, struct jgfs_dir_clust *dir_clust,
+int jgfs_dir_foreach(jgfs_dir_func_t func, struct jgfs_dir_ent *dir,
 	void *user_ptr) {
-	for (struct jgfs_dir_ent *this_ent = dir_clust->entries;
-		this_ent < dir_clust->entries + JGFS_DENT_PER_C; ++this_ent) {
-		if (this_ent->name[0] != '\0') {
-			int rtn;
-			if ((rtn = func(this_ent, user_ptr)) != 0) {
-				return rtn;
+	jgfs_lock_dir(dir->begin, false);
+	
+	uint16_t clust_count = jgfs_chain_len(dir);
+	int rtn = 0;
+	
+	for (uint16_t i = 0; i < clust_count && rtn == 0; ++i) {
+		struct jgfs_dir_clust *dir_clust =
+			jgfs_get_clust(jgfs_chain_get(dir, i));
+		
+		for (struct jgfs_dir_ent *this_ent = dir_clust->entries;
+			this_ent < dir_clust->entries + JGFS_DENT_PER_C; ++this_ent) {
+			if (this_ent->name[0] != '\0' &&
+				(rtn = func(this_ent, user_ptr)) != 0) {
+				break;
 			}
 		}
 	}
 	
-	return 0;
+	jgfs_unlock_dir(dir->begin);
+	
+	return rtn;
 }
 
-int jgfs_create_ent(struct jgfs_dir_clust *parent,
+/* give back clusters at the end of a directory that no longer hold any dir
+ * ents, keeping one spare so that a directory hovering around a cluster
+ * boundary isn't grown and shrunk over and over */
+static void jgfs_dir_trim(struct jgfs_dir_ent *dir) {
+	uint32_t clust_size = jgfs_clust_size();
+	
+	uint32_t clust_keep = jgfs_dindex_clusts(dir);
+	if (clust_keep == 0) {
+		clust_keep = 1;
+	}
+	++clust_keep;
+	
+	if (dir->size / clust_size > clust_keep) {
+		jgfs_reduce(dir, clust_keep * clust_size);
+	}
+}
+
+int jgfs_create_ent(struct jgfs_dir_ent *parent,
 	const struct jgfs_dir_ent *new_ent, struct jgfs_dir_ent **created_ent) {
 	if (strlen(new_ent->name) == 0) {
 		errx(1, "jgfs_create_ent: new_ent->name is empty");
 	}
 	
-	struct jgfs_dir_ent *extant_ent;
-	if (jgfs_lookup_child(new_ent->name, parent, &extant_ent) == 0) {
-		return -EEXIST;
+	jgfs_lock_dir(parent->begin, true);
+	
+	uint32_t idx;
+	int rtn = 0;
+	if (jgfs_dindex_lookup(parent, new_ent->name, &idx) == 0) {
+		rtn = -EEXIST;
+	} else if (!jgfs_dindex_free(parent, &idx)) {
+		/* if the directory is full, add another cluster to it */
+		if (!jgfs_enlarge(parent, parent->size + jgfs_clust_size()) ||
+			!jgfs_dindex_free(parent, &idx)) {
+			rtn = -ENOSPC;
+		}
 	}
 	
-	struct jgfs_dir_ent *avail_ent;
-	for (struct jgfs_dir_ent *this_ent = parent->entries;
-		this_ent < parent->entries + JGFS_DENT_PER_C; ++this_ent) {
-		if (this_ent->name[0] == '\0') {
-			avail_ent = this_ent;
-			goto found;
+	if (rtn == 0) {
+		struct jgfs_dir_ent *avail_ent = jgfs_dir_get(parent->begin, idx);
+		
+		memcpy(avail_ent, new_ent, sizeof(*avail_ent));
+		jgfs_dirty(avail_ent, sizeof(*avail_ent));
+		jgfs_dindex_insert(parent, idx);
+		jgfs_dcache_inval_neg();
+		
+		if (created_ent != NULL) {
+			*created_ent = avail_ent;
 		}
 	}
 	
-	return -ENOSPC;
+	jgfs_unlock_dir(parent->begin);
 	
-found:
-	memcpy(avail_ent, new_ent, sizeof(*avail_ent));
+	return rtn;
+}
+
+/* take a free cluster for a new single-cluster dir ent */
+static bool jgfs_claim_clust(fat_ent_t *addr) {
+	jgfs_lock_fat(true);
 	
-	if (created_ent != NULL) {
-		*created_ent = avail_ent;
+	bool found = jgfs_fat_find(FAT_FREE, addr);
+	if (found) {
+		jgfs_fat_write(*addr, FAT_EOF);
 	}
 	
-	return 0;
+	jgfs_unlock_fat();
+	
+	return found;
+}
+
+/* give back a cluster taken by jgfs_claim_clust */
+static void jgfs_release_clust(fat_ent_t addr) {
+	jgfs_lock_fat(true);
+	jgfs_fat_write(addr, FAT_FREE);
+	jgfs_unlock_fat();
 }
 
-int jgfs_create_file(struct jgfs_dir_clust *parent, const char *name) {
+int jgfs_create_file(struct jgfs_dir_ent *parent, const char *name) {
 	if (strlen(name) > JGFS_NAME_LIMIT) {
 		return -ENAMETOOLONG;
 	}
@@ -518,97 +1264,113 @@ int jgfs_create_file(struct jgfs_dir_clust *parent, const char *name) {
 	return jgfs_create_ent(parent, &new_ent, NULL);
 }
 
-int jgfs_create_dir(struct jgfs_dir_clust *parent, const char *name) {
+int jgfs_create_dir(struct jgfs_dir_ent *parent, const char *name) {
 	if (strlen(name) > JGFS_NAME_LIMIT) {
 		return -ENAMETOOLONG;
 	}
 	
+	/* fill in the new directory's cluster before anyone can see it */
 	fat_ent_t dest_addr;
-	/* make sure a free cluster exists before we bother adding a dir ent to the
-	 * parent directory */
-	if (!jgfs_fat_find(FAT_FREE, &dest_addr)) {
+	if (!jgfs_claim_clust(&dest_addr)) {
 		return -ENOSPC;
 	}
 	
-	struct jgfs_dir_ent new_ent, *created_ent;
+	struct jgfs_dir_clust *dir_clust = jgfs_get_clust(dest_addr);
+	jgfs_dir_init(dir_clust);
+	
+	struct jgfs_dir_ent new_ent;
 	memset(&new_ent, 0, sizeof(new_ent));
 	strlcpy(new_ent.name, name, JGFS_NAME_LIMIT + 1);
 	new_ent.type  = TYPE_DIR;
 	new_ent.attr  = ATTR_NONE;
 	new_ent.mtime = time(NULL);
 	new_ent.size  = jgfs_clust_size();
-	new_ent.begin = FAT_NALLOC;
+	new_ent.begin = dest_addr;
 	
 	int rtn;
-	if ((rtn = jgfs_create_ent(parent, &new_ent, &created_ent)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_create_ent(parent, &new_ent, NULL)) != 0) {
+		jgfs_release_clust(dest_addr);
 	}
 	
-	created_ent->begin = dest_addr;
-	
-	struct jgfs_dir_clust *dir_clust = jgfs_get_clust(dest_addr);
-	jgfs_dir_init(dir_clust);
-	
-	jgfs_fat_write(dest_addr, FAT_EOF);
-	
-	return 0;
+	return rtn;
 }
 
-int jgfs_create_symlink(struct jgfs_dir_clust *parent, const char *name,
+int jgfs_create_symlink(struct jgfs_dir_ent *parent, const char *name,
 	const char *target) {
 	if (strlen(name) > JGFS_NAME_LIMIT ||
 		strlen(target) > jgfs_clust_size() - 1) {
 		return -ENAMETOOLONG;
 	}
 	
+	/* write out the target before anyone can see the symlink */
 	fat_ent_t dest_addr;
-	/* make sure a free cluster exists before we bother adding a dir ent to the
-	 * parent directory */
-	if (!jgfs_fat_find(FAT_FREE, &dest_addr)) {
+	if (!jgfs_claim_clust(&dest_addr)) {
 		return -ENOSPC;
 	}
 	
-	struct jgfs_dir_ent new_ent, *created_ent;
+	char *symlink_clust = jgfs_get_clust(dest_addr);
+	strlcpy(symlink_clust, target, jgfs_clust_size());
+	jgfs_dirty(symlink_clust, strlen(target) + 1);
+	
+	struct jgfs_dir_ent new_ent;
 	memset(&new_ent, 0, sizeof(new_ent));
 	strlcpy(new_ent.name, name, JGFS_NAME_LIMIT + 1);
 	new_ent.type  = TYPE_SYMLINK;
 	new_ent.attr  = ATTR_NONE;
 	new_ent.mtime = time(NULL);
 	new_ent.size  = strlen(target);
-	new_ent.begin = FAT_NALLOC;
+	new_ent.begin = dest_addr;
 	
 	int rtn;
-	if ((rtn = jgfs_create_ent(parent, &new_ent, &created_ent)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_create_ent(parent, &new_ent, NULL)) != 0) {
+		jgfs_release_clust(dest_addr);
 	}
 	
-	created_ent->begin = dest_addr;
-	
-	char *symlink_clust = jgfs_get_clust(dest_addr);
-	strlcpy(symlink_clust, target, jgfs_clust_size());
-	
-	jgfs_fat_write(dest_addr, FAT_EOF);
+	return rtn;
+}
+
+/* give up what the dir ent holds, as it is about to go; returns posix error
+ * code on failure */
+static int jgfs_dealloc_ent(struct jgfs_dir_ent *dir_ent) {
+	/* check for directory emptiness, if appropriate */
+	if (dir_ent->type == TYPE_DIR) {
+		if (jgfs_dir_count(dir_ent) != 0) {
+			return -ENOTEMPTY;
+		}
+		
+		/* deallocate the directory's clusters; anything still holding it
+		 * open is left with an empty, deleted directory */
+		jgfs_dindex_forget(dir_ent->begin);
+		jgfs_reduce(dir_ent, 0);
+		jgfs_file_orphan(dir_ent);
+	} else if (!jgfs_file_orphan(dir_ent)) {
+		/* deallocate all the clusters associated with the dir ent (unless
+		 * it is still open, in which case the last close does this) */
+		if (dir_ent->size != 0) {
+			jgfs_reduce(dir_ent, 0);
+		}
+	}
 	
 	return 0;
 }
 
-int jgfs_move_ent(struct jgfs_dir_ent *dir_ent,
-	struct jgfs_dir_clust *new_parent) {
-	struct jgfs_dir_ent *extant_ent, *new_ent;
-	int rtn = jgfs_lookup_child(dir_ent->name, new_parent, &extant_ent);
+int jgfs_move_ent(struct jgfs_dir_ent *parent, struct jgfs_dir_ent *dir_ent,
+	struct jgfs_dir_ent *new_parent, const char *new_name) {
+	if (strlen(new_name) > JGFS_NAME_LIMIT) {
+		return -ENAMETOOLONG;
+	}
+	
+	struct jgfs_dir_ent *extant_ent;
+	int rtn = jgfs_lookup_child(new_name, new_parent, &extant_ent);
 	if (rtn == 0) {
+		/* renaming something to itself does nothing */
+		if (extant_ent == dir_ent) {
+			return 0;
+		}
+		
 		if (dir_ent->type == TYPE_DIR) {
 			/* only succeed if the target is also a dir and is empty */
-			if (extant_ent->type == TYPE_DIR) {
-				struct jgfs_dir_clust *extant_dir =
-					jgfs_get_clust(extant_ent->begin);
-				if (jgfs_dir_count(extant_dir) == 0) {
-					jgfs_delete_ent(extant_ent, true);
-					new_ent = extant_ent;
-				} else {
-					return -ENOTEMPTY;
-				}
-			} else {
+			if (extant_ent->type != TYPE_DIR) {
 				return -EEXIST;
 			}
 		} else {
@@ -616,48 +1378,61 @@ int jgfs_move_ent(struct jgfs_dir_ent *dir_ent,
 			if (extant_ent->type == TYPE_DIR) {
 				return -EISDIR;
 			}
-			
-			/* overwrite existing files */
-			new_ent = extant_ent;
 		}
-	} else if (rtn == -ENOENT) {
-		if ((rtn = jgfs_create_ent(new_parent, dir_ent, &new_ent)) != 0) {
+	} else if (rtn != -ENOENT) {
+		return rtn;
+	}
+	
+	/* copy the dir ent under its new name */
+	struct jgfs_dir_ent renamed_ent = *dir_ent, *moved_ent;
+	strlcpy(renamed_ent.name, new_name, JGFS_NAME_LIMIT + 1);
+	
+	if (rtn == 0) {
+		/* the target's dir ent is taken over in place, rather than deleted
+		 * and made again, so that the target is never gone without the
+		 * rename having happened (as it would be if the directory then had
+		 * no room to grow) */
+		if ((rtn = jgfs_dealloc_ent(extant_ent)) != 0) {
 			return rtn;
 		}
-	} else {
+		
+		jgfs_lock_dir(new_parent->begin, true);
+		memcpy(extant_ent, &renamed_ent, sizeof(*extant_ent));
+		jgfs_dirty(extant_ent, sizeof(*extant_ent));
+		jgfs_dcache_inval_neg();
+		jgfs_unlock_dir(new_parent->begin);
+		
+		moved_ent = extant_ent;
+	} else if ((rtn = jgfs_create_ent(new_parent, &renamed_ent,
+		&moved_ent)) != 0) {
 		return rtn;
 	}
 	
-	/* copy the dir ent */
-	memcpy(new_ent, dir_ent, sizeof(*new_ent));
+	/* open handles follow it to its new home */
+	jgfs_file_moved(dir_ent, moved_ent);
 	
 	/* clear out the old dir ent */
-	memset(dir_ent, 0, sizeof(*dir_ent));
-	
-	return 0;
+	return jgfs_delete_ent(parent, dir_ent, false);
 }
 
-int jgfs_delete_ent(struct jgfs_dir_ent *dir_ent, bool dealloc) {
-	if (dealloc) {
-		/* check for directory emptiness, if appropriate */
-		if (dir_ent->type == TYPE_DIR) {
-			struct jgfs_dir_clust *dir_clust = jgfs_get_clust(dir_ent->begin);
-			if (jgfs_dir_count(dir_clust) != 0) {
-				return -ENOTEMPTY;
-			}
-			
-			/* deallocate the directory cluster */
-			jgfs_fat_write(dir_ent->begin, FAT_FREE);
-		} else {
-			/* deallocate all the clusters associated with the dir ent */
-			if (dir_ent->size != 0) {
-				jgfs_reduce(dir_ent, 0);
-			}
-		}
+int jgfs_delete_ent(struct jgfs_dir_ent *parent, struct jgfs_dir_ent *dir_ent,
+	bool dealloc) {
+	int rtn;
+	if (dealloc && (rtn = jgfs_dealloc_ent(dir_ent)) != 0) {
+		return rtn;
+	}
+	
+	/* paths through a deleted directory are no longer valid */
+	if (dir_ent->type == TYPE_DIR) {
+		jgfs_dcache_inval_tree();
 	}
 	
-	/* erase this dir ent from the parent dir cluster */
+	/* erase this dir ent from the parent directory */
+	jgfs_dindex_remove(parent, dir_ent);
 	memset(dir_ent, 0, sizeof(*dir_ent));
+	jgfs_dirty(dir_ent, sizeof(*dir_ent));
+	
+	jgfs_dir_trim(parent);
 	
 	return 0;
 }
@@ -688,6 +1463,8 @@ void jgfs_reduce(struct jgfs_dir_ent *dir_ent, uint32_t new_size) {
 		clust_after = CEIL(new_size, jgfs_clust_size());
 	
 	if (clust_before != clust_after) {
+		jgfs_lock_fat(true);
+		
 		fat_ent_t this = dir_ent->begin, next;
 		
 		for (uint16_t i = 1; i <= clust_before; ++i) {
@@ -708,17 +1485,28 @@ void jgfs_reduce(struct jgfs_dir_ent *dir_ent, uint32_t new_size) {
 			this = next;
 		}
 		
+		jgfs_dindex_trunc(dir_ent, clust_after);
+		jgfs_file_trunc(dir_ent, clust_after);
+		
 		/* special case for zero-size files */
 		if (clust_after == 0) {
 			jgfs_fat_write(dir_ent->begin, FAT_FREE);
 			dir_ent->begin = FAT_NALLOC;
 		}
+		
+		jgfs_unlock_fat();
 	}
 	
 	dir_ent->size = new_size;
+	jgfs_dirty(dir_ent, sizeof(*dir_ent));
 }
 
 bool jgfs_enlarge(struct jgfs_dir_ent *dir_ent, uint32_t new_size) {
+	return jgfs_enlarge_over(dir_ent, new_size, new_size);
+}
+
+bool jgfs_enlarge_over(struct jgfs_dir_ent *dir_ent, uint32_t new_size,
+	uint32_t off) {
 	uint32_t clust_size = jgfs_clust_size();
 	
 	if (new_size <= dir_ent->size) {
@@ -728,66 +1516,105 @@ bool jgfs_enlarge(struct jgfs_dir_ent *dir_ent, uint32_t new_size) {
 	bool nospc = false;
 	uint16_t clust_before = CEIL(dir_ent->size, clust_size),
 		clust_after = CEIL(new_size, clust_size);
-	fat_ent_t new_addr;
 	
 	if (clust_before != clust_after) {
-		/* special case for zero-size files */
-		if (dir_ent->size == 0) {
-			if (jgfs_fat_find(FAT_FREE, &new_addr)) {
-				dir_ent->begin = new_addr;
-				jgfs_fat_write(new_addr, FAT_EOF);
-				
-				clust_before = 1;
-			} else {
+		jgfs_lock_fat(true);
+		
+		fat_ent_t this = FAT_NALLOC;
+		
+		/* zero-size files have no chain yet */
+		if (dir_ent->size != 0) {
+			uint16_t clust_chain = jgfs_chain_len(dir_ent);
+			
+			/* this means the filesystem is inconsistent */
+			if (clust_chain == 0) {
+				warnx("jgfs_enlarge: found no clust chain");
+				jgfs_unlock_fat();
 				return false;
+			} else if (clust_chain < clust_before) {
+				warnx("jgfs_enlarge: found premature FAT_EOF in clust chain");
+				clust_before = clust_chain;
 			}
+			
+			/* jump straight to the tail of the cached chain */
+			this = jgfs_chain_get(dir_ent, clust_before - 1);
 		}
 		
-		fat_ent_t this = dir_ent->begin, next;
+		/* growing files get a window sized in proportion to their length */
+		uint16_t fit = clust_before;
+		if (fit < RESV_MIN) {
+			fit = RESV_MIN;
+		} else if (fit > RESV_MAX) {
+			fit = RESV_MAX;
+		}
 		
-		for (uint16_t i = 1; i < clust_after; ++i) {
-			next = jgfs_fat_read(this);
+		for (uint16_t i = clust_before; i < clust_after; ) {
+			fat_ent_t run_addr;
+			uint16_t run_len = jgfs_fat_alloc(dir_ent->begin,
+				(this == FAT_NALLOC ? FAT_NALLOC : this + 1),
+				clust_after - i, fit, &run_addr);
 			
-			/* this means the filesystem is inconsistent */
-			if (this == FAT_EOF && i < clust_before) {
-				warnx("jgfs_enlarge: found premature FAT_EOF in clust chain");
-				clust_before = i;
+			if (run_len == 0) {
+				clust_after = i;
+				new_size = clust_after * clust_size;
+				nospc = true;
+				break;
 			}
 			
-			if (i >= clust_before) {
-				if (jgfs_fat_find(FAT_FREE, &new_addr)) {
-					jgfs_fat_write(this, new_addr);
-					jgfs_fat_write(new_addr, FAT_EOF);
-					
-					this = new_addr;
-				} else {
-					clust_after = i - 1;
-					new_size = clust_after * clust_size;
-					nospc = true;
-					break;
-				}
+			/* link up the run, then attach it to the end of the chain */
+			for (uint16_t j = 0; j < run_len; ++j) {
+				jgfs_fat_write(run_addr + j,
+					(j + 1 < run_len ? run_addr + j + 1 : FAT_EOF));
+			}
+			
+			if (this == FAT_NALLOC) {
+				dir_ent->begin = run_addr;
 			} else {
-				this = next;
+				jgfs_fat_write(this, run_addr);
 			}
+			
+			this = run_addr + run_len - 1;
+			i   += run_len;
+		}
+		
+		jgfs_unlock_fat();
+	}
+	
+	/* give back whatever was added rather than leave the file grown by some
+	 * amount that nobody asked for */
+	if (nospc) {
+		uint32_t old_size = dir_ent->size;
+		
+		if (new_size > old_size) {
+			dir_ent->size = new_size;
+			jgfs_reduce(dir_ent, old_size);
 		}
+		
+		return false;
+	}
+	
+	/* only the gap between the old end and off needs zeroing */
+	if (off < dir_ent->size) {
+		off = dir_ent->size;
+	}
+	if (off > new_size) {
+		off = new_size;
 	}
 	
-	jgfs_zero_span(dir_ent, dir_ent->size, new_size - dir_ent->size);
+	jgfs_zero_span(dir_ent, dir_ent->size, off - dir_ent->size);
 	
 	dir_ent->size = new_size;
+	jgfs_dirty(dir_ent, sizeof(*dir_ent));
 	
-	return !nospc;
+	return true;
 }
 
 void jgfs_zero_span(struct jgfs_dir_ent *dir_ent, uint32_t off, uint32_t size) {
 	uint32_t clust_size = jgfs_clust_size();
 	
 	/* skip to the first cluster to be zeroed */
-	fat_ent_t zero_addr = dir_ent->begin;
-	while (off >= clust_size) {
-		zero_addr = jgfs_fat_read(zero_addr);
-		off      -= clust_size;
-	}
+	fat_ent_t zero_addr = jgfs_chain_get(dir_ent, off / clust_size);
+	off %= clust_size;
 	
 	while (size > 0) {
 		uint32_t size_this_cluster;
@@ -798,8 +1625,9 @@ void jgfs_zero_span(struct jgfs_dir_ent *dir_ent, uint32_t off, uint32_t size) {
 			size_this_cluster = size;
 		}
 		
-		struct clust *data_clust = jgfs_get_clust(zero_addr);
+		struct clust *data_clust = jgfs_get_data(zero_addr);
 		memset((char *)data_clust + off, 0, size_this_cluster);
+		jgfs_dirty((char *)data_clust + off, size_this_cluster);
 		
 		size -= size_this_cluster;
 		off   = 0;
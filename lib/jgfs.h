@@ -10,15 +10,18 @@
 
 
 #include "macro.h"
+#include <stddef.h>
+#include <sys/uio.h>
 
 
 #define SECT_SIZE 0x200
 
 #define JGFS_VER_MAJOR 0x04
-#define JGFS_VER_MINOR 0x01
-#define JGFS_VER_TOTAL 0x0401
+#define JGFS_VER_MINOR 0x02
+#define JGFS_VER_TOTAL 0x0402
 
-#define JGFS_MAGIC "JGFS"
+#define JGFS_MAGIC    "JGFS"
+#define JGFS_JL_MAGIC "JGJL"
 
 #define JGFS_VBR_SECT  0
 #define JGFS_HDR_SECT  1
@@ -39,6 +42,11 @@
 #define JGFS_VER_EXPAND(_maj, _min) \
 	(((uint16_t)_maj * 0x100) + (uint16_t)_min)
 
+#define JGFS_READ_IOV_MAX(_size) \
+	(((_size) / jgfs_clust_size()) + 2)
+
+#define JGFS_READAHEAD_DEFAULT (2 * 1024 * 1024)
+
 
 typedef uint16_t fat_ent_t;
 
@@ -59,6 +67,27 @@ enum jgfs_fat_val {
 	FAT_NALLOC = 0xffff, // file not allocated
 };
 
+enum jgfs_scan_isa {
+	SCAN_SCALAR = 0, // portable c
+	SCAN_SSE2   = 1, // x86 sse2
+	SCAN_AVX2   = 2, // x86 avx2
+	SCAN_BEST   = 3, // best available on this cpu
+};
+
+enum jgfs_dev_type {
+	DEV_MMAP   = 0, // the device mapped into memory
+	DEV_PREAD  = 1, // a buffer cache filled with pread and written with pwrite
+	DEV_URING  = 2, // the same buffer cache, with i/o batched through io_uring
+	DEV_WINDOW = 3, // windows of the device mapped into memory as needed
+	DEV_AUTO   = 4, // mmap, or pread for a filesystem with a journal
+};
+
+enum jgfs_dcache_result {
+	DCACHE_MISS = 0, // not cached (or the cached entry was stale)
+	DCACHE_HIT  = 1, // path exists at the returned location
+	DCACHE_NEG  = 2, // path is known not to exist
+};
+
 enum jgfs_file_type {
 	TYPE_FILE    = (1 << 0), // regular file
 	TYPE_DIR     = (1 << 1), // directory
@@ -114,7 +143,22 @@ struct __attribute__((__packed__)) jgfs_hdr {
 	
 	struct jgfs_dir_ent root_dir_ent; // root directory entry
 	
-	char     reserved[0x1b4];
+	uint32_t s_journal; // sectors reserved for the journal at the end
+	
+	char     reserved[0x1b0];
+};
+
+/* each half of the journal starts with this header, followed by the sector
+ * numbers of the logged sectors (a uint32_t each, padded out to a whole sector)
+ * and then the sectors themselves */
+struct __attribute__((__packed__)) jgfs_jl_hdr {
+	char     magic[4]; // must be "JGJL"
+	uint32_t count;    // number of sectors logged
+	uint64_t seq;      // commit number (odd in the second half, even in the
+	                   // first)
+	uint32_t crc;      // crc32 of the whole record, with this field zeroed
+	
+	char     reserved[0x1ec];
 };
 
 struct jgfs_mkfs_param {
@@ -124,10 +168,50 @@ struct jgfs_mkfs_param {
 	uint16_t s_boot;
 	uint16_t s_per_c; // set to zero to auto-choose the best value
 	
+	uint32_t s_journal; // set to zero for no journal
+	
 	bool zero_data;   // set to true to zero all data clusters
 	bool zap;         // set to true to zero the vbr and boot area
 };
 
+struct jgfs_wb_param {
+	uint32_t interval;    // write back everything changed this often (in ms)
+	uint64_t dirty_bytes; // write back as soon as this much has changed
+};
+
+struct jgfs_flush {
+	uint64_t off; // offset on the device
+	uint64_t len; // length in bytes
+};
+
+struct jgfs_fat_stats {
+	uint16_t free; // FAT_FREE
+	uint16_t used; // normal clusters and FAT_EOF
+	uint16_t bad;  // FAT_BAD
+	uint16_t rsvd; // FAT_RSVD
+};
+
+struct jgfs_frag_stats {
+	uint16_t free_extents; // runs of contiguous free clusters
+	uint16_t free_largest; // length of the longest free run
+	uint16_t links;        // fat entries pointing to another cluster
+	uint16_t breaks;       // links to anything other than the next cluster
+};
+
+/* flattened copy of a cluster chain, as far along as it has been followed */
+struct jgfs_chain {
+	uint16_t   len;   // number of clusters copied
+	uint32_t   cap;   // allocated length of clust
+	fat_ent_t *clust; // cluster addresses, in chain order
+};
+
+struct jgfs_dcache_stats {
+	uint64_t hits;     // positive entries found and still valid
+	uint64_t neg_hits; // negative entries found and still valid
+	uint64_t misses;   // paths not in the cache at all
+	uint64_t stale;    // entries found but invalidated since they were made
+};
+
 struct jgfs {
 	struct jgfs_hdr      *hdr;
 	struct sect          *boot;
@@ -139,17 +223,25 @@ _Static_assert(sizeof(struct sect) == 0x200,
 	"sect must be 512 bytes");
 _Static_assert(sizeof(struct jgfs_hdr) == 0x200,
 	"jgfs_hdr must be 512 bytes");
+_Static_assert(sizeof(struct jgfs_jl_hdr) == 0x200,
+	"jgfs_jl_hdr must be 512 bytes");
 _Static_assert(sizeof(struct jgfs_fat_sect) == 0x200,
 	"jgfs_fat_sect must be 512 bytes");
 _Static_assert(512 % sizeof(struct jgfs_dir_ent) == 0,
 	"jgfs_dir_ent must go evenly into 512 bytes");
 
 
+struct jgfs_file;
+
+
 typedef int (*jgfs_dir_func_t)(struct jgfs_dir_ent *, void *);
 
 
 /* load jgfs from the device at dev_path */
 void jgfs_init(const char *dev_path);
+/* load jgfs from the device at dev_path only to look at it, never writing to
+ * the device; the filesystem must not be changed */
+void jgfs_init_ro(const char *dev_path);
 /* make new jgfs on the device at dev_path with the given parameters */
 void jgfs_new(const char *dev_path, struct jgfs_mkfs_param *param);
 /* sync and close the filesystem */
@@ -157,73 +249,420 @@ void jgfs_done(void);
 /* sync the filesystem to disk */
 void jgfs_sync(void);
 
+/* note that len bytes at ptr in the device mapping have changed, after
+ * changing them, so that the next sync covering them flushes them (pointers
+ * outside the mapping are ignored) */
+void jgfs_dirty(const void *ptr, size_t len);
+/* forget every change noted, before syncing the whole device */
+void jgfs_dirty_clear(void);
+/* get the number of bytes noted as changed and not yet written back */
+uint64_t jgfs_dirty_bytes(void);
+/* check whether any of len bytes at off on the device are noted as changed */
+bool jgfs_dirty_test(uint64_t off, uint64_t len);
+/* flush what has changed of the file or directory with dir_ent, the cluster
+ * holding its dir ent, the fat and the header, leaving the rest of the device
+ * alone; return posix error code on failure; the caller must hold the file
+ * lock; with a journal, only the file's data is flushed, and the metadata is
+ * left for jgfs_journal_commit */
+int jgfs_sync_file(struct jgfs_dir_ent *dir_ent);
+/* take what has changed of the metadata the journal logs (the header, the fat,
+ * and directory and symlink clusters), adding spans for it to flush, until
+ * limit bytes are taken; returns false if there was more than that */
+bool jgfs_dirty_take_logged(struct jgfs_flush *flush, size_t *count,
+	uint64_t limit);
+/* start a thread writing back changes in the background, whenever the interval
+ * passes or dirty_bytes have built up (zero disables either one) */
+void jgfs_writeback_start(const struct jgfs_wb_param *param);
+/* stop the writeback thread, if it was started */
+void jgfs_writeback_stop(void);
+/* write back everything changed so far, a batch at a time: first the header
+ * and the fat, so that they never wait behind a backlog of file data, then the
+ * data clusters in order; nothing is flushed from the device's cache, which is
+ * left to fsync; with a journal, the data clusters go first, and then the
+ * metadata is committed; return posix error code on failure */
+int jgfs_writeback(void);
+/* keep the writeback thread from starting a batch; returns false if one is
+ * under way */
+bool jgfs_writeback_hold(void);
+/* let the writeback thread go on after jgfs_writeback_hold */
+void jgfs_writeback_release(void);
+/* have the writeback thread start a pass now, if it's running */
+void jgfs_writeback_kick(void);
+
+/* zero the journal of a new filesystem, which is left unused until it is next
+ * loaded */
+void jgfs_journal_format(void);
+/* replay the journal of the filesystem being loaded onto the device, retire
+ * its records, and start logging changes to the metadata through it; if ro,
+ * the replay is only made in memory, and nothing is logged */
+void jgfs_journal_open(bool ro);
+/* stop logging changes through the journal, after the last commit, retiring
+ * the records if that commit went through */
+void jgfs_journal_close(void);
+/* commit nothing more, leaving out whatever hasn't been committed as a crash
+ * would (for exiting while the metadata may be half changed) */
+void jgfs_journal_abandon(void);
+/* check whether changes to the metadata are being logged */
+bool jgfs_journal_active(void);
+/* note that a cluster now holds a directory or symlink (meta set), or has been
+ * freed (meta clear); returns true if the freed cluster is to be kept out of
+ * the free index until the journal hands it to jgfs_fat_release */
+bool jgfs_journal_clust(fat_ent_t clust_num, bool meta);
+/* check whether changes to a cluster go to disk through the journal */
+bool jgfs_journal_logged(fat_ent_t clust_num);
+/* log every change to the metadata made so far as one transaction, and make it
+ * durable along with everything written back before it; callers arriving
+ * while a commit is under way are taken care of together by the next one;
+ * return posix error code on failure; the caller must not hold the namespace
+ * lock */
+int jgfs_journal_commit(void);
+
+/* choose how the device is accessed (before jgfs_init or jgfs_new);
+ * cache_size bounds the memory the pread and uring backends keep for file data,
+ * or that the windowed backend keeps mapped (zero keeps the default) */
+void jgfs_dev_select(enum jgfs_dev_type type, uint64_t cache_size);
+/* lock what is pinned (the header, the fat and directories) into memory as it
+ * is loaded, so that it is never paged out (before jgfs_init or jgfs_new) */
+void jgfs_dev_lock_pinned(bool lock);
+/* open the backend on the device fd of size bytes; until jgfs_dev_layout, only
+ * the vbr and the header can be loaded */
+void jgfs_dev_open(int fd, uint64_t size);
+/* close the backend, after everything has been written back */
+void jgfs_dev_close(void);
+/* lay the backend out for a filesystem whose clusters, of clust_size bytes,
+ * start meta bytes into the device and end len bytes into it; what was loaded
+ * before must be loaded again */
+void jgfs_dev_layout(uint64_t meta, uint32_t clust_size, uint64_t len);
+/* make len bytes at off on the device present in memory, where they lie
+ * together, and return where; pin keeps them until unmount (exiting if they
+ * can't be read), while without it they may only be used until the namespace
+ * lock is released */
+void *jgfs_dev_load(uint64_t off, uint64_t len, bool pin);
+/* get where the byte at off on the device goes in memory, without loading it;
+ * the same holds for it as for jgfs_dev_load without pin */
+void *jgfs_dev_addr(uint64_t off);
+/* get the offset on the device of a pointer into its memory, or UINT64_MAX if
+ * it points anywhere else */
+uint64_t jgfs_dev_offset(const void *ptr);
+/* make the spans of the iovecs (pointers into the device's memory) present, as
+ * with jgfs_dev_load without pin, reading in whatever is missing of their first
+ * load_len bytes at once; the rest is about to be written over, so only pages
+ * it covers in part are read */
+void jgfs_dev_load_iov(const struct iovec *iov, int iov_count,
+	uint64_t load_len);
+/* start bringing len bytes at off on the device into memory, without waiting
+ * for them */
+void jgfs_dev_prefetch(uint64_t off, uint64_t len);
+/* write count spans back to the device, all at once, and make them and
+ * everything written back before durable if barrier is set; pages that failed
+ * to read are left out, and fail the flush; return posix error code on
+ * failure */
+int jgfs_dev_flush(const struct jgfs_flush *flush, size_t count, bool barrier);
+/* check that len bytes at ptr in the device's memory (after loading them) can
+ * be read; return -EIO if not, noting where as possibly bad */
+int jgfs_dev_probe(const void *ptr, uint64_t len);
+/* check whether the device fd may be read and written directly, with the
+ * memory following along */
+bool jgfs_dev_direct(void);
+/* check whether the backend was chosen, rather than left to DEV_AUTO */
+bool jgfs_dev_chosen(void);
+/* return -EIO (once) if reading from the device has failed since last asked,
+ * or zero */
+int jgfs_dev_check(void);
+/* get how many bytes of the device's memory have been locked in */
+uint64_t jgfs_dev_locked(void);
+/* check whether locking pinned memory was asked for, whether or not it has
+ * worked */
+bool jgfs_dev_lock_wanted(void);
+/* check whether the backend holds more memory than it has been allowed */
+bool jgfs_dev_over(void);
+/* give back memory the backend holds beyond what it has been allowed; the
+ * caller must hold the namespace lock exclusively */
+void jgfs_dev_trim(void);
+
 /* get the cluster size (in bytes) of the loaded filesystem */
 uint32_t jgfs_clust_size(void);
 /* get the number of clusters in the loaded filesystem */
 uint16_t jgfs_fs_clusters(void);
 /* get a pointer to a sector */
 void *jgfs_get_sect(uint32_t sect_num);
-/* get a pointer to a cluster */
+/* get a pointer to a cluster, kept in memory until unmount */
 void *jgfs_get_clust(fat_ent_t clust_num);
+/* get a pointer to a cluster of file data, which is only good until the
+ * namespace lock is released */
+void *jgfs_get_data(fat_ent_t clust_num);
+/* get where a cluster of file data goes in memory, without loading it */
+void *jgfs_data_addr(fat_ent_t clust_num);
+/* get the offset on the device of a cluster of file data */
+uint64_t jgfs_data_offset(fat_ent_t clust_num);
+/* get the file descriptor of the device */
+int jgfs_dev_fd(void);
+
+/* note that len bytes at off on the device failed to read, so that the
+ * clusters there are marked FAT_BAD rather than FAT_FREE when they are freed */
+void jgfs_bad_note(uint64_t off, uint64_t len);
 
 /* read the fat entry at addr */
 fat_ent_t jgfs_fat_read(fat_ent_t addr);
 /* write val to the fat entry at addr */
 void jgfs_fat_write(fat_ent_t addr, fat_ent_t val);
+/* let a freed cluster that the journal held back be allocated again; the
+ * caller must hold the fat lock exclusively */
+void jgfs_fat_release(fat_ent_t addr);
 /* get the address of the first cluster with the target value in the fat, or
- * return false on failure to find one */
+ * return false on failure to find one (FAT_FREE is answered from the in-memory
+ * free index rather than by scanning the fat) */
 bool jgfs_fat_find(fat_ent_t target, fat_ent_t *first);
-/* count fat entries with the target value (use FAT_FREE for free blocks) */
+/* count fat entries with the target value (use FAT_FREE for free blocks);
+ * FAT_FREE, FAT_RSVD and FAT_BAD are answered from maintained counters */
 uint16_t jgfs_fat_count(fat_ent_t target);
-/* dump the entire fat to stderr */
+/* get the maintained cluster counts for each state without scanning the fat */
+void jgfs_fat_stats(struct jgfs_fat_stats *stats);
+/* find a run of up to want free clusters for the file whose first cluster is
+ * owner (FAT_NALLOC for a file with no clusters yet), continuing at goal if
+ * possible and otherwise opening a window of fit clusters in the best-fitting
+ * free extent; returns the length of the run (zero if the filesystem is full)
+ * and its first cluster in first; the run is not marked as used */
+uint16_t jgfs_fat_alloc(fat_ent_t owner, fat_ent_t goal, uint16_t want,
+	uint16_t fit, fat_ent_t *first);
+/* measure free space and cluster chain fragmentation by scanning the fat */
+void jgfs_frag_stats(struct jgfs_frag_stats *stats);
+/* dump the entire fat to stderr, collapsing repeated lines */
 void jgfs_fat_dump(void);
 
-/* find dir clust corresponding to the second-to-last path component, plus the
- * dir ent corresponding to the last component (or NULL for just the parent);
- * return posix error code on failure */
-int jgfs_lookup(const char *path, struct jgfs_dir_clust **parent,
+/* choose the fat scanning kernels (falling back to the best one this cpu
+ * supports); returns the kernels actually chosen */
+enum jgfs_scan_isa jgfs_scan_select(enum jgfs_scan_isa isa);
+/* get the index of the first of n fat entries equal to target, or n */
+size_t jgfs_scan_find(const fat_ent_t *ents, size_t n, fat_ent_t target);
+/* count the n fat entries equal to target */
+size_t jgfs_scan_count(const fat_ent_t *ents, size_t n, fat_ent_t target);
+/* set bit i of bits (which must hold CEIL(n, 64) words) for each of the n fat
+ * entries equal to target, and clear the rest */
+void jgfs_scan_mask(const fat_ent_t *ents, size_t n, fat_ent_t target,
+	uint64_t *bits);
+
+/* hash len bytes of str */
+uint32_t jgfs_hash(const char *str, size_t len);
+
+/* find the dir ent of the directory named by all but the last path component,
+ * plus the dir ent corresponding to the last component (or NULL for just the
+ * parent); return posix error code on failure */
+int jgfs_lookup(const char *path, struct jgfs_dir_ent **parent,
 	struct jgfs_dir_ent **child);
 /* find child with name in parent; return posix error code on failure */
-int jgfs_lookup_child(const char *name, struct jgfs_dir_clust *parent,
+int jgfs_lookup_child(const char *name, struct jgfs_dir_ent *parent,
 	struct jgfs_dir_ent **child);
 
+/* get the nth dir ent (counting from zero across all of its clusters) of the
+ * directory starting at cluster begin; returns NULL if it is not that large */
+struct jgfs_dir_ent *jgfs_dir_get(fat_ent_t begin, uint32_t n);
 /* initialize (zero out) a dir cluster with no entries */
 void jgfs_dir_init(struct jgfs_dir_clust *dir_clust);
 /* count the number of dir ents in the given directory */
-uint32_t jgfs_dir_count(struct jgfs_dir_clust *dir_clust);
-/* call func once for each dir ent in parent with the dir ent and the
+uint32_t jgfs_dir_count(struct jgfs_dir_ent *dir);
+/* call func once for each dir ent in dir with the dir ent and the
  * user-provided pointer as arguments; if func returns nonzero, the foreach
  * immediately terminates with the same return value */
-int jgfs_dir_foreach(jgfs_dir_func_t func, struct jgfs_dir_clust *dir_clust,
+int jgfs_dir_foreach(jgfs_dir_func_t func, struct jgfs_dir_ent *dir,
 	void *user_ptr);
 
-/* add new (valid) dir ent to parent and return a pointer to it as created_ent
- * (if not NULL); return posix error code on failure */
-int jgfs_create_ent(struct jgfs_dir_clust *parent,
+/* add new (valid) dir ent to parent, growing it if necessary, and return a
+ * pointer to it as created_ent (if not NULL); return posix error code on
+ * failure */
+int jgfs_create_ent(struct jgfs_dir_ent *parent,
 	const struct jgfs_dir_ent *new_ent, struct jgfs_dir_ent **created_ent);
 /* add new file called name to parent; return posix error code on failure */
-int jgfs_create_file(struct jgfs_dir_clust *parent, const char *name);
+int jgfs_create_file(struct jgfs_dir_ent *parent, const char *name);
 /* add new dir called name to parent; return posix error code on failure */
-int jgfs_create_dir(struct jgfs_dir_clust *parent, const char *name);
+int jgfs_create_dir(struct jgfs_dir_ent *parent, const char *name);
 /* add new symlink called name with target to parent; return posix error code on
  * failure */
-int jgfs_create_symlink(struct jgfs_dir_clust *parent, const char *name,
+int jgfs_create_symlink(struct jgfs_dir_ent *parent, const char *name,
 	const char *target);
 
-/* transplant dir_ent from its current parent to new_parent */
-int jgfs_move_ent(struct jgfs_dir_ent *dir_ent,
-	struct jgfs_dir_clust *new_parent);
+/* transplant dir_ent from parent to new_parent under new_name, replacing any
+ * file (or empty dir) already there; return posix error code on failure */
+int jgfs_move_ent(struct jgfs_dir_ent *parent, struct jgfs_dir_ent *dir_ent,
+	struct jgfs_dir_ent *new_parent, const char *new_name);
 /* delete the given dir ent from parent, deallocating the file or directory if
- * requested; return posix error code on failure */
-int jgfs_delete_ent(struct jgfs_dir_ent *dir_ent, bool dealloc);
+ * requested, and shrink parent if it has become mostly empty; return posix
+ * error code on failure */
+int jgfs_delete_ent(struct jgfs_dir_ent *parent, struct jgfs_dir_ent *dir_ent,
+	bool dealloc);
 
 /* count the clusters taken up by a file or directory */
 uint16_t jgfs_block_count(struct jgfs_dir_ent *dir_ent);
 
 /* reduce the size of a file */
 void jgfs_reduce(struct jgfs_dir_ent *dir_ent, uint32_t new_size);
-/* increase the size of a file; returns false on insufficient space */
+/* increase the size of a file; returns false on insufficient space, in which
+ * case the file is left as it was */
 bool jgfs_enlarge(struct jgfs_dir_ent *dir_ent, uint32_t new_size);
+/* increase the size of a file, leaving the new clusters from off onward as they
+ * are for the caller to overwrite; returns false on insufficient space, in
+ * which case the file is left as it was */
+bool jgfs_enlarge_over(struct jgfs_dir_ent *dir_ent, uint32_t new_size,
+	uint32_t off);
+
+/* get the address of the nth cluster (counting from zero) of the cluster chain
+ * starting at begin, copying the chain into chain (if not NULL) as far as that
+ * and reading what was copied before from there; returns FAT_EOF if the chain
+ * is not that long, leaving its length in *len (if not NULL) */
+fat_ent_t jgfs_chain_follow(struct jgfs_chain *chain, fat_ent_t begin,
+	uint16_t n, uint16_t *len);
+/* shorten the copy in chain to len clusters (this must be done whenever the
+ * chain it is a copy of is cut short) */
+void jgfs_chain_cut(struct jgfs_chain *chain, uint16_t len);
+/* release the memory of the copy in chain */
+void jgfs_chain_free(struct jgfs_chain *chain);
+/* get the address of the nth cluster (counting from zero) of dir_ent, through
+ * the copy of its chain kept by its open file or its directory index, if any;
+ * returns FAT_EOF if it is not that long */
+fat_ent_t jgfs_chain_get(struct jgfs_dir_ent *dir_ent, uint16_t n);
+/* get the number of clusters of dir_ent, as jgfs_chain_get */
+uint16_t jgfs_chain_len(struct jgfs_dir_ent *dir_ent);
+
+/* find the dir ent called name in dir through the directory's in-memory name
+ * index, returning its number in idx; return posix error code on failure */
+int jgfs_dindex_lookup(struct jgfs_dir_ent *dir, const char *name,
+	uint32_t *idx);
+/* find the number of the first unused dir ent in dir; returns false if the
+ * directory is full */
+bool jgfs_dindex_free(struct jgfs_dir_ent *dir, uint32_t *idx);
+/* count the dir ents in use in dir */
+uint32_t jgfs_dindex_count(struct jgfs_dir_ent *dir);
+/* count the clusters of dir up to and including the last one in use */
+uint32_t jgfs_dindex_clusts(struct jgfs_dir_ent *dir);
+/* add the newly named dir ent number idx to dir's index, if any */
+void jgfs_dindex_insert(struct jgfs_dir_ent *dir, uint32_t idx);
+/* remove dir_ent from dir's index, if any (this must be called before its name
+ * is cleared) */
+void jgfs_dindex_remove(struct jgfs_dir_ent *dir,
+	struct jgfs_dir_ent *dir_ent);
+/* get the address of cluster n of dir, as jgfs_chain_follow, through the copy
+ * of its chain its index keeps */
+fat_ent_t jgfs_dindex_chain(struct jgfs_dir_ent *dir, uint16_t n,
+	uint16_t *len);
+/* get the address of cluster n of the directory starting at begin, as
+ * jgfs_dindex_chain, if it still has an index */
+fat_ent_t jgfs_dindex_clust(fat_ent_t begin, uint16_t n);
+/* shorten the copy of the chain of dir kept by its index, if any, to len
+ * clusters */
+void jgfs_dindex_trunc(struct jgfs_dir_ent *dir, uint16_t len);
+/* drop the index of the directory starting at begin, if any (this must be
+ * called before the directory is freed) */
+void jgfs_dindex_forget(fat_ent_t begin);
+/* drop all directory indexes and release their memory */
+void jgfs_dindex_forget_all(void);
+
+/* look up the first len chars of path in the path cache; on a hit, the dir ent
+ * is number idx of the directory starting at cluster dir */
+enum jgfs_dcache_result jgfs_dcache_get(const char *path, size_t len,
+	fat_ent_t *dir, uint32_t *idx);
+/* remember where the first len chars of path were found (or with dir set to
+ * FAT_NALLOC, that they weren't) */
+void jgfs_dcache_put(const char *path, size_t len, fat_ent_t dir,
+	uint32_t idx);
+/* invalidate all negative path cache entries (must be called whenever a name
+ * is added to any directory) */
+void jgfs_dcache_inval_neg(void);
+/* invalidate all positive path cache entries (must be called whenever a
+ * directory is moved or deleted) */
+void jgfs_dcache_inval_tree(void);
+/* get the path cache's hit and miss counters */
+void jgfs_dcache_stats(struct jgfs_dcache_stats *stats);
+/* drop all cached paths and release their memory */
+void jgfs_dcache_clear(void);
+
+/* open the file with the given dir ent, sharing its state with any handles
+ * already open on it */
+struct jgfs_file *jgfs_file_open(struct jgfs_dir_ent *dir_ent);
+/* drop a reference to an open file, freeing its clusters if it was unlinked
+ * and this was the last one */
+void jgfs_file_close(struct jgfs_file *file);
+/* drop refs references to an open file at once, as jgfs_file_close does for
+ * one */
+void jgfs_file_put(struct jgfs_file *file, uint32_t refs);
+/* get the current dir ent of an open file, which follows it across renames
+ * and survives its unlinking */
+struct jgfs_dir_ent *jgfs_file_dir_ent(struct jgfs_file *file);
+/* get the address of cluster n of an open file, continuing from the last
+ * cluster looked up or recorded if possible; returns FAT_EOF if the file is
+ * not that long */
+fat_ent_t jgfs_file_clust(struct jgfs_file *file, uint16_t n);
+/* record that cluster n of an open file is at addr */
+void jgfs_file_seek(struct jgfs_file *file, uint16_t n, fat_ent_t addr);
+/* let any open file on dir_ent know it has been moved to new_dir_ent */
+void jgfs_file_moved(struct jgfs_dir_ent *dir_ent,
+	struct jgfs_dir_ent *new_dir_ent);
+/* detach any open file (or directory) from dir_ent, which is about to be
+ * deleted, and take over its clusters; returns false if it is not open */
+bool jgfs_file_orphan(struct jgfs_dir_ent *dir_ent);
+/* let any open file on dir_ent know it has been cut down to len clusters */
+void jgfs_file_trunc(struct jgfs_dir_ent *dir_ent, uint16_t len);
+/* get the address of cluster n of dir_ent, as jgfs_chain_follow, through the
+ * copy of its chain kept by its open file; returns false if it is not open */
+bool jgfs_file_chain(const struct jgfs_dir_ent *dir_ent, uint16_t n,
+	fat_ent_t *addr, uint16_t *len);
+/* close all open files, freeing the clusters of unlinked ones */
+void jgfs_file_close_all(void);
+/* prefetch up to max bytes of the clusters ahead of an open file being read in
+ * order (zero to not prefetch at all) */
+void jgfs_file_readahead(uint32_t max);
+
+/* point iov at up to size bytes at offset of the file with dir_ent, in place in
+ * the device mapping, through the cursor of file if not NULL; returns the
+ * number of runs of contiguous clusters filled in, which is at most
+ * JGFS_READ_IOV_MAX(size), or -EIO if they can't be read from the device; if
+ * file continues on from its last read, the clusters after these are
+ * prefetched; the caller must hold the file lock for as long as it uses the
+ * data */
+int jgfs_read_iov(struct jgfs_dir_ent *dir_ent, struct jgfs_file *file,
+	struct iovec *iov, size_t size, uint64_t offset);
+/* make room for size bytes at offset in the file with dir_ent and point iov at
+ * where they go in the device mapping, like jgfs_read_iov (but without
+ * prefetching what follows them); space beyond the old end of the file is not
+ * zeroed, so the caller must fill every run; returns the number of runs or
+ * posix error code on failure; the caller must hold the file lock exclusively
+ * until it has filled them */
+int jgfs_write_iov(struct jgfs_dir_ent *dir_ent, struct jgfs_file *file,
+	struct iovec *iov, size_t size, uint64_t offset);
+/* finish filling the iov_count runs from jgfs_write_iov at offset, of which
+ * only the first written bytes were filled: note them as changed, and give
+ * back any space the write added beyond them, so that the file is only as long
+ * as what was written to it; old_size is the size of the file before the
+ * write */
+void jgfs_write_end(struct jgfs_dir_ent *dir_ent, uint32_t old_size,
+	const struct iovec *iov, int iov_count, uint64_t offset, size_t written);
+/* truncate or extend the file with dir_ent to new_size; return posix error code
+ * on failure; the caller must hold the file lock exclusively */
+int jgfs_resize(struct jgfs_dir_ent *dir_ent, uint64_t new_size);
+
+/* the namespace lock is held shared by every operation that resolves paths, and
+ * exclusively by those that remove or move dir ents, so that dir ent pointers
+ * stay valid while it is held; locks must be taken in the order namespace, dir,
+ * file, fat, and no two dir or file locks may be held at once */
+
+/* take the namespace lock, exclusively or shared */
+void jgfs_lock_ns(bool excl);
+/* take the namespace lock if it is free, without waiting; returns whether it
+ * was taken */
+bool jgfs_trylock_ns(bool excl);
+/* release the namespace lock */
+void jgfs_unlock_ns(void);
+/* take the lock on the fat and the cluster allocator */
+void jgfs_lock_fat(bool excl);
+/* release the lock on the fat and the cluster allocator */
+void jgfs_unlock_fat(void);
+/* take the lock on the entries of the directory starting at begin */
+void jgfs_lock_dir(fat_ent_t begin, bool excl);
+/* release the lock on the entries of the directory starting at begin */
+void jgfs_unlock_dir(fat_ent_t begin);
+/* take the lock on the size, contents and mtime of the given file */
+void jgfs_lock_file(const struct jgfs_dir_ent *dir_ent, bool excl);
+/* release the lock on the size, contents and mtime of the given file */
+void jgfs_unlock_file(const struct jgfs_dir_ent *dir_ent);
 
 /* fill a span of the given dir ent's data clusters with zeroes */
 void jgfs_zero_span(struct jgfs_dir_ent *dir_ent, uint32_t off, uint32_t size);
@@ -0,0 +1,590 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* sector numbers held by each sector of a record's table */
+#define JL_PER_S (SECT_SIZE / sizeof(uint32_t))
+
+
+/* the journal is split into two halves, and each commit writes one record
+ * (the changed metadata sectors, in full) into the half its number picks,
+ * followed by a single barrier; only then are the sectors written in place,
+ * which the next commit's barrier makes durable before the half is reused, so
+ * that the two halves always hold whatever hasn't surely reached its place;
+ * once everything is durably in place (after replay, and at unmount), the
+ * records are retired, so that they are never replayed over what comes later */
+static bool      jl_active = false;
+static bool      jl_abandoned = false;
+static bool      jl_live = false; // records may be left to replay
+static uint32_t  jl_first;     // first sector of the journal
+static uint32_t  jl_half;      // sectors in each half
+static uint32_t  jl_room;      // most sectors logged in one record
+static uint64_t  jl_seq;       // number of the next commit written out
+static char     *jl_buf  = NULL;
+static struct jgfs_flush *jl_flush = NULL;
+
+/* clusters holding directories and symlinks, whose changes are logged; a
+ * cluster that is freed stays logged, and is kept from being allocated, until
+ * neither record left to replay can hold it: that is, until two more records
+ * have been written after the one of the commit that freed it, so that its old
+ * contents are never replayed over whatever it holds next */
+static uint64_t jl_meta[0x10000 / 64];
+static uint64_t jl_freed[0x10000 / 64];     // freed and still held
+static uint64_t jl_freed_new[0x10000 / 64]; // freed since the last commit
+static uint64_t jl_taken[0x10000 / 64];     // freed by the commit under way
+static uint64_t jl_held[2][0x10000 / 64];   // freed by the last two records
+
+/* group commit: a caller wanting its changes committed waits for a commit that
+ * started after it arrived, and the first one of them to find no commit under
+ * way starts one for all of them */
+static pthread_mutex_t jl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jl_cond  = PTHREAD_COND_INITIALIZER;
+static bool            jl_busy  = false;
+static uint64_t        jl_begun = 0;
+static uint64_t        jl_done  = 0;
+static int             jl_rtn   = 0;
+
+static uint32_t crc_table[256];
+
+
+static void jgfs_crc_init(void) {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		
+		for (int j = 0; j < 8; ++j) {
+			crc = (crc >> 1) ^ ((crc & 1) != 0 ? 0xedb88320u : 0);
+		}
+		
+		crc_table[i] = crc;
+	}
+}
+
+static uint32_t jgfs_crc(const void *buf, size_t len) {
+	const uint8_t *bytes = buf;
+	uint32_t crc = ~0u;
+	
+	for (size_t i = 0; i < len; ++i) {
+		crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+	
+	return ~crc;
+}
+
+/* get the number of sectors taken up by a record of count sectors */
+static uint32_t jgfs_journal_len(uint32_t count) {
+	return 1 + CEIL(count, JL_PER_S) + count;
+}
+
+/* set up the layout of the journal of the loaded filesystem */
+static void jgfs_journal_layout(void) {
+	jl_first = jgfs.hdr->s_total - jgfs.hdr->s_journal;
+	jl_half  = jgfs.hdr->s_journal / 2;
+	
+	jl_room = (jl_half != 0 ? jl_half - 1 : 0);
+	while (jl_room != 0 && jgfs_journal_len(jl_room) > jl_half) {
+		--jl_room;
+	}
+}
+
+void jgfs_journal_format(void) {
+	jgfs_journal_layout();
+	
+	if (jgfs.hdr->s_journal == 0) {
+		return;
+	}
+	
+	/* one record has to be able to take the header, the whole fat and a
+	 * couple of directory clusters, or a rename could never be atomic */
+	uint32_t need = JGFS_BOOT_SECT + jgfs.hdr->s_boot + jgfs.hdr->s_fat +
+		(2 * jgfs.hdr->s_per_c);
+	if (jl_room < need) {
+		errx(1, "journal is too small (it needs at least %" PRIu32
+			" sectors)", 2 * jgfs_journal_len(need));
+	}
+	
+	/* a header that doesn't check out is an empty half */
+	for (uint32_t i = 0; i < 2; ++i) {
+		struct sect *sect = jgfs_get_sect(jl_first + (i * jl_half));
+		
+		memset(sect, 0, SECT_SIZE);
+		jgfs_dirty(sect, SECT_SIZE);
+	}
+}
+
+/* read the record in half into jl_buf and check it, returning its header if it
+ * is whole, or NULL */
+static const struct jgfs_jl_hdr *jgfs_journal_read(uint32_t half) {
+	struct jgfs_jl_hdr *hdr = (struct jgfs_jl_hdr *)jl_buf;
+	uint64_t off = (uint64_t)(jl_first + (half * jl_half)) * SECT_SIZE;
+	
+	if (pread(jgfs_dev_fd(), hdr, SECT_SIZE, off) != SECT_SIZE) {
+		warn("failed to read the journal");
+		return NULL;
+	}
+	
+	if (memcmp(hdr->magic, JGFS_JL_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->count == 0 || hdr->count > jl_room || hdr->seq % 2 != half) {
+		return NULL;
+	}
+	
+	size_t len = (size_t)jgfs_journal_len(hdr->count) * SECT_SIZE;
+	if (pread(jgfs_dev_fd(), jl_buf + SECT_SIZE, len - SECT_SIZE,
+		off + SECT_SIZE) != (ssize_t)(len - SECT_SIZE)) {
+		warn("failed to read the journal");
+		return NULL;
+	}
+	
+	/* a record cut short by a crash doesn't add up */
+	uint32_t crc = hdr->crc;
+	hdr->crc = 0;
+	if (jgfs_crc(jl_buf, len) != crc) {
+		return NULL;
+	}
+	hdr->crc = crc;
+	
+	return hdr;
+}
+
+static int jgfs_journal_cmp(const void *a, const void *b) {
+	uint32_t sect_a = *(const uint32_t *)a, sect_b = *(const uint32_t *)b;
+	
+	return (sect_a > sect_b) - (sect_a < sect_b);
+}
+
+/* copy the sectors of the record in jl_buf over the metadata in memory, noting
+ * them as changed, except for the skip_count sectors (in order) in skip;
+ * returns the number that differed */
+static uint32_t jgfs_journal_apply(const struct jgfs_jl_hdr *hdr,
+	const uint32_t *skip, uint32_t skip_count) {
+	const uint32_t *table = (const uint32_t *)(jl_buf + SECT_SIZE);
+	const struct sect *data = (const struct sect *)(jl_buf + SECT_SIZE) +
+		CEIL(hdr->count, JL_PER_S);
+	
+	uint32_t differed = 0;
+	for (uint32_t i = 0; i < hdr->count; ++i) {
+		if (table[i] >= jl_first) {
+			warnx("journal: sector %" PRIu32 " is out of bounds", table[i]);
+			continue;
+		} else if (skip_count != 0 && bsearch(table + i, skip, skip_count,
+			sizeof(*skip), jgfs_journal_cmp) != NULL) {
+			continue;
+		}
+		
+		struct sect *sect = jgfs_get_sect(table[i]);
+		if (memcmp(sect, data + i, SECT_SIZE) != 0) {
+			memcpy(sect, data + i, SECT_SIZE);
+			jgfs_dirty(sect, SECT_SIZE);
+			++differed;
+		}
+	}
+	
+	return differed;
+}
+
+/* make sure that neither record is ever replayed, now that everything they
+ * hold has been written in place: the writes are made durable first, and then
+ * the headers are cleared; return posix error code on failure */
+static int jgfs_journal_retire(void) {
+	int rtn;
+	if ((rtn = jgfs_dev_flush(NULL, 0, true)) != 0) {
+		return rtn;
+	}
+	
+	memset(jl_buf, 0, SECT_SIZE);
+	for (uint32_t half = 0; half < 2; ++half) {
+		if (pwrite(jgfs_dev_fd(), jl_buf, SECT_SIZE,
+			(uint64_t)(jl_first + (half * jl_half)) * SECT_SIZE) !=
+			SECT_SIZE) {
+			return (errno != 0 ? -errno : -EIO);
+		}
+	}
+	
+	if ((rtn = jgfs_dev_flush(NULL, 0, true)) != 0) {
+		return rtn;
+	}
+	
+	jl_live = false;
+	
+	return 0;
+}
+
+void jgfs_journal_open(bool ro) {
+	jgfs_journal_layout();
+	
+	if (jgfs.hdr->s_journal == 0) {
+		return;
+	} else if (jl_room == 0 || jgfs.hdr->s_journal > jgfs.hdr->s_total ||
+		jl_first < (uint32_t)(JGFS_BOOT_SECT + jgfs.hdr->s_boot +
+		jgfs.hdr->s_fat)) {
+		errx(1, "journal is out of bounds");
+	}
+	
+	jgfs_crc_init();
+	
+	if ((jl_buf = malloc((size_t)jl_half * SECT_SIZE)) == NULL ||
+		(jl_flush = malloc(jl_room * sizeof(*jl_flush))) == NULL) {
+		err(1, "malloc failed");
+	}
+	
+	uint64_t seq[2] = { 0, 0 };
+	for (uint32_t half = 0; half < 2; ++half) {
+		const struct jgfs_jl_hdr *hdr = jgfs_journal_read(half);
+		
+		if (hdr != NULL) {
+			seq[half] = hdr->seq;
+		}
+	}
+	
+	/* the newer record is replayed first, and the older one only for what the
+	 * newer one doesn't have (its table is in order), so that each sector is
+	 * put back once; sectors already in place are left alone */
+	uint32_t *skip = NULL, skip_count = 0, differed = 0;
+	uint32_t newer = (seq[1] > seq[0] ? 1 : 0);
+	for (uint32_t i = 0; i < 2; ++i) {
+		uint32_t half = (newer + i) % 2;
+		const struct jgfs_jl_hdr *hdr;
+		
+		if (seq[half] == 0 || (hdr = jgfs_journal_read(half)) == NULL) {
+			continue;
+		}
+		
+		differed += jgfs_journal_apply(hdr, skip, skip_count);
+		
+		if (i == 0) {
+			if ((skip = malloc(hdr->count * sizeof(*skip))) == NULL) {
+				err(1, "malloc failed");
+			}
+			memcpy(skip, jl_buf + SECT_SIZE, hdr->count * sizeof(*skip));
+			skip_count = hdr->count;
+		}
+	}
+	
+	free(skip);
+	
+	jl_seq = (seq[0] > seq[1] ? seq[0] : seq[1]) + 1;
+	
+	if (differed != 0) {
+		warnx("replayed %" PRIu32 " sectors from the journal%s", differed,
+			(ro ? " in memory" : ""));
+	}
+	
+	if (ro) {
+		return;
+	}
+	
+	/* the records are retired even if everything was already in place, as
+	 * what they hold may be freed and reused from here on */
+	if (seq[0] != 0 || seq[1] != 0) {
+		int rtn;
+		if ((differed != 0 && (rtn = jgfs_writeback()) != 0) ||
+			(rtn = jgfs_journal_retire()) != 0) {
+			errx(1, "failed to write back the journal: %s", strerror(-rtn));
+		}
+	}
+	
+	__atomic_store_n(&jl_active, true, __ATOMIC_RELEASE);
+}
+
+void jgfs_journal_close(void) {
+	/* after a last commit that went through, nothing is left to replay */
+	if (jgfs_journal_active() && jl_live &&
+		!__atomic_load_n(&jl_abandoned, __ATOMIC_ACQUIRE) && jl_rtn == 0) {
+		int rtn;
+		if ((rtn = jgfs_journal_retire()) != 0) {
+			warnx("failed to retire the journal: %s", strerror(-rtn));
+		}
+	}
+	
+	__atomic_store_n(&jl_active, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&jl_abandoned, false, __ATOMIC_RELEASE);
+	
+	free(jl_buf);
+	free(jl_flush);
+	jl_buf   = NULL;
+	jl_flush = NULL;
+	
+	memset(jl_meta, 0, sizeof(jl_meta));
+	memset(jl_freed, 0, sizeof(jl_freed));
+	memset(jl_freed_new, 0, sizeof(jl_freed_new));
+	memset(jl_held, 0, sizeof(jl_held));
+}
+
+void jgfs_journal_abandon(void) {
+	__atomic_store_n(&jl_abandoned, true, __ATOMIC_RELEASE);
+}
+
+bool jgfs_journal_active(void) {
+	return __atomic_load_n(&jl_active, __ATOMIC_ACQUIRE);
+}
+
+bool jgfs_journal_clust(fat_ent_t clust_num, bool meta) {
+	uint64_t bit = 1ULL << (clust_num % 64);
+	
+	if (meta) {
+		if ((__atomic_load_n(jl_meta + (clust_num / 64), __ATOMIC_RELAXED) &
+			bit) == 0) {
+			__atomic_fetch_or(jl_meta + (clust_num / 64), bit,
+				__ATOMIC_RELEASE);
+		}
+	} else if ((__atomic_fetch_and(jl_meta + (clust_num / 64), ~bit,
+		__ATOMIC_ACQ_REL) & bit) != 0 && jgfs_journal_active()) {
+		__atomic_fetch_or(jl_freed + (clust_num / 64), bit, __ATOMIC_RELEASE);
+		__atomic_fetch_or(jl_freed_new + (clust_num / 64), bit,
+			__ATOMIC_RELEASE);
+		
+		return true;
+	}
+	
+	return false;
+}
+
+bool jgfs_journal_logged(fat_ent_t clust_num) {
+	uint64_t bit = 1ULL << (clust_num % 64);
+	
+	return jgfs_journal_active() &&
+		((__atomic_load_n(jl_meta + (clust_num / 64), __ATOMIC_ACQUIRE) |
+		__atomic_load_n(jl_freed + (clust_num / 64), __ATOMIC_ACQUIRE)) &
+		bit) != 0;
+}
+
+/* build a record in jl_buf of the count spans in jl_flush, copying them out of
+ * memory; returns its length in sectors */
+static uint32_t jgfs_journal_build(size_t count) {
+	uint32_t sects = 0;
+	for (size_t i = 0; i < count; ++i) {
+		sects += jl_flush[i].len / SECT_SIZE;
+	}
+	
+	struct jgfs_jl_hdr *hdr = (struct jgfs_jl_hdr *)jl_buf;
+	uint32_t *table = (uint32_t *)(jl_buf + SECT_SIZE);
+	char *data = jl_buf + ((1 + CEIL(sects, JL_PER_S)) * SECT_SIZE);
+	
+	memset(jl_buf, 0, (1 + CEIL(sects, JL_PER_S)) * SECT_SIZE);
+	
+	for (size_t i = 0, n = 0; i < count; ++i) {
+		/* the sectors of a span needn't lie together in memory */
+		for (uint64_t at = 0; at < jl_flush[i].len; at += SECT_SIZE, ++n) {
+			table[n] = (jl_flush[i].off + at) / SECT_SIZE;
+			
+			memcpy(data, jgfs_get_sect(table[n]), SECT_SIZE);
+			data += SECT_SIZE;
+		}
+	}
+	
+	memcpy(hdr->magic, JGFS_JL_MAGIC, sizeof(hdr->magic));
+	hdr->count = sects;
+	hdr->seq   = jl_seq;
+	hdr->crc   = jgfs_crc(jl_buf, (size_t)jgfs_journal_len(sects) * SECT_SIZE);
+	
+	return sects;
+}
+
+/* write the record of sects sectors in jl_buf to its half, make it durable,
+ * and then write its sectors in place; return posix error code on failure */
+static int jgfs_journal_write(uint32_t sects) {
+	int fd = jgfs_dev_fd();
+	
+	size_t len = (size_t)jgfs_journal_len(sects) * SECT_SIZE;
+	uint64_t off = (uint64_t)(jl_first + ((jl_seq % 2) * jl_half)) *
+		SECT_SIZE;
+	
+	jl_live = true;
+	if (pwrite(fd, jl_buf, len, off) != (ssize_t)len) {
+		return (errno != 0 ? -errno : -EIO);
+	}
+	
+	int rtn;
+	if ((rtn = jgfs_dev_flush(NULL, 0, true)) != 0) {
+		return rtn;
+	}
+	
+	++jl_seq;
+	
+	/* the sectors go in place from the record, not from memory, which may
+	 * have changed since */
+	const uint32_t *table = (const uint32_t *)(jl_buf + SECT_SIZE);
+	const char *data = jl_buf + ((1 + CEIL(sects, JL_PER_S)) * SECT_SIZE);
+	
+	for (uint32_t i = 0, run; i < sects; i += run) {
+		for (run = 1; i + run < sects && table[i + run] == table[i] + run;
+			++run);
+		
+		len = (size_t)run * SECT_SIZE;
+		if (pwrite(fd, data + ((size_t)i * SECT_SIZE), len,
+			(uint64_t)table[i] * SECT_SIZE) != (ssize_t)len) {
+			return (errno != 0 ? -errno : -EIO);
+		}
+	}
+	
+	return 0;
+}
+
+/* note that a record has been written, freeing along with it the clusters in
+ * taken (or none, if NULL): the record overwrote the one before the last, so
+ * that the clusters freed by that one can no longer be replayed over, and may
+ * be allocated again */
+static void jgfs_journal_advance(const uint64_t *taken) {
+	jgfs_lock_fat(true);
+	
+	for (uint32_t i = 0; i < 0x10000 / 64; ++i) {
+		uint64_t bits = jl_held[1][i];
+		
+		if (bits != 0) {
+			__atomic_fetch_and(jl_freed + i, ~bits, __ATOMIC_ACQ_REL);
+			
+			for (; bits != 0; bits &= bits - 1) {
+				jgfs_fat_release((i * 64) + __builtin_ctzll(bits));
+			}
+		}
+		
+		jl_held[1][i] = jl_held[0][i];
+		jl_held[0][i] = (taken != NULL ? taken[i] : 0);
+	}
+	
+	jgfs_unlock_fat();
+}
+
+/* mark the count spans in jl_flush as changed again, a sector at a time */
+static void jgfs_journal_redirty(size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		for (uint64_t at = 0; at < jl_flush[i].len; at += SECT_SIZE) {
+			jgfs_dirty(jgfs_get_sect((jl_flush[i].off + at) / SECT_SIZE),
+				SECT_SIZE);
+		}
+	}
+}
+
+/* commit everything the journal logs that has changed; metadata is only
+ * consistent while nothing is changing it, so the namespace lock is held
+ * exclusively while it is copied out, and then let go for the writing */
+static int jgfs_journal_run(void) {
+	bool all, locked = true, taken = false, sent = false;
+	uint32_t pieces = 0;
+	int rtn = 0;
+	
+	jgfs_lock_ns(true);
+	
+	/* more than fits in one record is committed a record at a time with the
+	 * lock held throughout, which is not atomic, but is no worse than having
+	 * no journal at all */
+	do {
+		size_t count = 0;
+		all = jgfs_dirty_take_logged(jl_flush, &count,
+			(uint64_t)jl_room * SECT_SIZE);
+		
+		if (!all && pieces++ == 0) {
+			warnx("changes to the metadata outgrew the journal; committing "
+				"them in pieces");
+		}
+		
+		/* pages that failed to read hold zeroes, which mustn't reach the
+		 * device by way of the record either */
+		for (size_t i = 0; i < count && rtn == 0; ++i) {
+			for (uint64_t at = 0; at < jl_flush[i].len && rtn == 0;
+				at += SECT_SIZE) {
+				rtn = jgfs_dev_probe(jgfs_get_sect((jl_flush[i].off + at) /
+					SECT_SIZE), SECT_SIZE);
+			}
+		}
+		if (rtn != 0) {
+			jgfs_journal_redirty(count);
+			break;
+		}
+		
+		uint32_t sects = (count != 0 ? jgfs_journal_build(count) : 0);
+		
+		/* what was freed up to here goes out with this record */
+		if (all) {
+			for (uint32_t i = 0; i < 0x10000 / 64; ++i) {
+				jl_taken[i] = __atomic_exchange_n(jl_freed_new + i, 0,
+					__ATOMIC_ACQ_REL);
+			}
+			taken = true;
+			
+			jgfs_unlock_ns();
+			locked = false;
+		}
+		
+		/* with nothing to log, whatever was written back before still needs
+		 * the barrier */
+		if (sects == 0) {
+			rtn = jgfs_dev_flush(NULL, 0, true);
+			break;
+		}
+		
+		/* what didn't make it is committed again next time */
+		if ((rtn = jgfs_journal_write(sects)) != 0) {
+			jgfs_journal_redirty(count);
+		} else {
+			jgfs_journal_advance(all ? jl_taken : NULL);
+			sent = all;
+		}
+	} while (!all && rtn == 0);
+	
+	if (locked) {
+		jgfs_unlock_ns();
+	}
+	
+	/* clusters freed by a record that didn't go out go with the next one */
+	if (taken && !sent) {
+		for (uint32_t i = 0; i < 0x10000 / 64; ++i) {
+			if (jl_taken[i] != 0) {
+				__atomic_fetch_or(jl_freed_new + i, jl_taken[i],
+					__ATOMIC_RELEASE);
+			}
+		}
+	}
+	
+	return rtn;
+}
+
+int jgfs_journal_commit(void) {
+	if (!jgfs_journal_active() ||
+		__atomic_load_n(&jl_abandoned, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	
+	pthread_mutex_lock(&jl_mutex);
+	
+	/* a commit already under way may have copied out the metadata before the
+	 * caller's changes were made */
+	uint64_t want = jl_begun + 1;
+	
+	while (jl_done < want) {
+		if (jl_busy) {
+			pthread_cond_wait(&jl_cond, &jl_mutex);
+		} else {
+			uint64_t gen = ++jl_begun;
+			jl_busy = true;
+			
+			pthread_mutex_unlock(&jl_mutex);
+			int rtn = jgfs_journal_run();
+			pthread_mutex_lock(&jl_mutex);
+			
+			jl_busy = false;
+			jl_done = gen;
+			jl_rtn  = rtn;
+			
+			pthread_cond_broadcast(&jl_cond);
+		}
+	}
+	
+	int rtn = jl_rtn;
+	
+	pthread_mutex_unlock(&jl_mutex);
+	
+	return rtn;
+}
@@ -0,0 +1,103 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "jgfs.h"
+#include <err.h>
+#include <pthread.h>
+#include <string.h>
+
+
+/* number of locks that directories and files are hashed onto */
+#define LOCK_STRIPES 64
+
+
+/* renames and deletions wait for the namespace lock exclusively, and must not
+ * be starved by a steady stream of readers */
+static pthread_rwlock_t ns_lock =
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+	PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+	PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+static pthread_rwlock_t fat_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_rwlock_t dir_locks[LOCK_STRIPES] = {
+	[0 ... LOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static pthread_rwlock_t file_locks[LOCK_STRIPES] = {
+	[0 ... LOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+
+static void jgfs_rwlock(pthread_rwlock_t *lock, bool excl) {
+	int rtn = (excl ? pthread_rwlock_wrlock(lock) :
+		pthread_rwlock_rdlock(lock));
+	
+	if (rtn != 0) {
+		errx(1, "jgfs_rwlock: %s", strerror(rtn));
+	}
+}
+
+static void jgfs_rwunlock(pthread_rwlock_t *lock) {
+	int rtn = pthread_rwlock_unlock(lock);
+	
+	if (rtn != 0) {
+		errx(1, "jgfs_rwunlock: %s", strerror(rtn));
+	}
+}
+
+static pthread_rwlock_t *jgfs_file_lock(const struct jgfs_dir_ent *dir_ent) {
+	uintptr_t n = (uintptr_t)dir_ent / sizeof(struct jgfs_dir_ent);
+	
+	return &file_locks[n % LOCK_STRIPES];
+}
+
+void jgfs_lock_ns(bool excl) {
+	jgfs_rwlock(&ns_lock, excl);
+}
+
+bool jgfs_trylock_ns(bool excl) {
+	return ((excl ? pthread_rwlock_trywrlock(&ns_lock) :
+		pthread_rwlock_tryrdlock(&ns_lock)) == 0);
+}
+
+void jgfs_unlock_ns(void) {
+	jgfs_rwunlock(&ns_lock);
+	
+	/* file data held in memory can only be given back while no operation is
+	 * using it */
+	if (jgfs_dev_over() && pthread_rwlock_trywrlock(&ns_lock) == 0) {
+		jgfs_dev_trim();
+		jgfs_rwunlock(&ns_lock);
+	}
+}
+
+void jgfs_lock_fat(bool excl) {
+	jgfs_rwlock(&fat_lock, excl);
+}
+
+void jgfs_unlock_fat(void) {
+	jgfs_rwunlock(&fat_lock);
+}
+
+void jgfs_lock_dir(fat_ent_t begin, bool excl) {
+	jgfs_rwlock(&dir_locks[begin % LOCK_STRIPES], excl);
+}
+
+void jgfs_unlock_dir(fat_ent_t begin) {
+	jgfs_rwunlock(&dir_locks[begin % LOCK_STRIPES]);
+}
+
+void jgfs_lock_file(const struct jgfs_dir_ent *dir_ent, bool excl) {
+	jgfs_rwlock(jgfs_file_lock(dir_ent), excl);
+}
+
+void jgfs_unlock_file(const struct jgfs_dir_ent *dir_ent) {
+	jgfs_rwunlock(jgfs_file_lock(dir_ent));
+}
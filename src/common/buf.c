@@ -0,0 +1,88 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "buf.h"
+#include <errno.h>
+#include <stdlib.h>
+
+
+/* describe iov_count runs of the device mapping as a buffer vector, either in
+ * place in memory or as ranges of the device itself (which fuse can splice to
+ * and from); bufv must have room for iov_count buffers */
+static void jg_dev_bufvec(struct fuse_bufvec *bufv, const struct iovec *iov,
+	int iov_count, bool as_fd) {
+	*bufv = FUSE_BUFVEC_INIT(0);
+	
+	for (int i = 0; i < iov_count; ++i) {
+		if (as_fd) {
+			bufv->buf[i] = (struct fuse_buf) {
+				.size  = iov[i].iov_len,
+				.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY,
+				.fd    = jgfs_dev_fd(),
+				.pos   = jgfs_dev_offset(iov[i].iov_base),
+			};
+		} else {
+			bufv->buf[i] = (struct fuse_buf) {
+				.size  = iov[i].iov_len,
+				.mem   = iov[i].iov_base,
+				.fd    = -1,
+			};
+		}
+	}
+	
+	if (iov_count != 0) {
+		bufv->count = iov_count;
+	}
+}
+
+int jg_buf_write(struct jgfs_dir_ent *dir_ent, struct jgfs_file *file,
+	struct fuse_bufvec *buf, uint64_t offset) {
+	size_t size = fuse_buf_size(buf), iov_max = JGFS_READ_IOV_MAX(size);
+	
+	struct iovec *iov;
+	struct fuse_bufvec *bufv;
+	if ((iov = malloc(iov_max * sizeof(*iov))) == NULL) {
+		return -ENOMEM;
+	} else if ((bufv = malloc(sizeof(*bufv) +
+		(iov_max * sizeof(struct fuse_buf)))) == NULL) {
+		free(iov);
+		return -ENOMEM;
+	}
+	
+	uint32_t old_size = dir_ent->size;
+	
+	/* move the data straight into place, a run of clusters at a time; data
+	 * spliced in from the kernel is spliced onward to the device (if it is
+	 * mapped, and so sees the change), while data already in memory is copied
+	 * in */
+	int rtn;
+	if ((rtn = jgfs_write_iov(dir_ent, file, iov, size, offset)) >= 0) {
+		int iov_count = rtn;
+		jg_dev_bufvec(bufv, iov, iov_count,
+			(buf->buf[buf->idx].flags & FUSE_BUF_IS_FD) != 0 &&
+			jgfs_dev_direct());
+		
+		ssize_t b_written = fuse_buf_copy(bufv, buf, 0);
+		if (b_written < 0) {
+			rtn = b_written;
+			b_written = 0;
+		} else {
+			rtn = b_written;
+		}
+		
+		/* note what was written for fsync; after a short copy, the file
+		 * mustn't end up any longer than the kernel (which only hears of what
+		 * was written) believes, or with whatever the unwritten space held
+		 * before showing */
+		jgfs_write_end(dir_ent, old_size, iov, iov_count, offset, b_written);
+	}
+	
+	free(bufv);
+	free(iov);
+	
+	return rtn;
+}
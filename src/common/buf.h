@@ -0,0 +1,24 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#ifndef JGFS_SRC_COMMON_BUF_H
+#define JGFS_SRC_COMMON_BUF_H
+
+
+#include <fuse_common.h>
+#include "../../lib/jgfs.h"
+
+
+/* write the data in buf at offset of the file with dir_ent (through the cursor
+ * of file, if not NULL) straight into place; returns the number of bytes
+ * written or posix error code on failure; the caller must hold the file lock
+ * exclusively */
+int jg_buf_write(struct jgfs_dir_ent *dir_ent, struct jgfs_file *file,
+	struct fuse_bufvec *buf, uint64_t offset);
+
+
+#endif
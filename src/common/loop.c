@@ -0,0 +1,137 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "loop.h"
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+struct jg_loop {
+	struct fuse_session *se;
+	sem_t                finish; // posted by each worker as it stops
+	bool                 error;
+};
+
+struct jg_worker {
+	struct jg_loop *loop;
+	pthread_t       thread;
+	char           *buf;
+	size_t          bufsize;
+};
+
+
+static void *jg_loop_worker(void *arg) {
+	struct jg_worker *worker = arg;
+	struct jg_loop *loop = worker->loop;
+	
+	while (!fuse_session_exited(loop->se)) {
+		struct fuse_chan *chan = fuse_session_next_chan(loop->se, NULL);
+		struct fuse_buf fbuf = {
+			.mem  = worker->buf,
+			.size = worker->bufsize,
+		};
+		
+		/* only allow cancellation while waiting for a request, never while
+		 * one is being served with locks held */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int res = fuse_session_receive_buf(loop->se, &fbuf, &chan);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		
+		if (res == -EINTR) {
+			continue;
+		} else if (res <= 0) {
+			if (res < 0) {
+				loop->error = true;
+				fuse_session_exit(loop->se);
+			}
+			break;
+		}
+		
+		fuse_session_process_buf(loop->se, &fbuf, chan);
+	}
+	
+	sem_post(&loop->finish);
+	
+	return NULL;
+}
+
+int jg_loop_fixed(struct fuse_session *se, unsigned int threads) {
+	struct jg_loop loop = {
+		.se    = se,
+		.error = false,
+	};
+	sem_init(&loop.finish, 0, 0);
+	
+	struct jg_worker *workers;
+	if ((workers = calloc(threads, sizeof(*workers))) == NULL) {
+		warnx("jg_loop_fixed: calloc failed");
+		return -1;
+	}
+	
+	/* leave the signals that end the session to the main thread, which is
+	 * the one waiting to notice */
+	sigset_t block, old;
+	sigemptyset(&block);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	
+	size_t bufsize = fuse_chan_bufsize(fuse_session_next_chan(se, NULL));
+	
+	unsigned int started = 0;
+	while (started < threads) {
+		struct jg_worker *worker = workers + started;
+		
+		worker->loop    = &loop;
+		worker->bufsize = bufsize;
+		
+		if ((worker->buf = malloc(bufsize)) == NULL) {
+			warnx("jg_loop_fixed: malloc failed");
+			break;
+		}
+		
+		int err;
+		if ((err = pthread_create(&worker->thread, NULL, jg_loop_worker,
+			worker)) != 0) {
+			warnx("jg_loop_fixed: pthread_create: %s", strerror(err));
+			free(worker->buf);
+			break;
+		}
+		
+		++started;
+	}
+	
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	if (started != threads) {
+		loop.error = true;
+		fuse_session_exit(se);
+	}
+	
+	while (!fuse_session_exited(se)) {
+		sem_wait(&loop.finish);
+	}
+	
+	for (unsigned int i = 0; i < started; ++i) {
+		pthread_cancel(workers[i].thread);
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].buf);
+	}
+	
+	free(workers);
+	sem_destroy(&loop.finish);
+	
+	fuse_session_reset(se);
+	
+	return (loop.error ? -1 : 0);
+}
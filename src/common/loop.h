@@ -0,0 +1,20 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#ifndef JGFS_SRC_COMMON_LOOP_H
+#define JGFS_SRC_COMMON_LOOP_H
+
+
+#include <fuse_lowlevel.h>
+
+
+/* serve requests on se with a fixed number of worker threads until the
+ * session exits; returns 0 on a clean exit */
+int jg_loop_fixed(struct fuse_session *se, unsigned int threads);
+
+
+#endif
@@ -0,0 +1,38 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include "opts.h"
+#include <stdio.h>
+
+
+void jg_usage_common(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s <device> <mountpoint> [options]\n"
+		"\n"
+		"jgfs options:\n"
+		"    -o fast                a preset for throughput: %s\n"
+		"    -o threads=N           serve requests with exactly N threads\n"
+		"                           (default: as many as fuse sees fit)\n"
+		"    -o writeback_interval=MS\n"
+		"                           write changes back every MS ms (5000)\n"
+		"    -o dirty_bytes=N       write changes back as soon as N bytes\n"
+		"                           have built up (33554432)\n"
+		"    -o backend=mmap        map the device into memory (default,\n"
+		"                           but for a filesystem with a journal,\n"
+		"                           which uses pread)\n"
+		"    -o backend=pread       read the device into a buffer cache\n"
+		"    -o backend=uring       the same, with i/o batched through\n"
+		"                           io_uring (pread if unavailable)\n"
+		"    -o backend=window      map the device in 4 MiB windows\n"
+		"    -o cache_size=N        keep at most N bytes of file data in the\n"
+		"                           buffer cache, or mapped (67108864)\n"
+		"    -o readahead=N         prefetch up to N bytes ahead of a file\n"
+		"                           read in order (2097152; 0 for none)\n"
+		"    -o lock_meta           load the fat and every directory at\n"
+		"                           mount, and lock them into memory\n",
+		argv0, JG_FAST_OPTS);
+}
@@ -0,0 +1,23 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#ifndef JGFS_SRC_COMMON_OPTS_H
+#define JGFS_SRC_COMMON_OPTS_H
+
+
+/* the mount options the fast preset stands for; anything given explicitly on
+ * the command line takes precedence */
+#define JG_FAST_OPTS "kernel_cache,big_writes,max_read=131072," \
+	"max_write=131072,attr_timeout=30,entry_timeout=30,negative_timeout=30"
+
+
+/* print the usage line and the help for the options every frontend takes, for
+ * the frontend to follow with its own */
+void jg_usage_common(const char *argv0);
+
+
+#endif
@@ -6,8 +6,38 @@
 
 
 #include <err.h>
+#include <inttypes.h>
+#include "../../lib/jgfs.h"
 
 
-int main(void) {
-	errx(1, "not implemented");
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		errx(1, "expected one argument");
+	}
+	
+	jgfs_init_ro(argv[1]);
+	
+	struct jgfs_fat_stats fat_stats;
+	jgfs_fat_stats(&fat_stats);
+	
+	struct jgfs_frag_stats frag_stats;
+	jgfs_frag_stats(&frag_stats);
+	
+	/* report some statistics */
+	warnx("cluster size:   %" PRIu32, jgfs_clust_size());
+	warnx("total clusters: %" PRIu16, jgfs_fs_clusters());
+	warnx("used clusters:  %" PRIu16, fat_stats.used);
+	warnx("free clusters:  %" PRIu16, fat_stats.free);
+	warnx("bad clusters:   %" PRIu16, fat_stats.bad);
+	warnx("rsvd clusters:  %" PRIu16, fat_stats.rsvd);
+	warnx("free extents:   %" PRIu16 " (largest: %" PRIu16 " clusters)",
+		frag_stats.free_extents, frag_stats.free_largest);
+	warnx("chain breaks:   %" PRIu16 " of %" PRIu16 " links",
+		frag_stats.breaks, frag_stats.links);
+	
+	jgfs_done();
+	
+	warnx("consistency checks not implemented");
+	
+	return 0;
 }
@@ -7,31 +7,170 @@
 
 #include <err.h>
 #include <fuse.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+#include "../../lib/jgfs.h"
+#include "../common/loop.h"
+#include "../common/opts.h"
+
+
+enum {
+	JG_KEY_FAST,
+	JG_KEY_HELP,
+	JG_KEY_DEBUG,
+};
+
+struct jg_opts {
+	unsigned int       threads;     // fixed worker count, or 0 for fuse's pick
+	unsigned int       wb_interval; // writeback interval in ms
+	unsigned long long dirty_bytes; // writeback threshold in bytes
+	int                backend;     // enum jgfs_dev_type
+	unsigned long long cache_size;  // pread backend memory bound in bytes
+	unsigned int       readahead;   // prefetch window bound in bytes
+	int                lock_meta;   // lock metadata into memory
+	bool               fast;
+	bool               help;
+};
 
 
 extern char *dev_path;
 
+extern struct jgfs_wb_param jg_wb_param;
+extern bool                 jg_debug;
+
 extern struct fuse_operations jg_oper;
 
 
+static const struct fuse_opt jg_opt_spec[] = {
+	{ "threads=%u",            offsetof(struct jg_opts, threads),     0 },
+	{ "writeback_interval=%u", offsetof(struct jg_opts, wb_interval), 0 },
+	{ "dirty_bytes=%llu",      offsetof(struct jg_opts, dirty_bytes), 0 },
+	{ "backend=mmap",          offsetof(struct jg_opts, backend),
+		DEV_MMAP },
+	{ "backend=pread",         offsetof(struct jg_opts, backend),
+		DEV_PREAD },
+	{ "backend=uring",         offsetof(struct jg_opts, backend),
+		DEV_URING },
+	{ "backend=window",        offsetof(struct jg_opts, backend),
+		DEV_WINDOW },
+	{ "cache_size=%llu",       offsetof(struct jg_opts, cache_size),  0 },
+	{ "readahead=%u",          offsetof(struct jg_opts, readahead),   0 },
+	{ "lock_meta",             offsetof(struct jg_opts, lock_meta),   1 },
+	FUSE_OPT_KEY("fast",   JG_KEY_FAST),
+	FUSE_OPT_KEY("-h",     JG_KEY_HELP),
+	FUSE_OPT_KEY("--help", JG_KEY_HELP),
+	FUSE_OPT_KEY("-d",     JG_KEY_DEBUG),
+	FUSE_OPT_KEY("debug",  JG_KEY_DEBUG),
+	FUSE_OPT_END,
+};
+
+
+static void jg_usage(const char *argv0) {
+	jg_usage_common(argv0);
+	fputc('\n', stderr);
+}
+
+static int jg_opt_proc(void *data, const char *arg, int key,
+	struct fuse_args *outargs) {
+	struct jg_opts *opts = data;
+	
+	switch (key) {
+	case FUSE_OPT_KEY_NONOPT:
+		/* the first plain argument is ours, the second is the mountpoint;
+		 * the device is opened only after fuse has daemonized and left the
+		 * working directory, so the path has to be absolute */
+		if (dev_path == NULL) {
+			if ((dev_path = realpath(arg, NULL)) == NULL) {
+				err(1, "%s", arg);
+			}
+			return 0;
+		}
+		return 1;
+	case JG_KEY_FAST:
+		opts->fast = true;
+		return 0;
+	case JG_KEY_HELP:
+		jg_usage(outargs->argv[0]);
+		opts->help = true;
+		return fuse_opt_add_arg(outargs, "-ho");
+	case JG_KEY_DEBUG:
+		/* fuse still needs to see it */
+		jg_debug = true;
+		return 1;
+	default:
+		return 1;
+	}
+}
+
 int main(int argc, char **argv) {
-	if (argc != 3) {
-		errx(1, "expected two arguments");
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct jg_opts opts = {
+		.threads     = 0,
+		.wb_interval = jg_wb_param.interval,
+		.dirty_bytes = jg_wb_param.dirty_bytes,
+		.backend     = DEV_AUTO,
+		.cache_size  = 0,
+		.readahead   = JGFS_READAHEAD_DEFAULT,
+		.lock_meta   = 0,
+		.fast        = false,
+		.help        = false,
+	};
+	
+	if (fuse_opt_parse(&args, &opts, jg_opt_spec, jg_opt_proc) != 0) {
+		return 1;
+	}
+	
+	jg_wb_param.interval    = opts.wb_interval;
+	jg_wb_param.dirty_bytes = opts.dirty_bytes;
+	
+	jgfs_dev_select(opts.backend, opts.cache_size);
+	jgfs_file_readahead(opts.readahead);
+	jgfs_dev_lock_pinned(opts.lock_meta != 0);
+	
+	/* put the preset before everything else, so that it loses to any option
+	 * given explicitly */
+	if (opts.fast && (fuse_opt_insert_arg(&args, 1, "-o") != 0 ||
+		fuse_opt_insert_arg(&args, 2, JG_FAST_OPTS) != 0)) {
+		errx(1, "fuse_opt_insert_arg failed");
 	}
 	
-	dev_path = argv[1];
+	if (!opts.help) {
+		if (dev_path == NULL) {
+			jg_usage(argv[0]);
+			errx(1, "expected a device and a mountpoint");
+		}
+		
+		/* hard_remove hands us unlinks of open files (which we keep alive
+		 * until they are closed) rather than renaming them to names too long
+		 * for jgfs */
+		if (fuse_opt_add_arg(&args, "-oallow_other,hard_remove") != 0) {
+			errx(1, "fuse_opt_add_arg failed");
+		}
+	}
+	
+	/* this mounts, daemonizes unless -f or -d was given, and installs the
+	 * signal handlers; -h just prints the rest of the help and fails */
+	char *mount_point;
+	int multithreaded;
+	struct fuse *fuse;
+	if ((fuse = fuse_setup(args.argc, args.argv, &jg_oper, sizeof(jg_oper),
+		&mount_point, &multithreaded, NULL)) == NULL) {
+		fuse_opt_free_args(&args);
+		return (opts.help ? 0 : 1);
+	}
+	
+	int rtn;
+	if (!multithreaded) {
+		rtn = fuse_loop(fuse);
+	} else if (opts.threads != 0) {
+		rtn = jg_loop_fixed(fuse_get_session(fuse), opts.threads);
+	} else {
+		rtn = fuse_loop_mt(fuse);
+	}
 	
-	/* fuse's command processing is inflexible and useless */
-	int real_argc = 6;
-	char **real_argv = malloc(real_argc * sizeof(char *));
-	real_argv[0] = argv[0];
-	real_argv[1] = strdup("-s");
-	real_argv[2] = strdup("-d");
-	real_argv[3] = strdup("-o");
-	real_argv[4] = strdup("allow_other");
-	real_argv[5] = argv[2];
+	fuse_teardown(fuse, mount_point);
+	fuse_opt_free_args(&args);
 	
-	return fuse_main(real_argc, real_argv, &jg_oper, NULL);
+	return (rtn == 0 ? 0 : 1);
 }
@@ -8,24 +8,58 @@
 #include <bsd/string.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../../lib/jgfs.h"
+#include "../common/buf.h"
 
 
 char *dev_path;
 
+/* when changes are written back in the background, as set by the mount
+ * options */
+struct jgfs_wb_param jg_wb_param = {
+	.interval    = 5000,
+	.dirty_bytes = 32 << 20,
+};
+
+/* whether to report statistics at unmount (with -d) */
+bool jg_debug = false;
+
+
+/* state kept for each open file, in fi->fh */
+struct jg_handle {
+	struct jgfs_file *file;
+	int               flags; // open flags
+};
+
 
 void *jg_init(struct fuse_conn_info *conn) {
 	jgfs_init(dev_path);
 	
+	/* threads can only be started now that fuse has daemonized */
+	jgfs_writeback_start(&jg_wb_param);
+	
+	/* let written data be spliced onto the device */
+	conn->want |= (conn->capable & FUSE_CAP_SPLICE_READ);
+	
 	return NULL;
 }
 
 void jg_destroy(void *userdata) {
+	if (jg_debug) {
+		struct jgfs_dcache_stats stats;
+		jgfs_dcache_stats(&stats);
+		
+		warnx("path cache: %" PRIu64 " hits, %" PRIu64 " negative hits, %"
+			PRIu64 " misses, %" PRIu64 " stale", stats.hits, stats.neg_hits,
+			stats.misses, stats.stale);
+	}
+	
 	jgfs_done();
 }
 
@@ -34,21 +68,18 @@ int jg_statfs(const char *path, struct statvfs *statv) {
 	
 	statv->f_bsize = jgfs_clust_size();
 	statv->f_blocks = jgfs_fs_clusters();
+	
+	jgfs_lock_fat(false);
 	statv->f_bfree = statv->f_bavail = jgfs_fat_count(FAT_FREE);
+	jgfs_unlock_fat();
 	
 	statv->f_namemax = JGFS_NAME_LIMIT;
 	
 	return 0;
 }
 
-int jg_getattr(const char *path, struct stat *buf) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
-	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
-	}
-	
+/* the caller must hold child's file lock */
+static void jg_fill_stat(struct jgfs_dir_ent *child, struct stat *buf) {
 	buf->st_nlink = 1;
 	buf->st_uid = 0;
 	buf->st_gid = 0;
@@ -65,57 +96,61 @@ int jg_getattr(const char *path, struct stat *buf) {
 	} else {
 		errx(1, "jg_getattr: unknown type 0x%x", child->type);
 	}
-	
-	return 0;
 }
 
-int jg_utimens(const char *path, const struct timespec tv[2]) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+int jg_getattr(const char *path, struct stat *buf) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent, *child;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		jgfs_lock_file(child, false);
+		jg_fill_stat(child, buf);
+		jgfs_unlock_file(child);
 	}
 	
-	child->mtime = tv[1].tv_sec;
+	jgfs_unlock_ns();
 	
-	return 0;
+	return rtn;
 }
 
-int jg_chmod(const char *path, mode_t mode) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
-	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
-	}
+int jg_utimens(const char *path, const struct timespec tv[2]) {
+	jgfs_lock_ns(false);
 	
-	return 0;
-}
-
-int jg_chown(const char *path, uid_t uid, gid_t gid) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+	struct jgfs_dir_ent *parent, *child;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		jgfs_lock_file(child, true);
+		child->mtime = tv[1].tv_sec;
+		jgfs_dirty(child, sizeof(*child));
+		jgfs_unlock_file(child);
 	}
 	
-	return 0;
+	jgfs_unlock_ns();
+	
+	return rtn;
 }
 
-int jg_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
-	/* just flush everything */
-	jgfs_sync();
+int jg_chmod(const char *path, mode_t mode) {
+	jgfs_lock_ns(false);
 	
-	return 0;
+	struct jgfs_dir_ent *parent, *child;
+	int rtn = jgfs_lookup(path, &parent, &child);
+	
+	jgfs_unlock_ns();
+	
+	return rtn;
 }
 
-int jg_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
-	/* just flush everything */
-	jgfs_sync();
+int jg_chown(const char *path, uid_t uid, gid_t gid) {
+	jgfs_lock_ns(false);
 	
-	return 0;
+	struct jgfs_dir_ent *parent, *child;
+	int rtn = jgfs_lookup(path, &parent, &child);
+	
+	jgfs_unlock_ns();
+	
+	return rtn;
 }
 
 int jg_readdir_filler(struct jgfs_dir_ent *dir_ent, void *user_ptr) {
@@ -131,66 +166,72 @@ int jg_readdir_filler(struct jgfs_dir_ent *dir_ent, void *user_ptr) {
 
 int jg_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	off_t offset, struct fuse_file_info *fi) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
-	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
-	}
+	jgfs_lock_ns(false);
 	
-	if (child->type != TYPE_DIR) {
-		return -ENOTDIR;
+	struct jgfs_dir_ent *parent, *child;
+	int rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		if (child->type != TYPE_DIR) {
+			rtn = -ENOTDIR;
+		} else {
+			filler(buf, ".", NULL, 0);
+			filler(buf, "..", NULL, 0);
+			
+			void *filler_info[] = {
+				buf,
+				filler,
+			};
+			
+			rtn = jgfs_dir_foreach(jg_readdir_filler, child, filler_info);
+		}
 	}
 	
-	/* we want the child's dir clust, not the parent's */
-	struct jgfs_dir_clust *child_clust = jgfs_get_clust(child->begin);
-	
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	jgfs_unlock_ns();
 	
-	void *filler_info[] = {
-		buf,
-		filler,
-	};
-	
-	return jgfs_dir_foreach(jg_readdir_filler, child_clust, filler_info);
+	return rtn;
 }
 
 int jg_readlink(const char *path, char *link, size_t size) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+	jgfs_lock_ns(false);
+	
+	/* symlinks never change once created, so there's no file lock to take */
+	struct jgfs_dir_ent *parent, *child;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		memset(link, 0, size);
+		
+		struct clust *link_clust = jgfs_get_clust(child->begin);
+		
+		if (size < child->size) {
+			memcpy(link, link_clust, size);
+		} else {
+			memcpy(link, link_clust, child->size);
+		}
 	}
 	
-	memset(link, 0, size);
-	
-	struct clust *link_clust = jgfs_get_clust(child->begin);
-	
-	if (size < child->size) {
-		memcpy(link, link_clust, size);
-	} else {
-		memcpy(link, link_clust, child->size);
-	}
+	jgfs_unlock_ns();
 	
-	return 0;
+	return rtn;
 }
 
 int jg_symlink(const char *target, const char *path) {
-	struct jgfs_dir_clust *parent;
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, NULL)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, NULL)) == 0) {
+		char *path_last = strrchr(path, '/') + 1;
+		if (path_last == NULL || path_last[0] == '\0') {
+			/* most applicable errno */
+			rtn = -EINVAL;
+		} else {
+			rtn = jgfs_create_symlink(parent, path_last, target);
+		}
 	}
 	
-	char *path_last = strrchr(path, '/') + 1;
-	if (path_last == NULL || path_last[0] == '\0') {
-		/* most applicable errno */
-		return -EINVAL;
-	}
+	jgfs_unlock_ns();
 	
-	return jgfs_create_symlink(parent, path_last, target);
+	return rtn;
 }
 
 int jg_rename(const char *path, const char *newpath) {
@@ -202,247 +243,346 @@ int jg_rename(const char *path, const char *newpath) {
 		return -ENAMETOOLONG;
 	}
 	
-	struct jgfs_dir_clust *old_parent, *new_parent;
-	struct jgfs_dir_ent *dir_ent;
+	/* dir ents are moved and removed with everything else locked out */
+	jgfs_lock_ns(true);
+	
+	struct jgfs_dir_ent *old_parent, *new_parent, *dir_ent;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &old_parent, &dir_ent)) != 0 ||
-		(rtn = jgfs_lookup(newpath, &new_parent, NULL)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &old_parent, &dir_ent)) == 0 &&
+		(rtn = jgfs_lookup(newpath, &new_parent, NULL)) == 0) {
+		/* transplant it under the new name (even if it's the same directory) */
+		rtn = jgfs_move_ent(old_parent, dir_ent, new_parent, newpath_last);
 	}
 	
-	/* rename the dir ent */
-	strlcpy(dir_ent->name, newpath_last, JGFS_NAME_LIMIT + 1);
+	jgfs_unlock_ns();
 	
-	/* transplant it (even if it's the same directory) */
-	return jgfs_move_ent(dir_ent, new_parent);
+	return rtn;
 }
 
 int jg_mknod(const char *path, mode_t mode, dev_t dev) {
-	struct jgfs_dir_clust *parent;
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, NULL)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, NULL)) == 0) {
+		char *path_last = strrchr(path, '/') + 1;
+		
+		if ((mode & ~0777) != 0 && (mode & ~0777) != S_IFREG) {
+			rtn = -EPERM;
+		} else if (path_last == NULL || path_last[0] == '\0') {
+			/* most applicable errno */
+			rtn = -EINVAL;
+		} else {
+			rtn = jgfs_create_file(parent, path_last);
+		}
 	}
 	
-	switch (mode & ~0777) {
-	case 0:
-	case S_IFREG:
-		break;
-	default:
-		return -EPERM;
-	}
+	jgfs_unlock_ns();
 	
-	char *path_last = strrchr(path, '/') + 1;
-	if (path_last == NULL || path_last[0] == '\0') {
-		/* most applicable errno */
-		return -EINVAL;
-	}
-	
-	return jgfs_create_file(parent, path_last);
+	return rtn;
 }
 
 int jg_mkdir(const char *path, mode_t mode) {
-	struct jgfs_dir_clust *parent;
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, NULL)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, NULL)) == 0) {
+		char *path_last = strrchr(path, '/') + 1;
+		if (path_last == NULL || path_last[0] == '\0') {
+			/* most applicable errno */
+			rtn = -EINVAL;
+		} else {
+			rtn = jgfs_create_dir(parent, path_last);
+		}
 	}
 	
-	char *path_last = strrchr(path, '/') + 1;
-	if (path_last == NULL || path_last[0] == '\0') {
-		/* most applicable errno */
-		return -EINVAL;
-	}
+	jgfs_unlock_ns();
 	
-	return jgfs_create_dir(parent, path_last);
+	return rtn;
 }
 
 int jg_unlink(const char *path) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+	jgfs_lock_ns(true);
+	
+	struct jgfs_dir_ent *parent, *child;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		if (child->type == TYPE_DIR) {
+			rtn = -EISDIR;
+		} else {
+			rtn = jgfs_delete_ent(parent, child, true);
+		}
 	}
 	
-	if (child->type == TYPE_DIR) {
-		return -EISDIR;
-	}
+	jgfs_unlock_ns();
 	
-	return jgfs_delete_ent(child, true);
+	return rtn;
 }
 
 int jg_rmdir(const char *path) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+	jgfs_lock_ns(true);
+	
+	struct jgfs_dir_ent *parent, *child;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		if (child->type != TYPE_DIR) {
+			rtn = -ENOTDIR;
+		} else {
+			rtn = jgfs_delete_ent(parent, child, true);
+		}
 	}
 	
-	if (child->type != TYPE_DIR) {
-		return -ENOTDIR;
+	jgfs_unlock_ns();
+	
+	return rtn;
+}
+
+/* find the dir ent that an operation on path applies to, through the handle in
+ * fi if there is one (which also works once the file has been unlinked); the
+ * caller must hold the namespace lock */
+static int jg_lookup_file(const char *path, struct fuse_file_info *fi,
+	struct jgfs_dir_ent **child, struct jgfs_file **file) {
+	if (fi != NULL && fi->fh != 0) {
+		struct jg_handle *handle = (struct jg_handle *)fi->fh;
+		
+		*file  = handle->file;
+		*child = jgfs_file_dir_ent(handle->file);
+		return 0;
 	}
 	
-	return jgfs_delete_ent(child, true);
+	struct jgfs_dir_ent *parent;
+	*file = NULL;
+	return jgfs_lookup(path, &parent, child);
 }
 
 int jg_open(const char *path, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent, *child;
+	int rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		if (child->type != TYPE_FILE) {
+			rtn = -EISDIR;
+		} else {
+			struct jg_handle *handle;
+			if ((handle = malloc(sizeof(*handle))) == NULL) {
+				rtn = -ENOMEM;
+			} else {
+				handle->file  = jgfs_file_open(child);
+				handle->flags = fi->flags;
+				
+				fi->fh = (uintptr_t)handle;
+			}
+		}
+	}
+	
+	jgfs_unlock_ns();
+	
+	return rtn;
+}
+
+int jg_release(const char *path, struct fuse_file_info *fi) {
+	struct jg_handle *handle = (struct jg_handle *)fi->fh;
+	
+	jgfs_file_close(handle->file);
+	free(handle);
+	
 	return 0;
 }
 
-int jg_truncate(const char *path, off_t newsize) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+int jg_fgetattr(const char *path, struct stat *buf,
+	struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *child;
+	struct jgfs_file *file;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jg_lookup_file(path, fi, &child, &file)) == 0) {
+		jgfs_lock_file(child, false);
+		jg_fill_stat(child, buf);
+		jgfs_unlock_file(child);
 	}
 	
-	if (child->type != TYPE_FILE) {
-		return -EISDIR;
-	}
+	jgfs_unlock_ns();
 	
-	child->mtime = time(NULL);
+	return rtn;
+}
+
+int jg_truncate(const char *path, off_t newsize) {
+	jgfs_lock_ns(false);
 	
-	if (newsize < child->size) {
-		jgfs_reduce(child, newsize);
-		return 0;
-	} else if (newsize > child->size) {
-		if (!jgfs_enlarge(child, newsize)) {
-			return -ENOSPC;
-		}
+	struct jgfs_dir_ent *parent, *child;
+	int rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		jgfs_lock_file(child, true);
+		rtn = jgfs_resize(child, newsize);
+		jgfs_unlock_file(child);
 	}
 	
-	return 0;
+	jgfs_unlock_ns();
+	
+	return rtn;
 }
 
 int jg_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi) {
-	return jg_truncate(path, newsize);
-}
-
-int jg_read(const char *path, char *buf, size_t size, off_t offset,
-	struct fuse_file_info *fi) {
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *child;
+	struct jgfs_file *file;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jg_lookup_file(path, fi, &child, &file)) == 0) {
+		jgfs_lock_file(child, true);
+		rtn = jgfs_resize(child, newsize);
+		jgfs_unlock_file(child);
 	}
 	
-	memset(buf, 0, size);
+	jgfs_unlock_ns();
 	
-	uint32_t file_size = child->size;
-	int b_read = 0;
+	return rtn;
+}
+
+int jg_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
 	
-	/* immediate EOF check */
-	if (file_size <= offset) {
-		return 0;
+	/* flush only what has changed of this file and what leads to it */
+	struct jgfs_dir_ent *child;
+	struct jgfs_file *file;
+	int rtn;
+	if ((rtn = jg_lookup_file(path, fi, &child, &file)) == 0) {
+		jgfs_lock_file(child, false);
+		rtn = jgfs_sync_file(child);
+		jgfs_unlock_file(child);
 	}
 	
-	/* skip to the first cluster requested */
-	fat_ent_t data_addr = child->begin;
-	while (offset >= jgfs_clust_size()) {
-		data_addr  = jgfs_fat_read(data_addr);
-		offset    -= jgfs_clust_size();
-		file_size -= jgfs_clust_size();
-	}
+	jgfs_unlock_ns();
 	
-	while (size > 0 && file_size > 0) {
-		uint32_t size_this_cluster;
-		
-		if (size < file_size) {
-			size_this_cluster = size;
-		} else {
-			size_this_cluster = file_size;
-		}
-		
-		/* read to the end of this cluster on this iteration */
-		if (size_this_cluster > (jgfs_clust_size() - offset)) {
-			size_this_cluster = (jgfs_clust_size() - offset);
-		}
-		
-		struct clust *data_clust = jgfs_get_clust(data_addr);
-		memcpy(buf, (char *)data_clust + offset, size_this_cluster);
-		
-		buf       += size_this_cluster;
-		b_read    += size_this_cluster;
-		
-		size      -= size_this_cluster;
-		file_size -= size_this_cluster;
-		
-		offset     = 0;
-		
-		/* next cluster */
-		data_addr = jgfs_fat_read(data_addr);
+	/* with a journal, what leads to it is committed once nothing is held */
+	if (rtn == 0) {
+		rtn = jgfs_journal_commit();
 	}
 	
-	return b_read;
+	return rtn;
 }
 
-int jg_write(const char *path, const char *buf, size_t size, off_t offset,
-	struct fuse_file_info *fi) {
-	uint32_t clust_size = jgfs_clust_size();
+int jg_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
 	
-	struct jgfs_dir_clust *parent;
-	struct jgfs_dir_ent   *child;
+	/* flush only what has changed of this directory and what leads to it */
+	struct jgfs_dir_ent *parent, *child;
 	int rtn;
-	if ((rtn = jgfs_lookup(path, &parent, &child)) != 0) {
-		return rtn;
+	if ((rtn = jgfs_lookup(path, &parent, &child)) == 0) {
+		jgfs_lock_file(child, false);
+		rtn = jgfs_sync_file(child);
+		jgfs_unlock_file(child);
 	}
 	
-	child->mtime = time(NULL);
+	jgfs_unlock_ns();
 	
-	if (offset + size > child->size) {
-		if (!jgfs_enlarge(child, offset + size)) {
-			return -ENOSPC;
-		}
+	/* with a journal, what leads to it is committed once nothing is held */
+	if (rtn == 0) {
+		rtn = jgfs_journal_commit();
 	}
 	
-	uint32_t file_size = child->size;
-	int b_written = 0;
-	
-	/* skip to the first cluster requested */
-	fat_ent_t data_addr = child->begin;
-	while (offset >= clust_size) {
-		data_addr  = jgfs_fat_read(data_addr);
-		offset    -= clust_size;
-		file_size -= clust_size;
+	return rtn;
+}
+
+int jg_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+	off_t offset, struct fuse_file_info *fi) {
+	struct iovec *iov;
+	struct fuse_bufvec *bufv;
+	if ((iov = malloc(JGFS_READ_IOV_MAX(size) * sizeof(*iov))) == NULL) {
+		return -ENOMEM;
+	} else if ((bufv = malloc(sizeof(*bufv))) == NULL) {
+		free(iov);
+		return -ENOMEM;
 	}
 	
-	while (size > 0 && file_size > 0) {
-		uint32_t size_this_cluster;
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *child;
+	struct jgfs_file *file;
+	int rtn;
+	if ((rtn = jg_lookup_file(path, fi, &child, &file)) == 0) {
+		jgfs_lock_file(child, false);
 		
-		if (size < file_size) {
-			size_this_cluster = size;
-		} else {
-			size_this_cluster = file_size;
-		}
+		/* fuse sends the reply only after we return, by which time the
+		 * clusters may have been freed and reused by another file, so the
+		 * bytes have to be copied out while the file is still locked; fuse
+		 * frees the buffer once it is sent */
+		int iov_count = jgfs_read_iov(child, file, iov, size, offset);
 		
-		/* write to the end of this cluster on this iteration */
-		if (size_this_cluster > (clust_size - offset)) {
-			size_this_cluster = (clust_size - offset);
+		size_t total = 0;
+		for (int i = 0; i < iov_count; ++i) {
+			total += iov[i].iov_len;
 		}
 		
-		struct clust *data_clust = jgfs_get_clust(data_addr);
-		memcpy((char *)data_clust + offset, buf, size_this_cluster);
+		*bufv = FUSE_BUFVEC_INIT(total);
+		if (iov_count < 0) {
+			rtn = iov_count;
+		} else if (total != 0 && (bufv->buf[0].mem = malloc(total)) == NULL) {
+			rtn = -ENOMEM;
+		} else {
+			uint8_t *dest = bufv->buf[0].mem;
+			for (int i = 0; i < iov_count; ++i) {
+				memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+				dest += iov[i].iov_len;
+			}
+		}
 		
-		buf       += size_this_cluster;
-		b_written += size_this_cluster;
+		jgfs_unlock_file(child);
+	}
+	
+	jgfs_unlock_ns();
+	
+	if (rtn == 0) {
+		*bufp = bufv;
+	} else {
+		free(bufv);
+	}
+	free(iov);
+	
+	return rtn;
+}
+
+int jg_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+	struct fuse_file_info *fi) {
+	/* honor O_SYNC and O_DSYNC (which O_SYNC includes) */
+	bool dsync = (fi != NULL && fi->fh != 0 &&
+		(((struct jg_handle *)fi->fh)->flags & O_DSYNC) != 0);
+	
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *child;
+	struct jgfs_file *file;
+	int rtn;
+	if ((rtn = jg_lookup_file(path, fi, &child, &file)) == 0) {
+		jgfs_lock_file(child, true);
 		
-		size      -= size_this_cluster;
-		file_size -= size_this_cluster;
+		rtn = jg_buf_write(child, file, buf, offset);
 		
-		offset     = 0;
+		if (rtn > 0 && dsync) {
+			int err;
+			if ((err = jgfs_sync_file(child)) != 0) {
+				rtn = err;
+			}
+		}
 		
-		/* next cluster */
-		data_addr = jgfs_fat_read(data_addr);
+		jgfs_unlock_file(child);
 	}
 	
-	return b_written;
+	jgfs_unlock_ns();
+	
+	if (rtn > 0 && dsync) {
+		int err;
+		if ((err = jgfs_journal_commit()) != 0) {
+			rtn = err;
+		}
+	}
+	
+	return rtn;
 }
 
-
 struct fuse_operations jg_oper = {
 	.init      = jg_init,
 	.destroy   = jg_destroy,
@@ -450,6 +590,7 @@ struct fuse_operations jg_oper = {
 	.statfs    = jg_statfs,
 	
 	.getattr   = jg_getattr,
+	.fgetattr  = jg_fgetattr,
 	.utimens   = jg_utimens,
 	
 	.chmod     = jg_chmod,
@@ -471,10 +612,11 @@ struct fuse_operations jg_oper = {
 	.rmdir     = jg_rmdir,
 	
 	.open      = jg_open,
+	.release   = jg_release,
 	
 	.ftruncate = jg_ftruncate,
 	.truncate  = jg_truncate,
 	
-	.read      = jg_read,
-	.write     = jg_write,
+	.read_buf  = jg_read_buf,
+	.write_buf = jg_write_buf,
 };
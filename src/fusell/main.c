@@ -0,0 +1,238 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include <err.h>
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../lib/jgfs.h"
+#include "../common/loop.h"
+#include "../common/opts.h"
+
+
+/* fuse_opt stores flags as ints */
+struct jgll_opts {
+	double             attr_timeout;
+	double             entry_timeout;
+	double             negative_timeout;
+	int                keep_cache;
+	unsigned int       threads;     // fixed worker count, or 0 for fuse's pick
+	unsigned int       wb_interval; // writeback interval in ms
+	unsigned long long dirty_bytes; // writeback threshold in bytes
+	int                backend;     // enum jgfs_dev_type
+	unsigned long long cache_size;  // pread backend memory bound in bytes
+	unsigned int       readahead;   // prefetch window bound in bytes
+	int                lock_meta;   // lock metadata into memory
+	int                fast;
+	int                help;
+};
+
+
+extern char *dev_path;
+
+extern double jgll_attr_timeout;
+extern double jgll_entry_timeout;
+extern double jgll_negative_timeout;
+extern bool   jgll_keep_cache;
+
+extern struct jgfs_wb_param jgll_wb_param;
+
+extern struct fuse_lowlevel_ops jgll_oper;
+
+
+#define JGLL_OPT(_templ, _field, _value) \
+	{ _templ, offsetof(struct jgll_opts, _field), _value }
+
+/* the high-level library handles the caching options itself; here they are
+ * ours to implement, and the rest go on to fuse */
+static const struct fuse_opt jgll_opt_spec[] = {
+	JGLL_OPT("attr_timeout=%lf",      attr_timeout,     0),
+	JGLL_OPT("entry_timeout=%lf",     entry_timeout,    0),
+	JGLL_OPT("negative_timeout=%lf",  negative_timeout, 0),
+	JGLL_OPT("kernel_cache",          keep_cache,       1),
+	JGLL_OPT("threads=%u",            threads,          0),
+	JGLL_OPT("writeback_interval=%u", wb_interval,      0),
+	JGLL_OPT("dirty_bytes=%llu",      dirty_bytes,      0),
+	JGLL_OPT("backend=mmap",          backend,          DEV_MMAP),
+	JGLL_OPT("backend=pread",         backend,          DEV_PREAD),
+	JGLL_OPT("backend=uring",         backend,          DEV_URING),
+	JGLL_OPT("backend=window",        backend,          DEV_WINDOW),
+	JGLL_OPT("cache_size=%llu",       cache_size,       0),
+	JGLL_OPT("readahead=%u",          readahead,        0),
+	JGLL_OPT("lock_meta",             lock_meta,        1),
+	JGLL_OPT("fast",                  fast,             1),
+	JGLL_OPT("-h",                    help,             1),
+	JGLL_OPT("--help",                help,             1),
+	
+	/* every change goes through the kernel, so the cache it keeps is never
+	 * stale, and a file is always unchanged since it was last cached */
+	JGLL_OPT("auto_cache",            keep_cache,       1),
+	
+	FUSE_OPT_END,
+};
+
+
+static void jgll_usage(const char *argv0) {
+	jg_usage_common(argv0);
+	fprintf(stderr,
+		"    -o attr_timeout=T      cache attributes for T seconds (1.0)\n"
+		"    -o entry_timeout=T     cache names for T seconds (1.0)\n"
+		"    -o negative_timeout=T  cache missing names for T seconds (1.0)\n"
+		"    -o kernel_cache        keep cached file data across opens\n"
+		"    -o auto_cache          the same as kernel_cache\n"
+		"\n"
+		"along with fuse's mount options, such as max_read=N, max_write=N\n"
+		"and big_writes\n"
+		"\n");
+}
+
+static int jgll_opt_proc(void *data, const char *arg, int key,
+	struct fuse_args *outargs) {
+	/* the first plain argument is ours, the second is the mountpoint; the
+	 * device is opened only after we have daemonized and left the working
+	 * directory, so the path has to be absolute */
+	if (key == FUSE_OPT_KEY_NONOPT && dev_path == NULL) {
+		if ((dev_path = realpath(arg, NULL)) == NULL) {
+			err(1, "%s", arg);
+		}
+		return 0;
+	}
+	
+	return 1;
+}
+
+/* parse argv into opts, leaving what is fuse's in args; the fast preset, if
+ * given, goes in front of the rest, so that it loses to any option given
+ * explicitly */
+static int jgll_parse(int argc, char **argv, bool fast, struct jgll_opts *opts,
+	struct fuse_args *args) {
+	*opts = (struct jgll_opts) {
+		.attr_timeout     = 1.0,
+		.entry_timeout    = 1.0,
+		.negative_timeout = 1.0,
+		.keep_cache       = 0,
+		.threads          = 0,
+		.wb_interval      = jgll_wb_param.interval,
+		.dirty_bytes      = jgll_wb_param.dirty_bytes,
+		.backend          = DEV_AUTO,
+		.cache_size       = 0,
+		.readahead        = JGFS_READAHEAD_DEFAULT,
+		.lock_meta        = 0,
+		.fast             = 0,
+		.help             = 0,
+	};
+	
+	*args = (struct fuse_args)FUSE_ARGS_INIT(0, NULL);
+	if (fuse_opt_add_arg(args, argv[0]) != 0 ||
+		(fast && (fuse_opt_add_arg(args, "-o") != 0 ||
+		fuse_opt_add_arg(args, JG_FAST_OPTS) != 0))) {
+		errx(1, "fuse_opt_add_arg failed");
+	}
+	for (int i = 1; i < argc; ++i) {
+		if (fuse_opt_add_arg(args, argv[i]) != 0) {
+			errx(1, "fuse_opt_add_arg failed");
+		}
+	}
+	
+	free(dev_path);
+	dev_path = NULL;
+	
+	return fuse_opt_parse(args, opts, jgll_opt_spec, jgll_opt_proc);
+}
+
+int main(int argc, char **argv) {
+	struct jgll_opts opts;
+	struct fuse_args args;
+	if (jgll_parse(argc, argv, false, &opts, &args) != 0) {
+		return 1;
+	}
+	if (opts.fast) {
+		fuse_opt_free_args(&args);
+		if (jgll_parse(argc, argv, true, &opts, &args) != 0) {
+			return 1;
+		}
+	}
+	
+	if (opts.help) {
+		jgll_usage(argv[0]);
+		
+		/* have fuse list its own general options */
+		if (fuse_opt_add_arg(&args, "-ho") == 0) {
+			fuse_parse_cmdline(&args, NULL, NULL, NULL);
+		}
+		
+		fuse_opt_free_args(&args);
+		return 0;
+	}
+	
+	jgll_attr_timeout     = opts.attr_timeout;
+	jgll_entry_timeout    = opts.entry_timeout;
+	jgll_negative_timeout = opts.negative_timeout;
+	jgll_keep_cache       = (opts.keep_cache != 0);
+	
+	jgll_wb_param.interval    = opts.wb_interval;
+	jgll_wb_param.dirty_bytes = opts.dirty_bytes;
+	
+	jgfs_dev_select(opts.backend, opts.cache_size);
+	jgfs_file_readahead(opts.readahead);
+	jgfs_dev_lock_pinned(opts.lock_meta != 0);
+	
+	char *mount_point;
+	int multithreaded, foreground;
+	if (fuse_opt_add_arg(&args, "-oallow_other") != 0 ||
+		fuse_parse_cmdline(&args, &mount_point, &multithreaded,
+		&foreground) != 0) {
+		errx(1, "fuse_parse_cmdline failed");
+	}
+	
+	if (dev_path == NULL || mount_point == NULL) {
+		jgll_usage(argv[0]);
+		errx(1, "expected a device and a mountpoint");
+	}
+	
+	struct fuse_chan *chan;
+	if ((chan = fuse_mount(mount_point, &args)) == NULL) {
+		errx(1, "fuse_mount failed");
+	}
+	
+	struct fuse_session *session;
+	if ((session = fuse_lowlevel_new(&args, &jgll_oper, sizeof(jgll_oper),
+		NULL)) == NULL) {
+		fuse_unmount(mount_point, chan);
+		errx(1, "fuse_lowlevel_new failed");
+	}
+	
+	if (fuse_set_signal_handlers(session) != 0) {
+		errx(1, "fuse_set_signal_handlers failed");
+	}
+	
+	fuse_session_add_chan(session, chan);
+	
+	/* stays in the foreground for -f or -d */
+	if (fuse_daemonize(foreground) != 0) {
+		errx(1, "fuse_daemonize failed");
+	}
+	
+	int rtn;
+	if (!multithreaded) {
+		rtn = fuse_session_loop(session);
+	} else if (opts.threads != 0) {
+		rtn = jg_loop_fixed(session, opts.threads);
+	} else {
+		rtn = fuse_session_loop_mt(session);
+	}
+	
+	fuse_remove_signal_handlers(session);
+	fuse_session_remove_chan(chan);
+	fuse_session_destroy(session);
+	fuse_unmount(mount_point, chan);
+	fuse_opt_free_args(&args);
+	free(mount_point);
+	
+	return (rtn == 0 ? 0 : 1);
+}
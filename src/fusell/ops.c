@@ -0,0 +1,621 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../lib/jgfs.h"
+#include "../common/buf.h"
+
+
+/* what readdir reports for inodes that haven't been looked up (as fuse's
+ * high-level api does) */
+#define JGLL_UNKNOWN_INO 0xffffffff
+
+
+char *dev_path;
+
+/* seconds the kernel may trust the attributes, names and missing names we give
+ * it; nothing changes the filesystem except through the kernel, and no request
+ * changes more than the kernel knows to invalidate (a write or resize that
+ * fails or comes up short leaves no trace beyond what it reports), so these
+ * only bound how often it asks again, and may be as long as you like */
+double jgll_attr_timeout     = 1.0;
+double jgll_entry_timeout    = 1.0;
+double jgll_negative_timeout = 1.0;
+
+/* whether the kernel may keep the cached pages of a file across opens */
+bool jgll_keep_cache = false;
+
+/* when changes are written back in the background */
+struct jgfs_wb_param jgll_wb_param = {
+	.interval    = 5000,
+	.dirty_bytes = 32 << 20,
+};
+
+
+void jgll_init(void *userdata, struct fuse_conn_info *conn) {
+	jgfs_init(dev_path);
+	
+	/* threads can only be started now that fuse has daemonized */
+	jgfs_writeback_start(&jgll_wb_param);
+	
+	/* let written data be spliced onto the device */
+	conn->want |= (conn->capable & FUSE_CAP_SPLICE_READ);
+}
+
+void jgll_destroy(void *userdata) {
+	jgfs_done();
+}
+
+/* every inode but the root is an open file, kept open from the kernel's first
+ * lookup of it until it forgets the last one, so that its inode number stays
+ * the same and follows it through renames and unlinking */
+static struct jgfs_file *jgll_file(fuse_ino_t ino) {
+	if (ino == FUSE_ROOT_ID) {
+		return NULL;
+	} else {
+		return (struct jgfs_file *)ino;
+	}
+}
+
+/* get the current dir ent of ino; the caller must hold the namespace lock */
+static struct jgfs_dir_ent *jgll_dir_ent(fuse_ino_t ino) {
+	if (ino == FUSE_ROOT_ID) {
+		return &jgfs.hdr->root_dir_ent;
+	} else {
+		return jgfs_file_dir_ent(jgll_file(ino));
+	}
+}
+
+/* get the dir ent of ino for looking up or adding names in; the caller must
+ * hold the namespace lock */
+static int jgll_parent(fuse_ino_t ino, struct jgfs_dir_ent **parent) {
+	*parent = jgll_dir_ent(ino);
+	
+	if ((*parent)->type != TYPE_DIR) {
+		return -ENOTDIR;
+	} else if ((*parent)->begin == FAT_NALLOC) {
+		/* it has been removed, and can't be added to */
+		return -ENOENT;
+	}
+	
+	return 0;
+}
+
+static mode_t jgll_mode(uint8_t type) {
+	if (type == TYPE_FILE) {
+		return 0644 | S_IFREG;
+	} else if (type == TYPE_DIR) {
+		return 0755 | S_IFDIR;
+	} else if (type == TYPE_SYMLINK) {
+		return 0777 | S_IFLNK;
+	} else {
+		errx(1, "jgll_mode: unknown type 0x%x", type);
+	}
+}
+
+/* the caller must hold dir_ent's file lock */
+static void jgll_fill_stat(struct jgfs_dir_ent *dir_ent, fuse_ino_t ino,
+	struct stat *buf) {
+	memset(buf, 0, sizeof(*buf));
+	
+	buf->st_ino = ino;
+	buf->st_mode = jgll_mode(dir_ent->type);
+	buf->st_nlink = 1;
+	buf->st_uid = 0;
+	buf->st_gid = 0;
+	buf->st_size = dir_ent->size;
+	buf->st_blocks = CEIL(dir_ent->size, jgfs_clust_size());
+	buf->st_atime = buf->st_ctime = buf->st_mtime = dir_ent->mtime;
+}
+
+/* look up name in parent for the kernel, which takes a reference to it until
+ * it forgets it; the caller must hold the namespace lock */
+static int jgll_entry(struct jgfs_dir_ent *parent, const char *name,
+	struct fuse_entry_param *entry) {
+	memset(entry, 0, sizeof(*entry));
+	entry->attr_timeout  = jgll_attr_timeout;
+	entry->entry_timeout = jgll_entry_timeout;
+	
+	struct jgfs_dir_ent *child;
+	int rtn;
+	if ((rtn = jgfs_lookup_child(name, parent, &child)) == 0) {
+		entry->ino = (uintptr_t)jgfs_file_open(child);
+		
+		jgfs_lock_file(child, false);
+		jgll_fill_stat(child, entry->ino, &entry->attr);
+		jgfs_unlock_file(child);
+	}
+	
+	return rtn;
+}
+
+static void jgll_reply_entry(fuse_req_t req, int rtn,
+	struct fuse_entry_param *entry) {
+	if (rtn == 0) {
+		fuse_reply_entry(req, entry);
+	} else {
+		fuse_reply_err(req, -rtn);
+	}
+}
+
+void jgll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	struct statvfs statv;
+	memset(&statv, 0, sizeof(statv));
+	
+	statv.f_bsize = jgfs_clust_size();
+	statv.f_blocks = jgfs_fs_clusters();
+	
+	jgfs_lock_fat(false);
+	statv.f_bfree = statv.f_bavail = jgfs_fat_count(FAT_FREE);
+	jgfs_unlock_fat();
+	
+	statv.f_namemax = JGFS_NAME_LIMIT;
+	
+	fuse_reply_statfs(req, &statv);
+}
+
+void jgll_lookup(fuse_req_t req, fuse_ino_t parent_ino, const char *name) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent;
+	struct fuse_entry_param entry;
+	int rtn;
+	if ((rtn = jgll_parent(parent_ino, &parent)) == 0) {
+		rtn = jgll_entry(parent, name, &entry);
+	}
+	
+	jgfs_unlock_ns();
+	
+	/* let the kernel remember names that don't exist, too */
+	if (rtn == -ENOENT) {
+		memset(&entry, 0, sizeof(entry));
+		entry.entry_timeout = jgll_negative_timeout;
+		rtn = 0;
+	}
+	
+	jgll_reply_entry(req, rtn, &entry);
+}
+
+void jgll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	if (ino != FUSE_ROOT_ID) {
+		jgfs_file_put(jgll_file(ino), nlookup);
+	}
+	
+	fuse_reply_none(req);
+}
+
+void jgll_forget_multi(fuse_req_t req, size_t count,
+	struct fuse_forget_data *forgets) {
+	for (size_t i = 0; i < count; ++i) {
+		if (forgets[i].ino != FUSE_ROOT_ID) {
+			jgfs_file_put(jgll_file(forgets[i].ino), forgets[i].nlookup);
+		}
+	}
+	
+	fuse_reply_none(req);
+}
+
+void jgll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *dir_ent = jgll_dir_ent(ino);
+	struct stat buf;
+	
+	jgfs_lock_file(dir_ent, false);
+	jgll_fill_stat(dir_ent, ino, &buf);
+	jgfs_unlock_file(dir_ent);
+	
+	jgfs_unlock_ns();
+	
+	fuse_reply_attr(req, &buf, jgll_attr_timeout);
+}
+
+void jgll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+	int to_set, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	/* mode and ownership are fixed, and atime isn't kept */
+	struct jgfs_dir_ent *dir_ent = jgll_dir_ent(ino);
+	struct stat buf;
+	int rtn = 0;
+	
+	jgfs_lock_file(dir_ent, true);
+	
+	if ((to_set & FUSE_SET_ATTR_SIZE) != 0) {
+		rtn = jgfs_resize(dir_ent, attr->st_size);
+	}
+	
+	if (rtn == 0) {
+		if ((to_set & FUSE_SET_ATTR_MTIME_NOW) != 0) {
+			dir_ent->mtime = time(NULL);
+		} else if ((to_set & FUSE_SET_ATTR_MTIME) != 0) {
+			dir_ent->mtime = attr->st_mtime;
+		}
+		jgfs_dirty(dir_ent, sizeof(*dir_ent));
+		
+		jgll_fill_stat(dir_ent, ino, &buf);
+	}
+	
+	jgfs_unlock_file(dir_ent);
+	
+	jgfs_unlock_ns();
+	
+	if (rtn == 0) {
+		fuse_reply_attr(req, &buf, jgll_attr_timeout);
+	} else {
+		fuse_reply_err(req, -rtn);
+	}
+}
+
+void jgll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	/* flush only what has changed of this file (or directory) and what leads
+	 * to it */
+	struct jgfs_dir_ent *dir_ent = jgll_dir_ent(ino);
+	
+	jgfs_lock_file(dir_ent, false);
+	int rtn = jgfs_sync_file(dir_ent);
+	jgfs_unlock_file(dir_ent);
+	
+	jgfs_unlock_ns();
+	
+	/* with a journal, what leads to it is committed once nothing is held */
+	if (rtn == 0) {
+		rtn = jgfs_journal_commit();
+	}
+	
+	fuse_reply_err(req, -rtn);
+}
+
+void jgll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	int rtn = 0;
+	if (jgll_dir_ent(ino)->type != TYPE_DIR) {
+		rtn = -ENOTDIR;
+	}
+	
+	jgfs_unlock_ns();
+	
+	if (rtn == 0) {
+		fuse_reply_open(req, fi);
+	} else {
+		fuse_reply_err(req, -rtn);
+	}
+}
+
+void jgll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info *fi) {
+	char *buf;
+	if ((buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	
+	jgfs_lock_ns(false);
+	
+	/* entry n + 2 is dir ent number n, after . and .., so that off can pick up
+	 * the listing where the last call left off */
+	struct jgfs_dir_ent *dir = jgll_dir_ent(ino);
+	size_t len = 0;
+	
+	jgfs_lock_dir(dir->begin, false);
+	
+	for (off_t n = off; ; ++n) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		
+		const char *name;
+		if (n < 2) {
+			name = (n == 0 ? "." : "..");
+			st.st_ino  = (n == 0 ? ino : JGLL_UNKNOWN_INO);
+			st.st_mode = S_IFDIR;
+		} else {
+			struct jgfs_dir_ent *dir_ent = NULL;
+			if (dir->begin != FAT_NALLOC) {
+				dir_ent = jgfs_dir_get(dir->begin, n - 2);
+			}
+			
+			if (dir_ent == NULL) {
+				break;
+			} else if (dir_ent->name[0] == '\0') {
+				continue;
+			}
+			
+			name = dir_ent->name;
+			st.st_ino  = JGLL_UNKNOWN_INO;
+			st.st_mode = jgll_mode(dir_ent->type);
+		}
+		
+		size_t ent_len =
+			fuse_add_direntry(req, buf + len, size - len, name, &st, n + 1);
+		if (ent_len > size - len) {
+			break;
+		}
+		
+		len += ent_len;
+	}
+	
+	jgfs_unlock_dir(dir->begin);
+	
+	jgfs_unlock_ns();
+	
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+}
+
+void jgll_readlink(fuse_req_t req, fuse_ino_t ino) {
+	jgfs_lock_ns(false);
+	
+	/* symlinks never change once created, so there's no file lock to take */
+	struct jgfs_dir_ent *dir_ent = jgll_dir_ent(ino);
+	char *link = NULL;
+	int rtn = 0;
+	
+	if (dir_ent->type != TYPE_SYMLINK) {
+		rtn = -EINVAL;
+	} else if ((link = calloc(1, dir_ent->size + 1)) == NULL) {
+		rtn = -ENOMEM;
+	} else {
+		memcpy(link, jgfs_get_clust(dir_ent->begin), dir_ent->size);
+	}
+	
+	jgfs_unlock_ns();
+	
+	if (rtn == 0) {
+		fuse_reply_readlink(req, link);
+	} else {
+		fuse_reply_err(req, -rtn);
+	}
+	
+	free(link);
+}
+
+void jgll_symlink(fuse_req_t req, const char *target, fuse_ino_t parent_ino,
+	const char *name) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent;
+	struct fuse_entry_param entry;
+	int rtn;
+	if ((rtn = jgll_parent(parent_ino, &parent)) == 0 &&
+		(rtn = jgfs_create_symlink(parent, name, target)) == 0) {
+		rtn = jgll_entry(parent, name, &entry);
+	}
+	
+	jgfs_unlock_ns();
+	
+	jgll_reply_entry(req, rtn, &entry);
+}
+
+void jgll_rename(fuse_req_t req, fuse_ino_t parent_ino, const char *name,
+	fuse_ino_t new_parent_ino, const char *new_name) {
+	/* dir ents are moved and removed with everything else locked out */
+	jgfs_lock_ns(true);
+	
+	struct jgfs_dir_ent *old_parent, *new_parent, *dir_ent;
+	int rtn;
+	if ((rtn = jgll_parent(parent_ino, &old_parent)) == 0 &&
+		(rtn = jgll_parent(new_parent_ino, &new_parent)) == 0 &&
+		(rtn = jgfs_lookup_child(name, old_parent, &dir_ent)) == 0) {
+		/* transplant it under the new name (even if it's the same directory) */
+		rtn = jgfs_move_ent(old_parent, dir_ent, new_parent, new_name);
+	}
+	
+	jgfs_unlock_ns();
+	
+	fuse_reply_err(req, -rtn);
+}
+
+void jgll_mknod(fuse_req_t req, fuse_ino_t parent_ino, const char *name,
+	mode_t mode, dev_t rdev) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent;
+	struct fuse_entry_param entry;
+	int rtn;
+	if ((rtn = jgll_parent(parent_ino, &parent)) == 0) {
+		if ((mode & S_IFMT) != S_IFREG) {
+			rtn = -EPERM;
+		} else if ((rtn = jgfs_create_file(parent, name)) == 0) {
+			rtn = jgll_entry(parent, name, &entry);
+		}
+	}
+	
+	jgfs_unlock_ns();
+	
+	jgll_reply_entry(req, rtn, &entry);
+}
+
+void jgll_mkdir(fuse_req_t req, fuse_ino_t parent_ino, const char *name,
+	mode_t mode) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *parent;
+	struct fuse_entry_param entry;
+	int rtn;
+	if ((rtn = jgll_parent(parent_ino, &parent)) == 0 &&
+		(rtn = jgfs_create_dir(parent, name)) == 0) {
+		rtn = jgll_entry(parent, name, &entry);
+	}
+	
+	jgfs_unlock_ns();
+	
+	jgll_reply_entry(req, rtn, &entry);
+}
+
+void jgll_unlink(fuse_req_t req, fuse_ino_t parent_ino, const char *name) {
+	jgfs_lock_ns(true);
+	
+	/* the kernel still holds a reference to the file, so its clusters stay
+	 * around until it forgets it */
+	struct jgfs_dir_ent *parent, *child;
+	int rtn;
+	if ((rtn = jgll_parent(parent_ino, &parent)) == 0 &&
+		(rtn = jgfs_lookup_child(name, parent, &child)) == 0) {
+		if (child->type == TYPE_DIR) {
+			rtn = -EISDIR;
+		} else {
+			rtn = jgfs_delete_ent(parent, child, true);
+		}
+	}
+	
+	jgfs_unlock_ns();
+	
+	fuse_reply_err(req, -rtn);
+}
+
+void jgll_rmdir(fuse_req_t req, fuse_ino_t parent_ino, const char *name) {
+	jgfs_lock_ns(true);
+	
+	struct jgfs_dir_ent *parent, *child;
+	int rtn;
+	if ((rtn = jgll_parent(parent_ino, &parent)) == 0 &&
+		(rtn = jgfs_lookup_child(name, parent, &child)) == 0) {
+		if (child->type != TYPE_DIR) {
+			rtn = -ENOTDIR;
+		} else {
+			rtn = jgfs_delete_ent(parent, child, true);
+		}
+	}
+	
+	jgfs_unlock_ns();
+	
+	fuse_reply_err(req, -rtn);
+}
+
+void jgll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	int rtn = 0;
+	if (jgll_dir_ent(ino)->type != TYPE_FILE) {
+		rtn = -EISDIR;
+	}
+	
+	jgfs_unlock_ns();
+	
+	/* the inode already holds the file open, so the handle only needs to
+	 * carry the open flags */
+	if (rtn == 0) {
+		fi->fh         = fi->flags;
+		fi->keep_cache = jgll_keep_cache;
+		fuse_reply_open(req, fi);
+	} else {
+		fuse_reply_err(req, -rtn);
+	}
+}
+
+void jgll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, 0);
+}
+
+void jgll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info *fi) {
+	struct iovec *iov;
+	if ((iov = malloc(JGFS_READ_IOV_MAX(size) * sizeof(*iov))) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *dir_ent = jgll_dir_ent(ino);
+	
+	/* the reply goes straight from the device mapping to the kernel, so the
+	 * file lock is held until it has been sent */
+	jgfs_lock_file(dir_ent, false);
+	int iov_count = jgfs_read_iov(dir_ent, jgll_file(ino), iov, size, off);
+	if (iov_count >= 0) {
+		fuse_reply_iov(req, iov, iov_count);
+	} else {
+		fuse_reply_err(req, -iov_count);
+	}
+	jgfs_unlock_file(dir_ent);
+	
+	jgfs_unlock_ns();
+	
+	free(iov);
+}
+
+void jgll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf,
+	off_t off, struct fuse_file_info *fi) {
+	jgfs_lock_ns(false);
+	
+	struct jgfs_dir_ent *dir_ent = jgll_dir_ent(ino);
+	
+	jgfs_lock_file(dir_ent, true);
+	
+	int rtn = jg_buf_write(dir_ent, jgll_file(ino), buf, off);
+	
+	/* honor O_SYNC and O_DSYNC (which O_SYNC includes) */
+	if (rtn > 0 && (fi->fh & O_DSYNC) != 0) {
+		int err;
+		if ((err = jgfs_sync_file(dir_ent)) != 0) {
+			rtn = err;
+		}
+	}
+	
+	jgfs_unlock_file(dir_ent);
+	
+	jgfs_unlock_ns();
+	
+	if (rtn > 0 && (fi->fh & O_DSYNC) != 0) {
+		int err;
+		if ((err = jgfs_journal_commit()) != 0) {
+			rtn = err;
+		}
+	}
+	
+	if (rtn >= 0) {
+		fuse_reply_write(req, rtn);
+	} else {
+		fuse_reply_err(req, -rtn);
+	}
+}
+
+struct fuse_lowlevel_ops jgll_oper = {
+	.init         = jgll_init,
+	.destroy      = jgll_destroy,
+	
+	.statfs       = jgll_statfs,
+	
+	.lookup       = jgll_lookup,
+	.forget       = jgll_forget,
+	.forget_multi = jgll_forget_multi,
+	
+	.getattr      = jgll_getattr,
+	.setattr      = jgll_setattr,
+	
+	.fsync        = jgll_fsync,
+	.fsyncdir     = jgll_fsync,
+	
+	.opendir      = jgll_opendir,
+	.readdir      = jgll_readdir,
+	.readlink     = jgll_readlink,
+	
+	.symlink      = jgll_symlink,
+	.rename       = jgll_rename,
+	
+	.mknod        = jgll_mknod,
+	.mkdir        = jgll_mkdir,
+	
+	.unlink       = jgll_unlink,
+	.rmdir        = jgll_rmdir,
+	
+	.open         = jgll_open,
+	.release      = jgll_release,
+	
+	.read         = jgll_read,
+	.write_buf    = jgll_write_buf,
+};
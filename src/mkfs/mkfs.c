@@ -22,6 +22,8 @@ struct jgfs_mkfs_param param = {
 	.s_boot  = 6,
 	.s_per_c = 0, // auto
 	
+	.s_journal = 0, // none
+	
 	.zero_data = false,
 	.zap       = false,
 };
@@ -64,6 +66,15 @@ error_t parse_opt(int key, char *arg, struct argp_state *state) {
 			break;
 		}
 		break;
+	case 'j':
+		switch (sscanf(arg, "%" SCNu32, &param.s_journal)) {
+		case EOF:
+			warnx("s_journal: can't read that!");
+			argp_usage(state);
+		case 1:
+			break;
+		}
+		break;
 	case 'z':
 		param.zero_data = true;
 		break;
@@ -108,6 +119,8 @@ static struct argp_option options[] = {
 		"boot sectors         [default: 6]", 2, },
 	{ "cluster", 'c', "NUMBER", 0,
 		"sectors per cluster  [default: auto]", 2, },
+	{ "journal", 'j', "NUMBER", 0,
+		"journal sectors      [default: 0 (none)]", 2, },
 	
 	{ NULL, 0, NULL, 0, "initialization options:", 3 },
 	{ "zero-data", 'z', NULL, 0,
@@ -133,6 +146,7 @@ int main(int argc, char **argv) {
 	warnx("total sectors:  %" PRIu32, jgfs.hdr->s_total);
 	warnx("boot sectors:   %" PRIu16, jgfs.hdr->s_boot);
 	warnx("fat sectors:    %" PRIu16, jgfs.hdr->s_fat);
+	warnx("journal:        %" PRIu32, jgfs.hdr->s_journal);
 	warnx("cluster size:   %u", jgfs.hdr->s_per_c * SECT_SIZE);
 	warnx("total clusters: %" PRIu16, jgfs_fs_clusters());
 	
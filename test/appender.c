@@ -0,0 +1,75 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* append small records to a file and report the throughput of each 16 MiB
+ * interval; this should stay flat as the file grows */
+
+#define INTERVAL (16 * 1024 * 1024)
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		errx(1, "usage: appender <file> <record bytes> <total MiB>");
+	}
+	
+	size_t rec_size = strtoul(argv[2], NULL, 0);
+	size_t total = strtoul(argv[3], NULL, 0) * 1024 * 1024;
+	
+	if (rec_size == 0) {
+		errx(1, "record size must be nonzero");
+	}
+	
+	int fd;
+	if ((fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+		0644)) == -1) {
+		err(1, "open failed");
+	}
+	
+	char *record = malloc(rec_size);
+	memset(record, 'j', rec_size);
+	
+	size_t written = 0;
+	double t_last = now();
+	
+	while (written < total) {
+		if (write(fd, record, rec_size) != (ssize_t)rec_size) {
+			close(fd);
+			err(1, "write failed at %zu bytes", written);
+		}
+		
+		written += rec_size;
+		
+		if (written % INTERVAL < rec_size) {
+			double t_now = now();
+			
+			printf("%6zu MiB: %8.2f MiB/s\n", written / (1024 * 1024),
+				(INTERVAL / (1024.0 * 1024.0)) / (t_now - t_last));
+			fflush(stdout);
+			
+			t_last = t_now;
+		}
+	}
+	
+	free(record);
+	close(fd);
+	
+	return 0;
+}
@@ -0,0 +1,110 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../lib/jgfs.h"
+
+/* time creating, looking up, listing and deleting a large number of entries in
+ * a single directory on a scratch image; build with:
+ * gcc -O2 -include stdbool.h -include stdint.h test/dirbench.c bin/libjgfs.a -lbsd
+ */
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int count_ent(struct jgfs_dir_ent *dir_ent, void *user_ptr) {
+	++*(uint32_t *)user_ptr;
+	
+	return 0;
+}
+
+static void report(const char *what, uint32_t n, double t) {
+	printf("%-8s %8.3f s  %10.0f ops/s\n", what, t, n / t);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		errx(1, "usage: dirbench <scratch image> <entries>");
+	}
+	
+	uint32_t n = strtoul(argv[2], NULL, 0);
+	
+	/* 4 KiB clusters, with plenty of room for the directory itself */
+	int fd;
+	if ((fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		err(1, "open failed");
+	}
+	if (ftruncate(fd, (off_t)(n * sizeof(struct jgfs_dir_ent) * 2) +
+		(1024 * 1024)) == -1) {
+		err(1, "ftruncate failed");
+	}
+	close(fd);
+	
+	struct jgfs_mkfs_param param = {
+		.label   = "dirbench",
+		.s_total = 0,
+		.s_boot  = 6,
+		.s_per_c = 8,
+	};
+	jgfs_new(argv[1], &param);
+	
+	struct jgfs_dir_ent *root = &jgfs.hdr->root_dir_ent, *dir_ent;
+	char name[JGFS_NAME_LIMIT + 1];
+	double t;
+	
+	t = now();
+	for (uint32_t i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "file%u", i);
+		if (jgfs_create_file(root, name) != 0) {
+			errx(1, "create failed at %u", i);
+		}
+	}
+	report("create", n, now() - t);
+	
+	t = now();
+	for (uint32_t i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "file%u", (i * 7919) % n);
+		if (jgfs_lookup_child(name, root, &dir_ent) != 0) {
+			errx(1, "lookup failed at %u", i);
+		}
+	}
+	report("lookup", n, now() - t);
+	
+	uint32_t count = 0;
+	t = now();
+	jgfs_dir_foreach(count_ent, root, &count);
+	report("list", count, now() - t);
+	
+	if (count != n) {
+		errx(1, "listed %u entries, expected %u", count, n);
+	}
+	
+	t = now();
+	for (uint32_t i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "file%u", i);
+		if (jgfs_lookup_child(name, root, &dir_ent) != 0 ||
+			jgfs_delete_ent(root, dir_ent, true) != 0) {
+			errx(1, "delete failed at %u", i);
+		}
+	}
+	report("delete", n, now() - t);
+	
+	printf("root dir is back down to %u bytes\n", root->size);
+	
+	jgfs_done();
+	
+	return 0;
+}
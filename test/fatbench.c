@@ -0,0 +1,108 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../lib/jgfs.h"
+
+/* time the fat scanning kernels over a full-size (128 KiB) fat on a scratch
+ * image; build with:
+ * gcc -O2 -include stdbool.h -include stdint.h test/fatbench.c bin/libjgfs.a -lbsd
+ */
+
+#define ITERATIONS 2000
+
+static const char *isa_names[] = {
+	[SCAN_SCALAR] = "scalar",
+	[SCAN_SSE2]   = "sse2",
+	[SCAN_AVX2]   = "avx2",
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		errx(1, "usage: fatbench <scratch image>");
+	}
+	
+	/* one sector per cluster, sized so that the fat comes out to 128 KiB */
+	int fd;
+	if ((fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		err(1, "open failed");
+	}
+	if (ftruncate(fd, (off_t)(2 + 6 + 0x10000) * SECT_SIZE) == -1) {
+		err(1, "ftruncate failed");
+	}
+	close(fd);
+	
+	struct jgfs_mkfs_param param = {
+		.label   = "fatbench",
+		.s_total = 0,
+		.s_boot  = 6,
+		.s_per_c = 1,
+	};
+	jgfs_new(argv[1], &param);
+	
+	/* fill every cluster so that nothing matches until the very end */
+	for (uint32_t i = 1; i < jgfs_fs_clusters(); ++i) {
+		jgfs_fat_write(i, (i + 1 < jgfs_fs_clusters() ? i + 1 : FAT_EOF));
+	}
+	
+	const fat_ent_t *ents = (const fat_ent_t *)jgfs.fat;
+	size_t n = JGFS_FENT_PER_S * jgfs.hdr->s_fat;
+	double mib = (double)(ITERATIONS * n * sizeof(fat_ent_t)) / (1 << 20);
+	
+	static uint64_t bits[0x10000 / 64];
+	
+	printf("%zu fat entries, %d iterations\n", n, ITERATIONS);
+	
+	for (int isa = SCAN_SCALAR; isa < SCAN_BEST; ++isa) {
+		if (jgfs_scan_select(isa) != (enum jgfs_scan_isa)isa) {
+			printf("%-8s not supported\n", isa_names[isa]);
+			continue;
+		}
+		
+		size_t sink = 0;
+		double t_find, t_count, t_mask;
+		
+		t_find = now();
+		for (int i = 0; i < ITERATIONS; ++i) {
+			sink += jgfs_scan_find(ents, n, FAT_BAD);
+		}
+		t_find = now() - t_find;
+		
+		t_count = now();
+		for (int i = 0; i < ITERATIONS; ++i) {
+			sink += jgfs_scan_count(ents, n, FAT_EOF);
+		}
+		t_count = now() - t_count;
+		
+		t_mask = now();
+		for (int i = 0; i < ITERATIONS; ++i) {
+			jgfs_scan_mask(ents, n, FAT_FREE, bits);
+			sink += bits[i % (0x10000 / 64)];
+		}
+		t_mask = now() - t_mask;
+		
+		printf("%-8s find %8.0f MiB/s  count %8.0f MiB/s  mask %8.0f MiB/s"
+			"  (%zu)\n", isa_names[isa], mib / t_find, mib / t_count,
+			mib / t_mask, sink);
+	}
+	
+	jgfs_done();
+	
+	return 0;
+}
@@ -0,0 +1,341 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../lib/jgfs.h"
+
+/* check that the journal brings back committed changes whose in-place writes
+ * never made it, and that a torn record is left out, on a scratch image; build
+ * with:
+ * gcc -O2 -include stdbool.h -include stdint.h test/journaltest.c bin/libjgfs.a -lbsd
+ */
+
+#define IMAGE_SIZE (16 << 20)
+
+struct record {
+	uint64_t seq;
+	uint32_t count;
+	uint32_t first; // sector the record starts at
+	uint32_t *sect;
+};
+
+static char *read_image(const char *path) {
+	char *buf;
+	if ((buf = malloc(IMAGE_SIZE)) == NULL) {
+		errx(1, "malloc failed");
+	}
+	
+	int fd;
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		err(1, "open failed");
+	}
+	if (pread(fd, buf, IMAGE_SIZE, 0) != IMAGE_SIZE) {
+		err(1, "pread failed");
+	}
+	close(fd);
+	
+	return buf;
+}
+
+static void write_image(const char *path, const char *buf) {
+	int fd;
+	if ((fd = open(path, O_WRONLY)) == -1) {
+		err(1, "open failed");
+	}
+	if (pwrite(fd, buf, IMAGE_SIZE, 0) != IMAGE_SIZE) {
+		err(1, "pwrite failed");
+	}
+	close(fd);
+}
+
+/* find the record in each half of the journal in image */
+static void read_records(const char *image, struct record rec[2]) {
+	const struct jgfs_hdr *hdr = (const struct jgfs_hdr *)(image + SECT_SIZE);
+	uint32_t jl_first = hdr->s_total - hdr->s_journal;
+	
+	for (int i = 0; i < 2; ++i) {
+		rec[i].first = jl_first + (i * (hdr->s_journal / 2));
+		
+		const struct jgfs_jl_hdr *jl_hdr = (const struct jgfs_jl_hdr *)
+			(image + ((size_t)rec[i].first * SECT_SIZE));
+		if (memcmp(jl_hdr->magic, JGFS_JL_MAGIC, 4) != 0) {
+			errx(1, "no record in half %d of the journal", i);
+		}
+		
+		rec[i].seq   = jl_hdr->seq;
+		rec[i].count = jl_hdr->count;
+		rec[i].sect  = (uint32_t *)(image +
+			((size_t)(rec[i].first + 1) * SECT_SIZE));
+	}
+}
+
+/* put back what every sector logged in either record held before the commits,
+ * as if the crash came before any of the in-place writes */
+static void revert(char *image, const char *before,
+	const struct record rec[2]) {
+	for (int i = 0; i < 2; ++i) {
+		for (uint32_t j = 0; j < rec[i].count; ++j) {
+			size_t off = (size_t)rec[i].sect[j] * SECT_SIZE;
+			memcpy(image + off, before + off, SECT_SIZE);
+		}
+	}
+}
+
+static bool exists(const char *path) {
+	struct jgfs_dir_ent *parent, *child;
+	
+	return jgfs_lookup(path, &parent, &child) == 0;
+}
+
+static void expect(const char *what, const char *path, bool present) {
+	if (exists(path) != present) {
+		errx(1, "%s: %s is %s", what, path, (present ? "missing" : "back"));
+	}
+}
+
+/* make a new file called name in root holding len bytes of c; returns the
+ * cluster it starts at */
+static fat_ent_t write_file(const char *name, char c, size_t len) {
+	struct jgfs_dir_ent *root = &jgfs.hdr->root_dir_ent, *dir_ent;
+	struct iovec iov[JGFS_READ_IOV_MAX(len)];
+	
+	if (jgfs_create_file(root, name) != 0 ||
+		jgfs_lookup_child(name, root, &dir_ent) != 0) {
+		errx(1, "create failed");
+	}
+	
+	int iov_count;
+	if ((iov_count = jgfs_write_iov(dir_ent, NULL, iov, len, 0)) < 0) {
+		errx(1, "write failed");
+	}
+	for (int i = 0; i < iov_count; ++i) {
+		memset(iov[i].iov_base, c, iov[i].iov_len);
+	}
+	jgfs_write_end(dir_ent, 0, iov, iov_count, 0, len);
+	
+	return dir_ent->begin;
+}
+
+/* make a directory called name in root holding a file, commit, then delete
+ * both and commit again; returns the cluster the directory had */
+static fat_ent_t free_dir(const char *name) {
+	struct jgfs_dir_ent *root = &jgfs.hdr->root_dir_ent, *dir_ent, *child;
+	
+	if (jgfs_create_dir(root, name) != 0 ||
+		jgfs_lookup_child(name, root, &dir_ent) != 0 ||
+		jgfs_create_file(dir_ent, "x") != 0 || jgfs_journal_commit() != 0) {
+		errx(1, "mkdir failed");
+	}
+	
+	fat_ent_t clust = dir_ent->begin;
+	
+	if (jgfs_lookup_child("x", dir_ent, &child) != 0 ||
+		jgfs_delete_ent(dir_ent, child, true) != 0 ||
+		jgfs_lookup_child(name, root, &dir_ent) != 0 ||
+		jgfs_delete_ent(root, dir_ent, true) != 0 ||
+		jgfs_journal_commit() != 0) {
+		errx(1, "rmdir failed");
+	}
+	
+	return clust;
+}
+
+/* get the first cluster that would be handed out as free */
+static fat_ent_t first_free(void) {
+	fat_ent_t first;
+	
+	jgfs_lock_fat(false);
+	if (!jgfs_fat_find(FAT_FREE, &first)) {
+		errx(1, "no free clusters");
+	}
+	jgfs_unlock_fat();
+	
+	return first;
+}
+
+/* check that the file at path holds len bytes of c */
+static void expect_file(const char *what, const char *path, char c,
+	size_t len) {
+	struct jgfs_dir_ent *parent, *dir_ent;
+	struct iovec iov[JGFS_READ_IOV_MAX(len)];
+	
+	int iov_count;
+	if (jgfs_lookup(path, &parent, &dir_ent) != 0 || dir_ent->size != len ||
+		(iov_count = jgfs_read_iov(dir_ent, NULL, iov, len, 0)) < 0) {
+		errx(1, "%s: %s is missing or cut short", what, path);
+	}
+	
+	for (int i = 0; i < iov_count; ++i) {
+		for (size_t j = 0; j < iov[i].iov_len; ++j) {
+			if (((char *)iov[i].iov_base)[j] != c) {
+				errx(1, "%s: %s has changed", what, path);
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		errx(1, "usage: journaltest <scratch image>");
+	}
+	
+	int fd;
+	if ((fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		err(1, "open failed");
+	}
+	if (ftruncate(fd, IMAGE_SIZE) == -1) {
+		err(1, "ftruncate failed");
+	}
+	close(fd);
+	
+	struct jgfs_mkfs_param param = {
+		.label     = "journaltest",
+		.s_total   = 0,
+		.s_boot    = 6,
+		.s_per_c   = 8,
+		.s_journal = 1024,
+	};
+	jgfs_new(argv[1], &param);
+	jgfs_done();
+	
+	char *before = read_image(argv[1]);
+	
+	/* two commits: the second renames what the first created, so both records
+	 * log the same root directory sector */
+	jgfs_init(argv[1]);
+	
+	struct jgfs_dir_ent *root = &jgfs.hdr->root_dir_ent, *dir_ent;
+	char name[JGFS_NAME_LIMIT + 1];
+	
+	if (jgfs_create_dir(root, "one") != 0 ||
+		jgfs_lookup_child("one", root, &dir_ent) != 0) {
+		errx(1, "mkdir failed");
+	}
+	for (int i = 0; i < 20; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (jgfs_create_file(dir_ent, name) != 0) {
+			errx(1, "create failed at %d", i);
+		}
+	}
+	if (jgfs_journal_commit() != 0) {
+		errx(1, "first commit failed");
+	}
+	
+	if (jgfs_lookup_child("one", root, &dir_ent) != 0 ||
+		jgfs_move_ent(root, dir_ent, root, "two") != 0 ||
+		jgfs_create_file(root, "three") != 0) {
+		errx(1, "rename failed");
+	}
+	if (jgfs_journal_commit() != 0) {
+		errx(1, "second commit failed");
+	}
+	
+	/* a clean unmount retires the records, so the crash comes before it */
+	char *after = read_image(argv[1]);
+	jgfs_done();
+	
+	struct record rec[2];
+	read_records(after, rec);
+	
+	int newer = (rec[1].seq > rec[0].seq ? 1 : 0);
+	if (rec[newer].seq != rec[!newer].seq + 1) {
+		errx(1, "records are seq %lu and %lu, not one after the other",
+			(unsigned long)rec[0].seq, (unsigned long)rec[1].seq);
+	}
+	printf("records: seq %lu with %u sectors, seq %lu with %u sectors\n",
+		(unsigned long)rec[!newer].seq, rec[!newer].count,
+		(unsigned long)rec[newer].seq, rec[newer].count);
+	
+	/* crash after both commits: replay has to apply the older record without
+	 * its sectors that the newer one logged again */
+	char *image = read_image(argv[1]);
+	memcpy(image, after, IMAGE_SIZE);
+	revert(image, before, rec);
+	write_image(argv[1], image);
+	
+	jgfs_init(argv[1]);
+	expect("replay", "/one", false);
+	expect("replay", "/two", true);
+	expect("replay", "/two/file19", true);
+	expect("replay", "/three", true);
+	jgfs_done();
+	printf("replay of both records: ok\n");
+	
+	/* crash in the middle of writing the second record: its crc doesn't match,
+	 * so only the first commit comes back */
+	memcpy(image, after, IMAGE_SIZE);
+	revert(image, before, rec);
+	image[((size_t)(rec[newer].first + 1 + CEIL(rec[newer].count,
+		SECT_SIZE / sizeof(uint32_t)) + rec[newer].count - 1) * SECT_SIZE) +
+		100] ^= 0x55;
+	write_image(argv[1], image);
+	
+	jgfs_init(argv[1]);
+	expect("torn record", "/one", true);
+	expect("torn record", "/one/file19", true);
+	expect("torn record", "/two", false);
+	expect("torn record", "/three", false);
+	jgfs_done();
+	printf("torn record left out: ok\n");
+	
+	/* a directory's cluster, once freed, may come back as file data, so no
+	 * record still holding the directory may be replayed over it, on this
+	 * mount or the next: it isn't handed out until two more records are
+	 * written, and the records are retired at unmount */
+	jgfs_new(argv[1], &param);
+	jgfs_done();
+	jgfs_init(argv[1]);
+	
+	fat_ent_t clust = free_dir("d");
+	if (first_free() == clust) {
+		errx(1, "reuse: a freed directory cluster is handed out at once");
+	}
+	
+	write_file("f", 'A', 4096);
+	if (jgfs_writeback() != 0) {
+		errx(1, "writeback failed");
+	}
+	jgfs_done();
+	
+	jgfs_init(argv[1]);
+	expect_file("reuse", "/f", 'A', 4096);
+	
+	clust = free_dir("e");
+	for (int i = 0; i < 2; ++i) {
+		snprintf(name, sizeof(name), "g%d", i);
+		if (jgfs_create_file(&jgfs.hdr->root_dir_ent, name) != 0 ||
+			jgfs_journal_commit() != 0) {
+			errx(1, "commit failed");
+		}
+	}
+	if (first_free() != clust) {
+		errx(1, "reuse: a freed directory cluster is never handed out");
+	}
+	
+	write_file("h", 'B', 4096);
+	if (jgfs_writeback() != 0) {
+		errx(1, "writeback failed");
+	}
+	jgfs_done();
+	
+	jgfs_init(argv[1]);
+	expect_file("reuse", "/f", 'A', 4096);
+	expect_file("reuse", "/h", 'B', 4096);
+	jgfs_done();
+	printf("freed directory cluster reused as data: ok\n");
+	
+	free(image);
+	free(after);
+	free(before);
+	
+	return 0;
+}
@@ -0,0 +1,287 @@
+/* jgfs
+ * (c) 2013 Justin Gottula
+ * The source code of this project is distributed under the terms of the
+ * simplified BSD license. See the LICENSE file for details.
+ */
+
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* run concurrent readers and writers against a mounted jgfs; each writer owns
+ * a set of files which it appends to, truncates, renames and deletes, always
+ * writing a fixed pattern, while the readers check every byte they read against
+ * that pattern and list and stat everything in sight; build with:
+ * gcc -O2 -include stdbool.h -include stdint.h test/stress.c -lpthread
+ */
+
+#define WRITERS    4
+#define READERS    4
+#define PER_WRITER 6
+#define FILES      (WRITERS * PER_WRITER)
+#define DIRS       3
+#define MAX_SIZE   (256 * 1024)
+#define MAX_IO     (64 * 1024)
+
+/* what each writer knows about its own files */
+struct file_state {
+	bool     exists;
+	bool     renamed;
+	uint32_t size;
+};
+
+static const char *mount;
+static uint32_t iters;
+
+static struct file_state files[FILES];
+static volatile bool writers_done = false;
+
+
+static uint8_t pattern(int id, uint32_t off) {
+	return (id * 31) + (off * 7) + (off >> 9);
+}
+
+static void file_path(char *path, int id, bool renamed) {
+	sprintf(path, "%s/d%d/%c%d", mount, id % DIRS, (renamed ? 'g' : 'f'), id);
+}
+
+static void do_write(int id, char *path, uint8_t *buf, unsigned *seed) {
+	struct file_state *file = &files[id];
+	
+	uint32_t off = file->size, len = rand_r(seed) % MAX_IO;
+	if (off > 0 && rand_r(seed) % 4 == 0) {
+		off = rand_r(seed) % off;
+	}
+	if (off + len > MAX_SIZE) {
+		return;
+	}
+	
+	for (uint32_t i = 0; i < len; ++i) {
+		buf[i] = pattern(id, off + i);
+	}
+	
+	int fd;
+	if ((fd = open(path, O_WRONLY)) == -1) {
+		err(1, "open %s failed", path);
+	}
+	
+	/* running out of space partway through gives a short write */
+	ssize_t b_written = pwrite(fd, buf, len, off);
+	if (b_written == -1 && errno != ENOSPC) {
+		err(1, "pwrite %s failed", path);
+	} else if (b_written != (ssize_t)len) {
+		/* don't leave a tail of zeroes behind */
+		if (ftruncate(fd, file->size) == -1) {
+			err(1, "ftruncate %s failed", path);
+		}
+	} else if (off + len > file->size) {
+		file->size = off + len;
+	}
+	
+	close(fd);
+}
+
+static void *writer(void *arg) {
+	int n = (intptr_t)arg;
+	unsigned seed = n + 1;
+	
+	uint8_t *buf;
+	if ((buf = malloc(MAX_IO)) == NULL) {
+		err(1, "malloc failed");
+	}
+	
+	char path[256], new_path[256];
+	for (uint32_t i = 0; i < iters; ++i) {
+		int id = (n * PER_WRITER) + (rand_r(&seed) % PER_WRITER);
+		struct file_state *file = &files[id];
+		
+		file_path(path, id, file->renamed);
+		
+		if (!file->exists) {
+			int fd;
+			if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+				if (errno == ENOSPC) {
+					continue;
+				}
+				err(1, "create %s failed", path);
+			}
+			close(fd);
+			
+			file->exists = true;
+			file->size   = 0;
+			continue;
+		}
+		
+		int op = rand_r(&seed) % 20;
+		if (op < 10) {
+			do_write(id, path, buf, &seed);
+		} else if (op < 13) {
+			uint32_t new_size =
+				(file->size != 0 ? rand_r(&seed) % file->size : 0);
+			if (truncate(path, new_size) == -1) {
+				err(1, "truncate %s failed", path);
+			}
+			file->size = new_size;
+		} else if (op < 17) {
+			file_path(new_path, id, !file->renamed);
+			if (rename(path, new_path) == -1) {
+				err(1, "rename %s failed", path);
+			}
+			file->renamed = !file->renamed;
+		} else if (op < 18) {
+			if (unlink(path) == -1) {
+				err(1, "unlink %s failed", path);
+			}
+			file->exists = false;
+		} else {
+			/* churn a directory of our own */
+			sprintf(path, "%s/d%d/s%d", mount, n % DIRS, n);
+			if (mkdir(path, 0755) == -1) {
+				if (errno == ENOSPC) {
+					continue;
+				}
+				err(1, "mkdir %s failed", path);
+			}
+			if (rmdir(path) == -1) {
+				err(1, "rmdir %s failed", path);
+			}
+		}
+	}
+	
+	free(buf);
+	return NULL;
+}
+
+static void *reader(void *arg) {
+	unsigned seed = (intptr_t)arg + 1000;
+	
+	uint8_t *buf;
+	if ((buf = malloc(MAX_IO)) == NULL) {
+		err(1, "malloc failed");
+	}
+	
+	char path[256];
+	while (!writers_done) {
+		int id = rand_r(&seed) % FILES;
+		file_path(path, id, rand_r(&seed) % 2);
+		
+		int op = rand_r(&seed) % 10;
+		if (op < 6) {
+			/* the file may be renamed or deleted out from under us */
+			int fd;
+			if ((fd = open(path, O_RDONLY)) == -1) {
+				if (errno == ENOENT) {
+					continue;
+				}
+				err(1, "open %s failed", path);
+			}
+			
+			uint32_t off = rand_r(&seed) % MAX_SIZE;
+			ssize_t b_read = pread(fd, buf, rand_r(&seed) % MAX_IO, off);
+			if (b_read == -1) {
+				err(1, "pread %s failed", path);
+			}
+			close(fd);
+			
+			for (ssize_t i = 0; i < b_read; ++i) {
+				if (buf[i] != pattern(id, off + i)) {
+					errx(1, "%s: bad data at offset %zd", path, off + i);
+				}
+			}
+		} else if (op < 9) {
+			struct stat st;
+			if (stat(path, &st) == -1 && errno != ENOENT) {
+				err(1, "stat %s failed", path);
+			}
+		} else {
+			sprintf(path, "%s/d%d", mount, id % DIRS);
+			
+			DIR *dir;
+			if ((dir = opendir(path)) == NULL) {
+				err(1, "opendir %s failed", path);
+			}
+			while (readdir(dir) != NULL);
+			closedir(dir);
+		}
+	}
+	
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 3) {
+		errx(1, "usage: stress <mount point> [iterations]");
+	}
+	
+	mount = argv[1];
+	iters = (argc == 3 ? strtoul(argv[2], NULL, 0) : 10000);
+	
+	char path[256];
+	for (int i = 0; i < DIRS; ++i) {
+		sprintf(path, "%s/d%d", mount, i);
+		if (mkdir(path, 0755) == -1) {
+			err(1, "mkdir %s failed", path);
+		}
+	}
+	
+	pthread_t writers[WRITERS], readers[READERS];
+	for (intptr_t i = 0; i < READERS; ++i) {
+		pthread_create(&readers[i], NULL, reader, (void *)i);
+	}
+	for (intptr_t i = 0; i < WRITERS; ++i) {
+		pthread_create(&writers[i], NULL, writer, (void *)i);
+	}
+	
+	for (int i = 0; i < WRITERS; ++i) {
+		pthread_join(writers[i], NULL);
+	}
+	writers_done = true;
+	for (int i = 0; i < READERS; ++i) {
+		pthread_join(readers[i], NULL);
+	}
+	
+	/* with everything quiet, every file should hold exactly what was written */
+	uint8_t *buf;
+	if ((buf = malloc(MAX_SIZE)) == NULL) {
+		err(1, "malloc failed");
+	}
+	
+	for (int id = 0; id < FILES; ++id) {
+		if (!files[id].exists) {
+			continue;
+		}
+		
+		file_path(path, id, files[id].renamed);
+		
+		int fd;
+		if ((fd = open(path, O_RDONLY)) == -1) {
+			err(1, "open %s failed", path);
+		}
+		if (pread(fd, buf, MAX_SIZE, 0) != (ssize_t)files[id].size) {
+			errx(1, "%s: wrong size", path);
+		}
+		close(fd);
+		
+		for (uint32_t i = 0; i < files[id].size; ++i) {
+			if (buf[i] != pattern(id, i)) {
+				errx(1, "%s: bad data at offset %u", path, i);
+			}
+		}
+	}
+	
+	free(buf);
+	
+	printf("ok: %d writers x %u operations, %d readers\n", WRITERS, iters,
+		READERS);
+	
+	return 0;
+}